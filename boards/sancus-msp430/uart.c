@@ -2,11 +2,34 @@
 
 #include "uart.h"
 #include "uart_hardware.h"
+#include "irq.h"
+#include "spsc.h"
+#include "thread.h"
+#include "secure_mintimer.h"
 
+#include <errno.h>
 #include <stdint.h>
+#include <string.h>
 
 #define RX_BUFFER_SIZE 128
 
+// Notification id of the scheduler that readers of an empty ring block on
+#define UART_RX_NOTIFY SPSC_NOTIFY_UART_RX
+
+// How long a reader that cannot block sleeps before it looks again
+#ifndef UART_RX_POLL_US
+#define UART_RX_POLL_US 1000
+#endif
+
+// Size of the transmit ring, writers only wait for the wire once it is full
+#ifndef UART_TX_BUFFER_SIZE
+#define UART_TX_BUFFER_SIZE 128
+#endif
+
+// Bytes copied into the transmit ring per locked section, bounds how long the
+// receive interrupt is held off
+#define TX_LOCKED_COPY 16
+
 // callback that is called for every byte received.
 uart_receive_cb receive_cb;
 
@@ -21,6 +44,19 @@ static volatile size_t rx_head;
 // rx_head, in which case the buffer is empty
 static volatile size_t rx_tail;
 
+// only hand out complete lines, see uart_set_line_mode
+static volatile uint8_t rx_line_mode;
+
+// Transmit ring, filled by writers and drained by the TX interrupt. As for
+// the receive buffer one element is wasted.
+static volatile uint8_t tx_buffer[UART_TX_BUFFER_SIZE];
+
+// index where the next byte to send is written
+static volatile size_t tx_head;
+
+// index of the next byte to hand to the hardware, only moved by uart_tx_fill
+static volatile size_t tx_tail;
+
 static void uart_append_byte(unsigned char);
 
 
@@ -29,6 +65,8 @@ void uart_init(void )
 {
     receive_cb = uart_append_byte;
     rx_head = rx_tail = 0;
+    rx_line_mode = 0;
+    tx_head = tx_tail = 0;
     UART_BAUD = BAUD;
     UART_CTL = UART_EN | UART_IEN_RX;
     UART2_BAUD = BAUD;
@@ -51,40 +89,220 @@ size_t uart_available(void)
         return RX_BUFFER_SIZE + head - tail;
 }
 
-void uart_write_byte(unsigned char b)
+static inline size_t uart_tx_free(void)
 {
-    // wait while TX buffer is full
+    size_t head = tx_head;
+    size_t tail = tx_tail;
+
+    if (head >= tail)
+        return UART_TX_BUFFER_SIZE - 1 - (head - tail);
+    else
+        return tail - head - 1;
+}
+
+static inline int uart_irq_enabled(void)
+{
+    unsigned int sr;
+    __asm__ volatile ("mov.w r2, %0" : "=r"(sr));
+    return sr & GIE;
+}
+
+// Keeps other writers out of the transmit ring. Besides threads these are
+// the receive interrupt, which echoes input. irq_disable() does not mask
+// interrupts for unprotected code on Sancus, so the receive interrupt is
+// masked at the UART as well. The TX interrupt never runs concurrently with a
+// writer's uart_tx_fill, see there.
+static unsigned uart_tx_lock(uint8_t *rx_ien)
+{
+    unsigned state = irq_disable();
+
+    *rx_ien = UART_CTL & UART_IEN_RX;
+    UART_CTL &= ~UART_IEN_RX;
+    return state;
+}
+
+static void uart_tx_unlock(unsigned state, uint8_t rx_ien)
+{
+    UART_CTL |= rx_ien;
+    irq_restore(state);
+}
+
+// Moves bytes from the ring into the hardware buffer while it has room. The
+// TX empty interrupt stays enabled as long as bytes are left, and only then,
+// so this runs either in the ISR or in a locked writer that found the ISR
+// idle.
+static void uart_tx_fill(void)
+{
+    size_t i = tx_tail;
+
+    UART_STAT = UART_TX_EMPTY_PND;
+    while (i != tx_head && !(UART_STAT & UART_TX_FULL)) {
+        UART_TXD = tx_buffer[i];
+        i = (i + 1) % UART_TX_BUFFER_SIZE;
+    }
+    tx_tail = i;
+
+    if (i == tx_head)
+        UART_CTL &= ~UART_IEN_TX_EMPTY;
+    else
+        UART_CTL |= UART_IEN_TX_EMPTY;
+}
+
+// Without interrupts (in an ISR or an SM that masked them) the ring is
+// drained by polling the hardware. The TX interrupt cannot run meanwhile.
+static void uart_tx_poll(void)
+{
+    uint8_t rx_ien;
+
     while (UART_STAT & UART_TX_FULL) {}
+    unsigned state = uart_tx_lock(&rx_ien);
+    uart_tx_fill();
+    uart_tx_unlock(state, rx_ien);
+}
 
-    // write byte to TX buffer
-    UART_TXD = b;
+// Waits for room in the ring, unlocked so that the TX interrupt can drain it
+static void uart_tx_wait(void)
+{
+    while (uart_tx_free() == 0) {
+        if (!uart_irq_enabled())
+            uart_tx_poll();
+    }
+}
+
+// Starts the TX interrupt after new bytes were queued, unless it already
+// runs. Called with the ring locked.
+static inline void uart_tx_start(void)
+{
+    if (!(UART_CTL & UART_IEN_TX_EMPTY))
+        uart_tx_fill();
+}
+
+void uart_write_byte(unsigned char b)
+{
+    uart_write(&b, 1);
 }
 
 void uart_write(const unsigned char* buf, size_t size)
 {
-    while (size--)
-        uart_write_byte(*buf++);
+    while (size) {
+        uint8_t rx_ien;
+
+        uart_tx_wait();
+        unsigned state = uart_tx_lock(&rx_ien);
+
+        // copy the contiguous part up to the end of the ring at once, another
+        // writer may have taken the room since the wait
+        size_t i = tx_head;
+        size_t n = uart_tx_free();
+        if (n > UART_TX_BUFFER_SIZE - i)
+            n = UART_TX_BUFFER_SIZE - i;
+        if (n > size)
+            n = size;
+        if (n > TX_LOCKED_COPY)
+            n = TX_LOCKED_COPY;
+
+        if (n) {
+            memcpy((uint8_t *)&tx_buffer[i], buf, n);
+            tx_head = (i + n) % UART_TX_BUFFER_SIZE;
+            buf += n;
+            size -= n;
+            uart_tx_start();
+        }
+
+        uart_tx_unlock(state, rx_ien);
+    }
 }
 
-unsigned char uart_read_byte(void)
+void uart_set_line_mode(int enable)
+{
+    rx_line_mode = enable;
+}
+
+// Bytes a reader may take now. In line mode only up to the first newline, or
+// everything once the ring is full, as no newline could arrive anymore.
+static size_t uart_rx_ready(void)
 {
+    size_t avail = uart_available();
+
+    if (!rx_line_mode || avail == RX_BUFFER_SIZE - 1)
+        return avail;
+
+    for (size_t n = 0, i = rx_tail; n < avail; n++, i = (i + 1) % RX_BUFFER_SIZE) {
+        if (rx_buffer[i] == '\n')
+            return n + 1;
+    }
+    return 0;
+}
+
+// Blocks in the scheduler until the receive ISR notifies. Readers that
+// cannot block there never spin on the scheduler: a periodic thread ends its
+// job, a second reader sleeps while the first one waits, and before the
+// scheduler runs there is nothing else to do but watch the ring.
+static void uart_rx_wait(void)
+{
+    switch (_spsc_wait(UART_RX_NOTIFY)) {
+        case SPSC_BLOCKED:
+        case 0:
+            thread_yield_higher();
+            break;
+        case -EBUSY:
+            secure_mintimer_usleep(UART_RX_POLL_US);
+            break;
+        case -EINVAL:
+            while (uart_rx_ready() == 0) {}
+            break;
+        default:
+            break;
+    }
+}
+
+size_t uart_read_some(unsigned char* buf, size_t size)
+{
+    size_t n;
+
+    if (size == 0)
+        return 0;
+
+    while ((n = uart_rx_ready()) == 0)
+        uart_rx_wait();
+    if (n > size)
+        n = size;
+
+    // copy the part up to the end of the ring and the wrapped rest
     size_t i = rx_tail;
+    size_t first = RX_BUFFER_SIZE - i;
+    if (first > n)
+        first = n;
+    memcpy(buf, (const uint8_t *)&rx_buffer[i], first);
+    memcpy(buf + first, (const uint8_t *)rx_buffer, n - first);
+    rx_tail = (i + n) % RX_BUFFER_SIZE;
+
+    return n;
+}
 
-    while (i == rx_head) {}
+unsigned char uart_read_byte(void)
+{
+    unsigned char ret;
 
-    uint8_t ret = rx_buffer[i];
-    rx_tail = (i + 1) % RX_BUFFER_SIZE;
+    uart_read_some(&ret, 1);
     return ret;
 }
 
 void uart_read(unsigned char* buf, size_t size)
 {
-    while (size--)
-        *buf++ = uart_read_byte();
+    while (size) {
+        size_t n = uart_read_some(buf, size);
+        buf += n;
+        size -= n;
+    }
 }
 
 void uart_flush(void)
 {
+    while (tx_tail != tx_head) {
+        if (!uart_irq_enabled())
+            uart_tx_poll();
+    }
     while (UART_STAT & UART_TX_BUSY) {}
 }
 
@@ -99,16 +317,55 @@ static void __attribute__((interrupt(UART_RX_VECTOR))) uart_receive(void)
     UART_STAT = UART_RX_PND;
 }
 
+static void __attribute__((interrupt(UART_TX_VECTOR))) uart_transmit(void)
+{
+    // Refill the hardware buffer, this also clears the pending flag
+    uart_tx_fill();
+}
+
+// Drops the last byte of the line that is being typed, unless a reader may
+// already copy it: a complete line or a full ring.
+static void uart_erase_byte(void)
+{
+    size_t i = rx_head;
+    size_t prev = (i + RX_BUFFER_SIZE - 1) % RX_BUFFER_SIZE;
+
+    if (i != rx_tail && rx_buffer[prev] != '\n'
+        && (i + 1) % RX_BUFFER_SIZE != rx_tail) {
+        rx_head = prev;
+        uart_write((const unsigned char *)"\b \b", 3);
+    }
+}
+
 static void uart_append_byte(unsigned char b)
 {
     size_t i = rx_head;
     size_t next_head = (i + 1) % RX_BUFFER_SIZE;
 
+    if (rx_line_mode) {
+        if (b == '\b' || b == 0x7f) {
+            uart_erase_byte();
+            return;
+        }
+        if (b == '\r')
+            b = '\n';
+    }
+
     if (next_head != rx_tail) // drop byte if buffer is full
     {
         rx_buffer[i] = b;
         rx_head = next_head;
+
+        // Only enter the scheduler when a waiting reader could continue: on
+        // the first byte, or in line mode on a complete line or full ring.
+        // The reader runs at the next scheduler entry.
+        if (rx_line_mode ? (b == '\n' || (next_head + 1) % RX_BUFFER_SIZE == rx_tail)
+                         : i == rx_tail)
+            spsc_notify(UART_RX_NOTIFY);
     }
+
+    if (rx_line_mode && b == '\n')
+        uart_write_byte('\r');
     uart_write_byte(b);
 }
 
@@ -1,87 +1,152 @@
-// /*
-//  * Copyright (C) 2016 Sam Kumar <samkumar@berkeley.edu>
-//  *               2016 University of California, Berkeley
-//  *
-//  * This file is subject to the terms and conditions of the GNU Lesser
-//  * General Public License v2.1. See the file LICENSE in the top level
-//  * directory for more details.
-//  */
-
-// /**
-//  * @ingroup     core_sync
-//  * @{
-//  *
-//  * @file
-//  * @brief       Kernel condition variable implementation
-//  *
-//  * @author      Sam Kumar <samkumar@berkeley.edu>
-//  *
-//  * @}
-//  */
-
-// #include "cond.h"
-// #include "irq.h"
-// #include "mutex.h"
-// #include "thread.h"
-
-// #define ENABLE_DEBUG    (0)
-// #include "debug.h"
-
-// void cond_init(cond_t *cond)
-// {
-//     cond->queue.next = NULL;
-// }
-
-// void cond_wait(cond_t *cond, mutex_t *mutex)
-// {
-//     unsigned irqstate = irq_disable();
-//     thread_t *me = (thread_t *)sched_active_thread;
-
-//     mutex_unlock(mutex);
-//     sched_set_status(me, STATUS_COND_BLOCKED);
-//     thread_add_to_list(&cond->queue, me);
-//     irq_restore(irqstate);
-//     thread_yield_higher();
-
-//     /*
-//      * Once we reach this point, the condition variable was signalled,
-//      * and we are free to continue.
-//      */
-//     mutex_lock(mutex);
-// }
-
-// static void _cond_signal(cond_t *cond, bool broadcast)
-// {
-//     unsigned irqstate = irq_disable();
-//     list_node_t *next;
-
-//     uint16_t min_prio = THREAD_PRIORITY_MIN + 1;
-
-//     while ((next = list_remove_head(&cond->queue)) != NULL) {
-//         thread_t *process = container_of((clist_node_t *)next, thread_t, rq_entry);
-//         sched_set_status(process, STATUS_PENDING);
-//         uint16_t process_priority = process->priority;
-//         if (process_priority < min_prio) {
-//             min_prio = process_priority;
-//         }
-
-//         if (!broadcast) {
-//             break;
-//         }
-//     }
-
-//     irq_restore(irqstate);
-//     if (min_prio <= THREAD_PRIORITY_MIN) {
-//         sched_switch(min_prio);
-//     }
-// }
-
-// void cond_signal(cond_t *cond)
-// {
-//     _cond_signal(cond, false);
-// }
-
-// void cond_broadcast(cond_t *cond)
-// {
-//     _cond_signal(cond, true);
-// }
+/*
+ * Copyright (C) 2016 Sam Kumar <samkumar@berkeley.edu>
+ *               2016 University of California, Berkeley
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     core_sync
+ * @{
+ *
+ * @file
+ * @brief       Kernel condition variable implementation
+ *
+ * @author      Sam Kumar <samkumar@berkeley.edu>
+ *
+ * @}
+ */
+
+#include <errno.h>
+
+#include "cond.h"
+#include "mutex.h"
+#include "sched.h"
+#include "thread.h"
+
+#define ENABLE_DEBUG    (0)
+#include "debug.h"
+
+// Condition variables of unprotected code and SMs
+SM_DATA(sancus_sm_timer) static cond_t cond_pool[COND_NUMOF];
+
+void SM_FUNC(sancus_sm_timer) cond_wait(cond_t *cond, mutex_t *mutex)
+{
+    thread_t *me = (thread_t *)sched_active_thread;
+
+    // Periodic threads are released by the timer, a yield ends their job
+    if (me == NULL || me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        return;
+    }
+
+    mutex_unlock(mutex);
+    sched_set_status(me, STATUS_COND_BLOCKED);
+    thread_add_to_list(&cond->queue, me);
+    thread_yield_higher();
+
+    /*
+     * Once we reach this point, the condition variable was signalled,
+     * and we are free to continue.
+     */
+    mutex_lock(mutex);
+}
+
+static void SM_FUNC(sancus_sm_timer) _cond_signal(cond_t *cond, bool broadcast)
+{
+    list_node_t *next;
+
+    uint16_t min_prio = THREAD_PRIORITY_MIN + 1;
+
+    // The queue is sorted by priority, the head is the most urgent waiter
+    while ((next = list_remove_head(&cond->queue)) != NULL) {
+        thread_t *process = container_of((clist_node_t *)next, thread_t, rq_entry);
+        sched_set_status(process, STATUS_PENDING);
+        uint16_t process_priority = process->priority;
+        if (process_priority < min_prio) {
+            min_prio = process_priority;
+        }
+
+        if (!broadcast) {
+            break;
+        }
+    }
+
+    // A single switch request for all woken threads, like mutex_unlock()
+    if (min_prio <= THREAD_PRIORITY_MIN && sched_active_thread != NULL) {
+        sched_switch_internal_allow_yield(min_prio, false);
+    }
+}
+
+void SM_FUNC(sancus_sm_timer) cond_signal(cond_t *cond)
+{
+    _cond_signal(cond, false);
+}
+
+void SM_FUNC(sancus_sm_timer) cond_broadcast(cond_t *cond)
+{
+    _cond_signal(cond, true);
+}
+
+int SM_ENTRY(sancus_sm_timer) _cond_wait_id(unsigned cond, unsigned mutex)
+{
+    thread_t *me = (thread_t *)sched_active_thread;
+    mutex_t *m = mutex_get(mutex);
+
+    if (me == NULL || me->status != STATUS_RUNNING || cond >= COND_NUMOF || m == NULL) {
+        return -EINVAL;
+    }
+    if (m->queue.next == NULL || m->owner != me->pid) {
+        return -EPERM;
+    }
+
+    // Periodic threads are released by the timer, they keep the mutex
+    if (me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        return 0;
+    }
+
+    mutex_unlock(m);
+    sched_set_status(me, STATUS_COND_BLOCKED);
+    thread_add_to_list(&cond_pool[cond].queue, me);
+    return COND_BLOCKED;
+}
+
+int SM_ENTRY(sancus_sm_timer) _cond_signal_id(unsigned cond, int broadcast)
+{
+    if (sched_active_thread == NULL || cond >= COND_NUMOF) {
+        return -EINVAL;
+    }
+
+    _cond_signal(&cond_pool[cond], broadcast);
+    return sched_context_switch_request ? COND_YIELD : 1;
+}
+
+int cond_wait_id(unsigned cond, unsigned mutex)
+{
+    int res = _cond_wait_id(cond, mutex);
+    if (res == COND_BLOCKED) {
+        thread_yield_higher();
+        return mutex_lock_id(mutex);
+    }
+    return res < 0 ? res : 1;
+}
+
+static int _cond_signal_finish(int res)
+{
+    if (res == COND_YIELD) {
+        thread_yield_higher();
+        return 1;
+    }
+    return res;
+}
+
+int cond_signal_id(unsigned cond)
+{
+    return _cond_signal_finish(_cond_signal_id(cond, 0));
+}
+
+int cond_broadcast_id(unsigned cond)
+{
+    return _cond_signal_finish(_cond_signal_id(cond, 1));
+}
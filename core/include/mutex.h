@@ -22,11 +22,13 @@
 #ifndef mutex_H
 #define mutex_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include "sancus_helpers.h"
 #include "sancus_modules.h"
 
 #include "list.h"
+#include "kernel_types.h"
 
 #ifdef __cplusplus
  extern "C" {
@@ -35,13 +37,23 @@
 /**
  * @brief Mutex structure. Must never be modified by the user.
  */
-typedef struct {
+typedef struct mutex {
     /**
      * @brief   The process waiting queue of the mutex. **Must never be changed
      *          by the user.**
      * @internal
      */
     list_node_t queue;
+    /**
+     * @brief   Thread holding the mutex, KERNEL_PID_UNDEF if unknown
+     * @internal
+     */
+    kernel_pid_t owner;
+    /**
+     * @brief   Next mutex held by the same owner, see thread_t::mutex_held
+     * @internal
+     */
+    struct mutex *next_held;
 } mutex_t;
 
 /**
@@ -65,6 +77,26 @@ typedef struct {
  * @endcond
  */
 
+/**
+ * @def MUTEX_NUMOF
+ * @brief Number of mutexes the scheduler keeps for unprotected code and SMs
+ *
+ * These can not use a mutex_t of their own, the scheduler does not trust
+ * memory outside of it. They lock one of these by its id instead, see
+ * mutex_lock_id().
+ */
+#ifndef MUTEX_NUMOF
+#define MUTEX_NUMOF (4)
+#endif
+
+/**
+ * @name Return values of the scheduler side mutex calls
+ * @{
+ */
+#define MUTEX_YIELD     (2)     /**< done, a higher priority thread was woken */
+#define MUTEX_BLOCKED   (3)     /**< the caller is blocked and has to yield */
+/** @} */
+
 /**
  * @brief Initializes a mutex object.
  * @details For initialization of variables use mutex_INIT instead.
@@ -74,6 +106,8 @@ typedef struct {
 static inline void SM_FUNC(sancus_sm_timer) mutex_init(mutex_t *mutex)
 {
     mutex->queue.next = NULL;
+    mutex->owner = KERNEL_PID_UNDEF;
+    mutex->next_held = NULL;
 }
 
 /**
@@ -82,6 +116,16 @@ static inline void SM_FUNC(sancus_sm_timer) mutex_init(mutex_t *mutex)
  * @details For commit purposes you should probably use mutex_trylock() and
  *          mutex_lock() instead.
  *
+ *          A thread that blocks lends its priority to the owner until the
+ *          owner unlocks (priority inheritance), so threads between the two
+ *          can not delay it indefinitely. Periodic waiters lend the highest
+ *          level below SCHED_PERIODIC_PRIO_LEVEL. The owner runs with the
+ *          highest priority lent by the first waiters of all mutexes it
+ *          holds, or its thread_t::base_priority if that is higher. If the
+ *          owner waits on a mutex itself, the priority is passed on along the
+ *          chain of owners, so a blocked thread waits at most for the critical
+ *          sections of the threads in its chain.
+ *
  * @param[in] mutex         Mutex object to lock. Has to be initialized first.
  *                          Must not be NULL.
  * @param[in] blocking      if true, block until mutex is available.
@@ -91,6 +135,18 @@ static inline void SM_FUNC(sancus_sm_timer) mutex_init(mutex_t *mutex)
  */
 int SM_FUNC(sancus_sm_timer) _mutex_lock(mutex_t *mutex, int blocking);
 
+/**
+ * @brief Locks @p mutex for @p me, or queues @p me if @p blocking (internal)
+ *
+ * Does not yield, @p me has to once MUTEX_BLOCKED is returned. It owns the
+ * mutex when it runs again.
+ *
+ * @return 1 if the mutex is locked for @p me now
+ * @return 0 if the mutex was locked and @p blocking is false
+ * @return MUTEX_BLOCKED if @p me was queued
+ */
+int SM_FUNC(sancus_sm_timer) _mutex_lock_internal(mutex_t *mutex, thread_t *me, int blocking);
+
 /**
  * @brief Tries to get a mutex, non-blocking.
  *
@@ -122,6 +178,30 @@ static inline void SM_FUNC(sancus_sm_timer) mutex_lock(mutex_t *mutex)
  */
 void SM_FUNC(sancus_sm_timer) mutex_unlock(mutex_t *mutex);
 
+/**
+ * @brief Recomputes the priority of @p thread from its base priority and the
+ *        waiters of all mutexes it holds (internal)
+ *
+ * If it changes while @p thread waits on a mutex, @p thread is requeued there
+ * and the owner of that mutex is updated as well, and so on.
+ */
+void SM_FUNC(sancus_sm_timer) mutex_update_priority(thread_t *thread);
+
+/**
+ * @brief Takes @p thread out of the queue of @p mutex without handing it the
+ *        mutex, e.g. on a timeout (internal)
+ *
+ * The owner loses the priority @p thread lent it.
+ *
+ * @return true, if @p thread was queued on @p mutex
+ */
+bool SM_FUNC(sancus_sm_timer) mutex_remove_waiter(mutex_t *mutex, thread_t *thread);
+
+/**
+ * @brief Unlocks all mutexes an exiting thread still holds (internal)
+ */
+void SM_FUNC(sancus_sm_timer) mutex_thread_exit(thread_t *thread);
+
 /**
  * @brief Unlocks the mutex and sends the current thread to sleep
  *
@@ -129,6 +209,64 @@ void SM_FUNC(sancus_sm_timer) mutex_unlock(mutex_t *mutex);
  */
 void SM_FUNC(sancus_sm_timer) mutex_unlock_and_sleep(mutex_t *mutex);
 
+/**
+ * @brief Locks the scheduler mutex @p id, blocking.
+ *
+ * The counterpart of mutex_lock() for unprotected code. SMs use
+ * ___MACRO_MUTEX_LOCK_FROM_SM() instead. Periodic threads can not block, they
+ * only get the mutex if it is free.
+ *
+ * @param[in] id    Mutex to lock, below MUTEX_NUMOF
+ *
+ * @return 1 if the mutex is locked now
+ * @return 0 if the caller is periodic and the mutex was locked
+ * @return -EINVAL if @p id is invalid
+ * @return -EDEADLK if the caller already holds the mutex
+ */
+int mutex_lock_id(unsigned id);
+
+/**
+ * @brief Tries to lock the scheduler mutex @p id, non-blocking.
+ *
+ * @param[in] id    Mutex to lock, below MUTEX_NUMOF
+ *
+ * @return 1 if the mutex was unlocked, now it is locked.
+ * @return 0 if the mutex was locked.
+ * @return -EINVAL if @p id is invalid
+ * @return -EDEADLK if the caller already holds the mutex
+ */
+int mutex_trylock_id(unsigned id);
+
+/**
+ * @brief Unlocks the scheduler mutex @p id.
+ *
+ * @param[in] id    Mutex to unlock, below MUTEX_NUMOF
+ *
+ * @return 1 on success
+ * @return -EINVAL if @p id is invalid
+ * @return -EPERM if the caller does not hold the mutex
+ */
+int mutex_unlock_id(unsigned id);
+
+/**
+ * @name Scheduler side of the mutex calls
+ *
+ * These do not yield themselves. They return MUTEX_YIELD if the caller should
+ * yield because it woke a higher priority thread, and MUTEX_BLOCKED if it has
+ * been blocked and must yield before it calls _mutex_wait(). Use the
+ * functions above or the SM macros instead.
+ * @{
+ */
+int SM_ENTRY(sancus_sm_timer) _mutex_lock_id(unsigned id, int blocking);
+int SM_ENTRY(sancus_sm_timer) _mutex_wait(unsigned id);
+int SM_ENTRY(sancus_sm_timer) _mutex_unlock_id(unsigned id);
+/** @} */
+
+/**
+ * @brief Returns the scheduler mutex @p id, NULL if invalid (internal)
+ */
+mutex_t* SM_FUNC(sancus_sm_timer) mutex_get(unsigned id);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,117 +1,181 @@
-// /*
-//  * Copyright (C) 2016 Theobroma Systems Design & Consulting GmbH
-//  *
-//  * This file is subject to the terms and conditions of the GNU Lesser
-//  * General Public License v2.1. See the file LICENSE in the top level
-//  * directory for more details.
-//  */
-
-// /**
-//  * @defgroup    core_sync_rmutex Recursive Mutex
-//  * @ingroup     core_sync
-//  * @brief       Recursive Mutex for thread synchronization
-//  *
-//  * @{
-//  *
-//  * @file
-//  * @brief       Recursive Mutex for thread synchronization
-//  *
-//  * @author      Martin Elshuber <martin.elshuber@theobroma-systems.com>
-//  *
-//  */
-
-// #ifndef RMUTEX_H
-// #define RMUTEX_H
-
-// #include <stdint.h>
-// #ifdef __cplusplus
-// #include "c11_atomics_compat.hpp"
-// #else
-// #include <stdatomic.h>
-// #endif
-
-// #include "mutex.h"
-// #include "kernel_types.h"
-
-// #ifdef __cplusplus
-//  extern "C" {
-// #endif
-
-// /**
-//  * @brief Mutex structure. Must never be modified by the user.
-//  */
-// typedef struct rmutex_t {
-//     /* fields are managed by mutex functions, don't touch */
-//     /**
-//      * @brief The mutex used for locking. **Must never be changed by
-//      *        the user.**
-//      * @internal
-//      */
-//     mutex_t mutex;
-
-//     /**
-//      * @brief   Number of locks owned by the thread owner
-//      * @internal
-//      */
-//     uint16_t refcount;
-
-//     /**
-//      * @brief   Owner thread of the mutex.
-//      * @details Owner is written by the mutex holder, and read
-//      *          concurrently to ensure consistency,
-//      *          atomic_int_least16_t is used. Note @ref kernel_pid_t is an int16
-//      * @internal
-//      */
-//     atomic_int_least16_t owner;
-// } rmutex_t;
-
-// /**
-//  * @brief Static initializer for rmutex_t.
-//  * @details This initializer is preferable to rmutex_init().
-//  */
-// #define RMUTEX_INIT { MUTEX_INIT, 0, ATOMIC_VAR_INIT(KERNEL_PID_UNDEF) }
-
-// /**
-//  * @brief Initializes a recursive mutex object.
-//  * @details For initialization of variables use RMUTEX_INIT instead.
-//  *          Only use the function call for dynamically allocated mutexes.
-//  * @param[out] rmutex    pre-allocated mutex structure, must not be NULL.
-//  */
-// static inline void rmutex_init(rmutex_t *rmutex)
-// {
-//     rmutex_t empty_rmutex = RMUTEX_INIT;
-//     *rmutex = empty_rmutex;
-// }
-
-// /**
-//  * @brief Tries to get a recursive mutex, non-blocking.
-//  *
-//  * @param[in] rmutex Recursive mutex object to lock. Has to be
-//  *                  initialized first. Must not be NULL.
-//  *
-//  * @return 1 if mutex was unlocked, now it is locked.
-//  * @return 0 if the mutex was locked.
-//  */
-// int rmutex_trylock(rmutex_t *rmutex);
-
-// /**
-//  * @brief Locks a recursive mutex, blocking.
-//  *
-//  * @param[in] rmutex Recursive mutex object to lock. Has to be
-//  *                 initialized first. Must not be NULL.
-//  */
-// void rmutex_lock(rmutex_t *rmutex);
-
-// /**
-//  * @brief Unlocks the recursive mutex.
-//  *
-//  * @param[in] rmutex Recursive mutex object to unlock, must not be NULL.
-//  */
-// void rmutex_unlock(rmutex_t *rmutex);
-
-// #ifdef __cplusplus
-// }
-// #endif
-
-// #endif /* RMUTEX_H */
-// /** @} */
+/*
+ * Copyright (C) 2016 Theobroma Systems Design & Consulting GmbH
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @defgroup    core_sync_rmutex Recursive Mutex
+ * @ingroup     core_sync
+ * @brief       Recursive Mutex for thread synchronization
+ *
+ * A recursive mutex wraps a @ref mutex_t, so it belongs to the scheduler
+ * enclave as well and waiters queue on the mutex by priority, inheriting
+ * priorities as described there. The owner may lock it again, it is released
+ * after as many unlocks as locks.
+ *
+ * @{
+ *
+ * @file
+ * @brief       Recursive Mutex for thread synchronization
+ *
+ * @author      Martin Elshuber <martin.elshuber@theobroma-systems.com>
+ *
+ */
+
+#ifndef RMUTEX_H
+#define RMUTEX_H
+
+#include <stdint.h>
+
+#include "mutex.h"
+#include "kernel_types.h"
+#include "sancus_modules.h"
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/**
+ * @brief Mutex structure. Must never be modified by the user.
+ */
+typedef struct rmutex_t {
+    /* fields are managed by mutex functions, don't touch */
+    /**
+     * @brief The mutex used for locking. **Must never be changed by
+     *        the user.**
+     * @internal
+     */
+    mutex_t mutex;
+
+    /**
+     * @brief   Number of locks owned by the thread owner
+     * @internal
+     */
+    uint16_t refcount;
+
+    /**
+     * @brief   Owner thread of the mutex.
+     * @details Only the scheduler touches it, which runs atomically, so no
+     *          atomic type is needed.
+     * @internal
+     */
+    kernel_pid_t owner;
+} rmutex_t;
+
+/**
+ * @def RMUTEX_NUMOF
+ * @brief Number of recursive mutexes the scheduler keeps for unprotected code
+ *        and SMs, see rmutex_lock_id()
+ */
+#ifndef RMUTEX_NUMOF
+#define RMUTEX_NUMOF (2)
+#endif
+
+/**
+ * @brief Static initializer for rmutex_t.
+ * @details This initializer is preferable to rmutex_init().
+ */
+#define RMUTEX_INIT { mutex_INIT, 0, KERNEL_PID_UNDEF }
+
+/**
+ * @brief Initializes a recursive mutex object.
+ * @details For initialization of variables use RMUTEX_INIT instead.
+ *          Only use the function call for dynamically allocated mutexes.
+ * @param[out] rmutex    pre-allocated mutex structure, must not be NULL.
+ */
+static inline void SM_FUNC(sancus_sm_timer) rmutex_init(rmutex_t *rmutex)
+{
+    mutex_init(&rmutex->mutex);
+    rmutex->refcount = 0;
+    rmutex->owner = KERNEL_PID_UNDEF;
+}
+
+/**
+ * @brief Tries to get a recursive mutex, non-blocking.
+ *
+ * @param[in] rmutex Recursive mutex object to lock. Has to be
+ *                  initialized first. Must not be NULL.
+ *
+ * @return 1 if mutex was unlocked, now it is locked.
+ * @return 0 if the mutex was locked.
+ */
+int SM_FUNC(sancus_sm_timer) rmutex_trylock(rmutex_t *rmutex);
+
+/**
+ * @brief Locks a recursive mutex, blocking.
+ *
+ * @param[in] rmutex Recursive mutex object to lock. Has to be
+ *                 initialized first. Must not be NULL.
+ */
+void SM_FUNC(sancus_sm_timer) rmutex_lock(rmutex_t *rmutex);
+
+/**
+ * @brief Unlocks the recursive mutex.
+ *
+ * Calls by a thread that does not own it are ignored.
+ *
+ * @param[in] rmutex Recursive mutex object to unlock, must not be NULL.
+ */
+void SM_FUNC(sancus_sm_timer) rmutex_unlock(rmutex_t *rmutex);
+
+/**
+ * @brief Locks the scheduler recursive mutex @p id, blocking.
+ *
+ * The counterpart of rmutex_lock() for unprotected code, SMs use
+ * ___MACRO_RMUTEX_LOCK_FROM_SM() instead. Periodic threads can not block,
+ * they only get the mutex if it is free or already theirs.
+ *
+ * @param[in] id    Recursive mutex to lock, below RMUTEX_NUMOF
+ *
+ * @return 1 if the mutex is locked now
+ * @return 0 if the caller is periodic and another thread holds the mutex
+ * @return -EINVAL if @p id is invalid
+ * @return -EOVERFLOW if the caller locked it too often
+ */
+int rmutex_lock_id(unsigned id);
+
+/**
+ * @brief Tries to lock the scheduler recursive mutex @p id, non-blocking.
+ *
+ * @param[in] id    Recursive mutex to lock, below RMUTEX_NUMOF
+ *
+ * @return 1 if the mutex is locked now
+ * @return 0 if another thread holds the mutex
+ * @return -EINVAL if @p id is invalid
+ * @return -EOVERFLOW if the caller locked it too often
+ */
+int rmutex_trylock_id(unsigned id);
+
+/**
+ * @brief Unlocks the scheduler recursive mutex @p id once.
+ *
+ * @param[in] id    Recursive mutex to unlock, below RMUTEX_NUMOF
+ *
+ * @return 1 on success
+ * @return -EINVAL if @p id is invalid
+ * @return -EPERM if the caller does not hold the mutex
+ */
+int rmutex_unlock_id(unsigned id);
+
+/**
+ * @name Scheduler side of the recursive mutex calls
+ *
+ * These do not yield themselves and return the MUTEX_YIELD and MUTEX_BLOCKED
+ * codes of mutex.h. After MUTEX_BLOCKED the caller has to yield and call
+ * _rmutex_lock_id() again, which then takes over the mutex it was handed. Use
+ * the functions above or the SM macros instead.
+ * @{
+ */
+int SM_ENTRY(sancus_sm_timer) _rmutex_lock_id(unsigned id, int blocking);
+int SM_ENTRY(sancus_sm_timer) _rmutex_unlock_id(unsigned id);
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RMUTEX_H */
+/** @} */
@@ -86,6 +86,9 @@
 #include "kernel_types.h"
 #include "native_sched.h"
 #include "clist.h"
+#include "list.h"
+#include "cib.h"
+#include "msg.h"
 #include "sancus_modules.h"
 #include "stdbool.h"
 
@@ -109,6 +112,7 @@ typedef enum {
     STATUS_FLAG_BLOCKED_ALL,        /**< waiting for all flags in flag_mask   */
     STATUS_MBOX_BLOCKED,            /**< waiting for get/put on mbox          */
     STATUS_COND_BLOCKED,            /**< waiting for a condition variable     */
+    STATUS_CHAN_BLOCKED,            /**< waiting for data on a spsc channel   */
     STATUS_RUNNING,                 /**< currently running                    */
     STATUS_PENDING,                 /**< waiting to be scheduled to run       */
     STATUS_NUMOF                    /**< number of supported thread states    */
@@ -132,11 +136,14 @@ struct _thread {
 
     kernel_pid_t pid;               /**< thread's process id            */
 
-// #if defined(MODULE_CORE_THREAD_FLAGS) || defined(DOXYGEN)
-//     thread_flags_t flags;           /**< currently set flags            */
-// #endif
+#if defined(MODULE_CORE_THREAD_FLAGS) || defined(DOXYGEN)
+    uint16_t flags;                 /**< currently set flags, a
+                                         thread_flags_t                 */
+#endif
 
     clist_node_t rq_entry;          /**< run queue entry                */
+    clist_node_t *rq_prev;          /**< previous run queue entry, only
+                                         valid while on a run queue     */
     bool in_use; /** Marks a thread struct as used. Only used by sm scheduler **/
     char *sm_entry; /* SM entry address used solely for sms. */
 
@@ -144,24 +151,35 @@ struct _thread {
     // To keep track, we also store the last reference point if we get interrupted anyway and how much of the current period has already been run
     uint32_t period;
     uint32_t runtime;
-    uint32_t last_reference;
-    uint32_t last_runtime;
+    uint32_t utilisation;           /**< utilisation reserved at admission,
+                                         see SCHED_PERIODIC_UTIL_SCALE  */
+    uint64_t last_reference;        /**< release of the current job, 64 bit secure_mintimer time */
+    uint32_t last_runtime;          /**< time the current job has executed */
+    uint32_t last_dispatch;         /**< low 32 bit of the secure_mintimer time
+                                         the job was last switched in */
     entry_idx original_idx;
 
-// #if defined(MODULE_CORE_MSG) || defined(MODULE_CORE_THREAD_FLAGS) \
-//     || defined(MODULE_CORE_MBOX) || defined(DOXYGEN)
-//     void *wait_data;                /**< used by msg, mbox and thread
-//                                          flags                          */
-// #endif
-// #if defined(MODULE_CORE_MSG) || defined(DOXYGEN)
-//     list_node_t msg_waiters;        /**< threads waiting for their message
-//                                          to be delivered to this thread
-//                                          (i.e. all blocked sends)       */
-//     cib_t msg_queue;                /**< index of this [thread's message queue]
-//                                          (thread_t::msg_array), if any  */
-//     msg_t *msg_array;               /**< memory holding messages sent
-//                                          to this thread's message queue */
-// #endif
+#if defined(MODULE_CORE_THREAD_FLAGS) || defined(DOXYGEN)
+    uint16_t wait_flags;            /**< flags a blocked thread waits for */
+#endif
+#if defined(MODULE_CORE_MSG) || defined(DOXYGEN)
+    list_node_t msg_waiters;        /**< threads waiting for their message
+                                         to be delivered to this thread
+                                         (i.e. all blocked sends)       */
+    cib_t msg_queue;                /**< index of this [thread's message queue]
+                                         (thread_t::msg_array), if any  */
+    msg_t *msg_array;               /**< part of the scheduler's message pool
+                                         holding this thread's queue    */
+    msg_t msg_slot;                 /**< message handed over directly, or the
+                                         message of a blocked send      */
+    uint8_t msg_slot_state;         /**< what msg_slot holds, see msg.c */
+    kernel_pid_t msg_peer;          /**< target of a blocked send       */
+#endif
+    uint8_t base_priority;          /**< priority without the ones lent
+                                         by mutex waiters               */
+    struct mutex *mutex_held;       /**< mutexes this thread owns, linked
+                                         by mutex_t::next_held          */
+    struct mutex *mutex_wait;       /**< mutex this thread is queued on */
 // #if defined(DEVELHELP) || defined(SCHED_TEST_STACK) \
 //     || defined(MODULE_MPU_STACK_GUARD) || defined(DOXYGEN)
 //     char *stack_start;              /**< thread's stack start address   */
@@ -177,8 +195,10 @@ struct _thread {
 
 
 /**
- * Defines the scheduler overhead until the sched_run function. Used to calculate 
- * overheads and remaining runtimes of the periodic functions.
+ * Defines the scheduler overhead until the sched_run function. The admission
+ * test reserves it on top of the runtime of every periodic job, the budget of
+ * a job only counts the time the job itself executes.
+ * Can be generated from measurements with examples/wcet.
 */
 #ifndef SCHEDULER_OVERHEAD_RUN
 #define SCHEDULER_OVERHEAD_RUN 300
@@ -221,6 +241,97 @@ typedef struct _thread thread_t;
 #define SCHED_PERIODIC_PRIO_LEVEL 1
 #endif
 
+/**
+ * @def SCHED_PERIODIC_UTIL_SCALE
+ * @brief Fixed point scale for the utilisation of periodic threads
+ * Periodic threads are scheduled earliest deadline first, so their total
+ * utilisation (runtime plus SCHEDULER_OVERHEAD_RUN over period) may be at
+ * most this value, which stands for 100% of the CPU.
+ */
+#ifndef SCHED_PERIODIC_UTIL_SCALE
+#define SCHED_PERIODIC_UTIL_SCALE (1ul << 15)
+#endif
+
+/**
+ * @def SCHED_PERIODIC_DOWNGRADE
+ * @brief Define to admit periodic threads that do not fit with a lower runtime
+ * By default, thread_change_to_periodical rejects such threads.
+ */
+
+/**
+ * @def SCHED_TICKLESS_IDLE
+ * @brief Define to let the idle thread sleep in a low-power mode
+ * pm_set_lowest() then parks the calling thread in the scheduler, which keeps
+ * it in the deepest mode whose wake latency fits the distance to the next
+ * timer. Interrupts that do not make another thread runnable (such as the
+ * overflows of the low-level timer) return straight into that mode.
+ */
+
+/**
+ * @def SCHED_IDLE_LPM0_LATENCY
+ * @brief Wake latency of LPM0 (CPUOFF) in secure_mintimer ticks
+ */
+#ifndef SCHED_IDLE_LPM0_LATENCY
+#define SCHED_IDLE_LPM0_LATENCY 0
+#endif
+
+/**
+ * @def SCHED_IDLE_LPM1_LATENCY
+ * @brief Wake latency of LPM1 (CPUOFF, SCG0) in secure_mintimer ticks
+ */
+#ifndef SCHED_IDLE_LPM1_LATENCY
+#define SCHED_IDLE_LPM1_LATENCY 16
+#endif
+
+/**
+ * @def SCHED_IDLE_STOP_TIMER
+ * @brief Define to allow LPM3 (CPUOFF, SCG0, SCG1) when no timer is armed
+ * This stops SMCLK and with it the secure_mintimer, so time does not advance
+ * until an external interrupt wakes the CPU.
+ */
+
+/**
+ * @def SCHED_IDLE_LPM3_LATENCY
+ * @brief Wake latency of LPM3 in secure_mintimer ticks
+ */
+#ifndef SCHED_IDLE_LPM3_LATENCY
+#define SCHED_IDLE_LPM3_LATENCY 256
+#endif
+
+/**
+ * @def SCHED_ACCOUNTING
+ * @brief Define to account CPU time and switches per thread
+ * The counters are kept inside the scheduler and can be read with
+ * sched_stats_snapshot(). Without this define, no code is added to
+ * sched_run_internal().
+ */
+
+/**
+ * @def SCHED_TRACE
+ * @brief Define to record scheduler events in a trace ring
+ * Switches, wakeups, timer expiries, exhausted budgets and violations are
+ * recorded with their time inside the scheduler. sched_trace_drain() copies
+ * them out, dist/tools/sched_trace turns them into a Chrome trace.
+ */
+
+/**
+ * @def SCHED_TRACE_SIZE
+ * @brief Number of records in the trace ring, a power of two of at most 256
+ * When the ring is full, the oldest record is overwritten.
+ */
+#ifndef SCHED_TRACE_SIZE
+#define SCHED_TRACE_SIZE 32
+#endif
+
+/**
+ * @def SCHED_WCET
+ * @brief Define to measure the longest run of every path through the scheduler
+ * Each exitless_entry function type and each combination of timer channels
+ * handled by the timer ISR is timed from its first instruction until the
+ * context restore. sched_wcet_snapshot() copies the maxima out, see
+ * examples/wcet. Build with a clock divider of 1 to measure in cycles.
+ */
+
 /**
  * @def SCHED_MAX_PRIO_LEVEL_UNPROTECTED
  * @brief The max prio level that an unprotected thread can get
@@ -252,6 +363,68 @@ int SM_FUNC(sancus_sm_timer) sched_run_internal(void); // Can be used from insid
  */
 void SM_FUNC(sancus_sm_timer) sched_set_status(thread_t *process, thread_status_t status);
 
+/**
+ * @brief   Move a non-periodic thread to another priority level
+ *
+ * A runnable thread is moved to the head of its new run queue when it is
+ * raised and to the tail when it is lowered. A context switch is requested
+ * if this changes which thread runs next.
+ *
+ * @param[in]   thread      Thread to change, must not be periodic
+ * @param[in]   priority    New priority, must not be SCHED_PERIODIC_PRIO_LEVEL
+ */
+void SM_FUNC(sancus_sm_timer) sched_change_priority(thread_t *thread, uint8_t priority);
+
+/**
+ * @brief   Utilisation of a periodic thread, see SCHED_PERIODIC_UTIL_SCALE
+ *
+ * @param[in]   runtime     Runtime per period
+ * @param[in]   period      Period of the thread
+ *
+ * @return  utilisation including SCHEDULER_OVERHEAD_RUN, rounded up
+ */
+uint32_t SM_FUNC(sancus_sm_timer) sched_periodic_utilisation(uint32_t runtime, uint32_t period);
+
+/**
+ * @brief   Reserve the utilisation of a periodic thread
+ *
+ * Replaces any reservation @p thread already holds. If the new reservation
+ * does not fit, it is rejected, or with SCHED_PERIODIC_DOWNGRADE @p runtime is
+ * lowered to what is left.
+ *
+ * @param[in]       thread      Thread that becomes periodic
+ * @param[in,out]   runtime     Requested runtime, set to the granted runtime
+ * @param[in]       period      Period of the thread
+ *
+ * @return  0 if @p runtime was granted
+ * @return  1 if @p runtime was lowered
+ * @return  -EOVERFLOW if there is no budget left
+ */
+int SM_FUNC(sancus_sm_timer) sched_periodic_admit(thread_t *thread, uint32_t *runtime, uint32_t period);
+
+/**
+ * @brief   Give back the reservation of @p thread, if it is periodic
+ */
+void SM_FUNC(sancus_sm_timer) sched_periodic_release(thread_t *thread);
+
+/**
+ * @brief   Utilisation currently reserved by periodic threads
+ *
+ * The free budget is SCHED_PERIODIC_UTIL_SCALE minus this value.
+ *
+ * @return  reserved utilisation, see SCHED_PERIODIC_UTIL_SCALE
+ */
+uint32_t SM_ENTRY(sancus_sm_timer) sched_periodic_reserved(void);
+
+/**
+ * @brief   Largest runtime a new periodic thread with @p period could get
+ *
+ * @param[in]   period      Period of the new thread
+ *
+ * @return  runtime that would be admitted, 0 if none
+ */
+uint32_t SM_ENTRY(sancus_sm_timer) sched_periodic_free_runtime(uint32_t period);
+
 /**
  * @brief   Set the status of the currently running process
  *
@@ -281,6 +454,16 @@ void SM_FUNC(sancus_sm_timer) sched_switch_internal_allow_yield(uint16_t other_p
  * */
 void SM_FUNC(sancus_sm_timer) sched_yield(void);
 
+/**
+ * Fast path of thread_yield_higher. Checks whether the active thread would
+ * simply be picked again by a yield, i.e. it is the only thread on the highest
+ * non-empty runqueue and it is not periodic. Pending timer interrupts are
+ * checked by the caller.
+ *
+ * @return  1 if the active thread can continue without a context switch
+ * */
+int SM_FUNC(sancus_sm_timer) sched_yield_fast_internal(void);
+
 /**
  * @brief   Call context switching at thread exit
  */
@@ -318,6 +501,158 @@ SM_DATA(sancus_sm_timer) extern thread_t sched_threads[KERNEL_PID_LAST + 1];
  */
 SM_DATA(sancus_sm_timer) extern volatile thread_t *sched_active_thread;
 
+#ifdef SCHED_TICKLESS_IDLE
+/**
+ *  Thread parked in a low-power mode by pm_set_lowest(), or NULL
+ */
+SM_DATA(sancus_sm_timer) extern thread_t *sched_idle_parked;
+
+/**
+ *  Low-power mode bits to set in the status register of the restored thread
+ */
+SM_DATA(sancus_sm_timer) extern uint16_t sched_idle_sr;
+
+/**
+ * @brief   Park the active thread if nothing else could run
+ * Called on the idle exitless entry, the thread is put to sleep when it is
+ * restored next.
+ */
+void SM_FUNC(sancus_sm_timer) sched_idle_internal(void);
+
+/**
+ * @brief   Pick the low-power mode for the thread that is about to be restored
+ * Sets @ref sched_idle_sr, which is 0 unless the parked thread is restored
+ * and the next timer is far enough away. Unparks the thread if it has to run.
+ *
+ * @returns the status register bits of the chosen mode
+ */
+uint16_t SM_FUNC(sancus_sm_timer) sched_idle_lpm_internal(void);
+#endif
+
+#ifdef SCHED_ACCOUNTING
+/**
+ * @brief   Accounting counters of a thread, see SCHED_ACCOUNTING
+ *
+ * All counters wrap around, monitors are expected to look at differences
+ * between two snapshots.
+ */
+typedef struct {
+    uint32_t runtime;           /**< secure_mintimer ticks the thread ran */
+    uint16_t switches;          /**< times the thread was switched to */
+    uint16_t preemptions;       /**< times the thread was switched away from
+                                     while it could still run */
+    uint16_t deadline_misses;   /**< periodic jobs that finished after their
+                                     deadline */
+} sched_stats_t;
+
+/**
+ *  Accounting counters, indexed by pid
+ */
+SM_DATA(sancus_sm_timer) extern sched_stats_t sched_stats[KERNEL_PID_LAST + 1];
+
+/**
+ * @brief   Clear the counters of @p pid, e.g. when a new thread takes it
+ */
+void SM_FUNC(sancus_sm_timer) sched_stats_reset(kernel_pid_t pid);
+
+/**
+ * @brief   Copy the accounting counters of all threads
+ *
+ * The running thread is charged up to the time of the call.
+ *
+ * @param[out]  stats       Buffer for the counters, indexed by pid. It must
+ *                          lie outside of the scheduler.
+ * @param[in]   count       Number of entries that fit into @p stats
+ *
+ * @return  number of entries written, -EFAULT if @p stats is not outside of
+ *          the scheduler
+ */
+int SM_ENTRY(sancus_sm_timer) sched_stats_snapshot(sched_stats_t *stats, unsigned count);
+#endif
+
+#ifdef SCHED_TRACE
+/**
+ * @brief   Events of the scheduler trace, see SCHED_TRACE
+ */
+typedef enum {
+    SCHED_TRACE_SWITCH = 1,     /**< switched to pid, arg is the previous pid */
+    SCHED_TRACE_WAKEUP,         /**< pid was put on a runqueue, arg is its old status */
+    SCHED_TRACE_TIMER,          /**< a timer of pid fired, pid 0 for timers of no thread */
+    SCHED_TRACE_BUDGET,         /**< the budget of the running periodic job ended */
+    SCHED_TRACE_VIOLATION,      /**< pid was killed after a violation */
+} sched_trace_event_t;
+
+/**
+ * @brief   Record of the scheduler trace, 8 bytes, little endian
+ */
+typedef struct {
+    uint32_t time;              /**< lower 32 bit of the secure_mintimer time */
+    uint8_t event;              /**< see sched_trace_event_t */
+    uint8_t pid;                /**< thread the event is about */
+    uint16_t arg;               /**< event specific */
+} sched_trace_record_t;
+
+/**
+ * @brief   Record an event in the trace ring
+ */
+void SM_FUNC(sancus_sm_timer) sched_trace(uint8_t event, kernel_pid_t pid, uint16_t arg);
+
+/**
+ * @brief   Move the oldest records of the trace ring into @p records
+ *
+ * @param[out]  records     Buffer for the records, must lie outside of the
+ *                          scheduler
+ * @param[in]   count       Number of records that fit into @p records
+ *
+ * @return  number of records moved, -EFAULT if @p records is not outside of
+ *          the scheduler or @p count is larger than any buffer can be
+ */
+int SM_ENTRY(sancus_sm_timer) sched_trace_drain(sched_trace_record_t *records, unsigned count);
+
+/**
+ * @brief   Number of records overwritten since the last call
+ */
+uint16_t SM_ENTRY(sancus_sm_timer) sched_trace_dropped(void);
+#endif
+
+#ifdef SCHED_WCET
+/**
+ * @name    Paths through the scheduler measured with SCHED_WCET
+ *
+ * Paths 0 to 6 are the exitless_entry function types.
+ * @{
+ */
+#define SCHED_WCET_PATH_VIOLATION   (7)     /**< timer ISR after a violation */
+#define SCHED_WCET_PATH_ISR         (8)     /**< timer ISR, plus (1 << channel)
+                                                 for every channel it handled */
+#define SCHED_WCET_PATHS            (16)    /**< number of paths */
+/** @} */
+
+/**
+ *  Timer value and path of the measurement in progress, set from assembly
+ */
+SM_DATA(sancus_sm_timer) extern uint16_t sched_wcet_start;
+SM_DATA(sancus_sm_timer) extern uint8_t sched_wcet_path;
+
+/**
+ * @brief   End the measurement in progress and keep it if it is the longest
+ *          of its path
+ */
+void SM_FUNC(sancus_sm_timer) sched_wcet_stop(void);
+
+/**
+ * @brief   Copy the longest measured run of every path
+ *
+ * @param[out]  max         Buffer for the maxima in timer ticks, indexed by
+ *                          path. It must lie outside of the scheduler.
+ * @param[in]   count       Number of entries that fit into @p max
+ *
+ * @return  number of entries written, -EFAULT if @p max is not outside of
+ *          the scheduler
+ */
+int SM_ENTRY(sancus_sm_timer) sched_wcet_snapshot(uint16_t *max, unsigned count);
+#endif
+
 /**
  *  Number of running (non-terminated) threads
  */
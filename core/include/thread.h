@@ -345,11 +345,20 @@ kernel_pid_t thread_create_protected(
  * @brief       Change a protected thread into a periodic thread.
  * @details     Allows to switch on the periodic scheduling of an existing thread. Can for now just be called by
  *              any code. 
+ *              Periodic threads are scheduled earliest deadline first, the deadline of a job being the
+ *              next release. A thread is only admitted if all periodic threads stay schedulable,
+ *              see sched_periodic_reserved() and sched_periodic_free_runtime() for the budget left.
  * @param[in]   pid   Thread to change.
  * @param[in]   runtime Runtime to guarantee (progress)
  * @param[in]   period Dormant period until activation
+ *
+ * @return      0 on success
+ * @return      1, if SCHED_PERIODIC_DOWNGRADE is defined and @p runtime was lowered to fit
+ * @return      -EINVAL, if @p pid is not a thread or @p period is 0
+ * @return      -EOVERFLOW, if the periodic threads would exceed 100% utilisation
+ * @return      -ENOMEM, if no timer is left for the periodic releases
  */
-void SM_ENTRY(sancus_sm_timer) thread_change_to_periodical(kernel_pid_t pid, uint16_t runtime, uint32_t period);
+int SM_ENTRY(sancus_sm_timer) thread_change_to_periodical(kernel_pid_t pid, uint16_t runtime, uint32_t period);
 
 /**
  * @brief       Retreive a thread control block by PID.
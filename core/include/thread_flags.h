@@ -42,6 +42,13 @@
  * Note that some flags (currently the three most significant bits) are used by
  * core functions and should not be set by the user. They can be waited for.
  *
+ * The flags live inside sancus_sm_timer, so threads are addressed by PID.
+ * Setting flags is a single entry into the scheduler and never yields inside
+ * it, which makes thread_flags_set() safe to call from ISRs. A waiting thread
+ * is blocked by the scheduler and then yields with an exitless call, it takes
+ * no wakeups until its condition is met. SMs use the
+ * ___MACRO_THREAD_FLAGS_WAIT_*_FROM_SM macros instead of the wait functions.
+ *
  * This API is optional and must be enabled by adding "core_thread_flags" to USEMODULE.
  *
  * @{
@@ -60,6 +67,7 @@
 
 #include "kernel_types.h"
 #include "sched.h"  /* for thread_t typedef */
+#include "sancus_helpers.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -110,14 +118,47 @@ extern "C" {
  */
 typedef uint16_t thread_flags_t;
 
+/**
+ * @name Wait modes of _thread_flags_wait()
+ * @{
+ */
+#define THREAD_FLAGS_WAIT_ANY   (0)     /**< any flag of the mask */
+#define THREAD_FLAGS_WAIT_ALL   (1)     /**< all flags of the mask */
+#define THREAD_FLAGS_WAIT_ONE   (2)     /**< any flag, return only the lowest */
+/** @} */
+
 /**
  * @brief Set thread flags, possibly waking it up
  *
- * @param[in]   thread     thread to work on
- * @param[in]   mask    additional flags to be set for the current thread,
+ * Yields if this woke a thread with a higher priority, unless called from
+ * an ISR.
+ *
+ * @param[in]   pid     thread to work on
+ * @param[in]   mask    additional flags to be set for the thread,
  *                      represented as a bitmask
+ *
+ * @return      0 on success, -EINVAL if @p pid is no thread
  */
-void thread_flags_set(thread_t *thread, thread_flags_t mask);
+int thread_flags_set(kernel_pid_t pid, thread_flags_t mask);
+
+/**
+ * @brief Scheduler side of thread_flags_set(), never yields
+ *
+ * @return      1 if a thread that runs before the caller was woken
+ * @return      0 otherwise, -EINVAL if @p pid is no thread
+ */
+int SM_ENTRY(sancus_sm_timer) _thread_flags_set(kernel_pid_t pid, thread_flags_t mask);
+
+/**
+ * @brief Scheduler side of the wait functions
+ *
+ * Clears and returns the flags that meet the condition of @p mode, or
+ * blocks the caller if there are none. Periodic threads never block.
+ *
+ * @return      the flags, 0 if the caller is blocked and has to yield
+ *              before it calls this again
+ */
+thread_flags_t SM_ENTRY(sancus_sm_timer) _thread_flags_wait(thread_flags_t mask, unsigned mode);
 
 /**
  * @brief Clear current thread's flags
@@ -127,7 +168,7 @@ void thread_flags_set(thread_t *thread, thread_flags_t mask);
  *
  * @returns     flags that have actually been cleared (mask & thread->flags before clear)
  */
-thread_flags_t thread_flags_clear(thread_flags_t mask);
+thread_flags_t SM_ENTRY(sancus_sm_timer) thread_flags_clear(thread_flags_t mask);
 
 /**
  * @brief Wait for any flag in mask to become set (blocking)
@@ -175,7 +216,6 @@ thread_flags_t thread_flags_wait_one(thread_flags_t mask);
  * @brief Possibly Wake up thread waiting for flags
  *
  * Wakes up a thread if it is thread flag blocked and its condition is met.
- * Has to be called with interrupts disabled.
  * Does not trigger yield.
  *
  * @internal
@@ -184,7 +224,31 @@ thread_flags_t thread_flags_wait_one(thread_flags_t mask);
  * @return      1       if @p thread has been woken up
  *              0       otherwise
  */
-int thread_flags_wake(thread_t *thread);
+int SM_FUNC(sancus_sm_timer) thread_flags_wake(thread_t *thread);
+
+/**
+ * @brief Sets flags from inside the scheduler (internal)
+ *
+ * @return      1 if a thread that runs before the active one was woken
+ */
+int SM_FUNC(sancus_sm_timer) thread_flags_set_internal(thread_t *thread, thread_flags_t mask);
+
+/**
+ * @brief SM variants of the wait functions, res gets the flags
+ */
+#define ___MACRO_THREAD_FLAGS_WAIT_FROM_SM(mask, mode, res, sm)     \
+    while (((res) = _thread_flags_wait((mask), (mode))) == 0) {      \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+    }
+
+#define ___MACRO_THREAD_FLAGS_WAIT_ANY_FROM_SM(mask, res, sm)        \
+    ___MACRO_THREAD_FLAGS_WAIT_FROM_SM(mask, THREAD_FLAGS_WAIT_ANY, res, sm)
+
+#define ___MACRO_THREAD_FLAGS_WAIT_ALL_FROM_SM(mask, res, sm)        \
+    ___MACRO_THREAD_FLAGS_WAIT_FROM_SM(mask, THREAD_FLAGS_WAIT_ALL, res, sm)
+
+#define ___MACRO_THREAD_FLAGS_WAIT_ONE_FROM_SM(mask, res, sm)        \
+    ___MACRO_THREAD_FLAGS_WAIT_FROM_SM(mask, THREAD_FLAGS_WAIT_ONE, res, sm)
 
 #ifdef __cplusplus
 }
@@ -46,10 +46,9 @@
 /**
  * This is a debugging function useful to debug timers. Usually, the timers are protected 
  * by the scheduler, however if one removes the SM_DATA restriction for:
- * secure_mintimer_timer_list
+ * secure_mintimer_pool
  * timer_list_head
- * overflow_list_head
- * long_list_head
+ * secure_mintimer_wheel
  * long_cnt
  * _secure_mintimer_high_cnt
  * Then one can debug with the below functions.
@@ -101,8 +100,7 @@ static void *idle_thread(void *arg)
     #endif
     #ifdef DEBUG_TIMER
     int i = 0;
-    secure_mintimer_t *timer = timer_list_head;
-    secure_mintimer_t *long_timer = long_list_head;
+    secure_mintimer_t *timer;
     #endif
 
     while (1) {
@@ -116,29 +114,22 @@ static void *idle_thread(void *arg)
         if(timer_list_head == NULL){
             puts("[Idle thread] Timer list head is NULL");
         }
-        while(timer != NULL){
-            print_timer_struct(timer, TIMER_TYPE_NORMAL);
-            if(timer->next != NULL) timer = timer->next;
-            else timer = NULL;
-        }
-        if(long_list_head == NULL){
-            puts("[Idle thread] Long timer list head is NULL");
-        }
-        while(long_timer != NULL){
-            print_timer_struct(long_timer, TIMER_TYPE_LONG);
-            if(long_timer->next != NULL) long_timer = long_timer->next;
-            else long_timer = NULL;
+        // Slots from the long wheel on hold timers of later periods
+        for(i = 0; i < SECURE_MINTIMER_WHEEL_SLOT_COUNT; i++){
+            for(timer = secure_mintimer_wheel[i]; timer != NULL; timer = timer->next){
+                print_timer_struct(timer, (i < (2 << SECURE_MINTIMER_WHEEL_BITS)) ? TIMER_TYPE_NORMAL : TIMER_TYPE_LONG);
+            }
         }
         // print_thread_struct(1);
         // print_thread_struct(2);
+        i = 0;
         while(i<1000){i++;}
 
         i = 0;
-        timer = timer_list_head;
-        long_timer = long_list_head;
         #endif
         // thread_yield_higher();
         // By default, the idle threat just loops the pm_set_lowest CPU dependent instruction.
+        // With SCHED_TICKLESS_IDLE, this sleeps until the next timer or interrupt needs a thread.
         pm_set_lowest();
     }
 
@@ -1,421 +1,424 @@
-// /*
-//  * Copyright (C) 2014 Freie Universität Berlin
-//  *
-//  * This file is subject to the terms and conditions of the GNU Lesser
-//  * General Public License v2.1. See the file LICENSE in the top level
-//  * directory for more details.
-//  */
-
-// /**
-//  * @ingroup     core_msg
-//  * @{
-//  *
-//  * @file
-//  * @brief       Kernel messaging implementation
-//  *
-//  * @author      Kaspar Schleiser <kaspar@schleiser.de>
-//  * @author      Oliver Hahm <oliver.hahm@inria.fr>
-//  * @author      Kévin Roussel <Kevin.Roussel@inria.fr>
-//  *
-//  * @}
-//  */
-
-// #include <stddef.h>
-// #include <inttypes.h>
-// #include <assert.h>
-// #include "sched.h"
-// #include "msg.h"
-// #include "list.h"
-// #include "thread.h"
-// #if MODULE_CORE_THREAD_FLAGS
-// #include "thread_flags.h"
-// #endif
-// #include "irq.h"
-// #include "cib.h"
-
-// #define ENABLE_DEBUG    (0)
-// #include "debug.h"
-
-// static int _msg_receive(msg_t *m, int block);
-// static int _msg_send(msg_t *m, kernel_pid_t target_pid, bool block, unsigned state);
-
-// static int queue_msg(thread_t *target, const msg_t *m)
-// {
-//     int n = cib_put(&(target->msg_queue));
-//     if (n < 0) {
-//         DEBUG("queue_msg(): message queue is full (or there is none)\n");
-//         return 0;
-//     }
-
-//     DEBUG("queue_msg(): queuing message\n");
-//     msg_t *dest = &target->msg_array[n];
-//     *dest = *m;
-// #if MODULE_CORE_THREAD_FLAGS
-//     target->flags |= THREAD_FLAG_MSG_WAITING;
-//     thread_flags_wake(target);
-// #endif
-//     return 1;
-// }
-
-// int msg_send(msg_t *m, kernel_pid_t target_pid)
-// {
-//     if (irq_is_in()) {
-//         return msg_send_int(m, target_pid);
-//     }
-//     if (sched_active_pid == target_pid) {
-//         return msg_send_to_self(m);
-//     }
-//     return _msg_send(m, target_pid, true, irq_disable());
-// }
-
-// int msg_try_send(msg_t *m, kernel_pid_t target_pid)
-// {
-//     if (irq_is_in()) {
-//         return msg_send_int(m, target_pid);
-//     }
-//     if (sched_active_pid == target_pid) {
-//         return msg_send_to_self(m);
-//     }
-//     return _msg_send(m, target_pid, false, irq_disable());
-// }
-
-// static int _msg_send(msg_t *m, kernel_pid_t target_pid, bool block, unsigned state)
-// {
-// #ifdef DEVELHELP
-//     if (!pid_is_valid(target_pid)) {
-//         DEBUG("msg_send(): target_pid is invalid, continuing anyways\n");
-//     }
-// #endif /* DEVELHELP */
-
-//     thread_t *target = (thread_t*) sched_threads[target_pid];
-
-//     m->sender_pid = sched_active_pid;
-
-//     if (target == NULL) {
-//         DEBUG("msg_send(): target thread does not exist\n");
-//         irq_restore(state);
-//         return -1;
-//     }
-
-//     thread_t *me = (thread_t *) sched_active_thread;
-
-//     DEBUG("msg_send() %s:%i: Sending from %" PRIkernel_pid " to %" PRIkernel_pid
-//           ". block=%i src->state=%i target->state=%i\n", RIOT_FILE_RELATIVE,
-//           __LINE__, sched_active_pid, target_pid,
-//           block, me->status, target->status);
-
-//     if (target->status != STATUS_RECEIVE_BLOCKED) {
-//         DEBUG("msg_send() %s:%i: Target %" PRIkernel_pid " is not RECEIVE_BLOCKED.\n",
-//               RIOT_FILE_RELATIVE, __LINE__, target_pid);
-
-//         if (queue_msg(target, m)) {
-//             DEBUG("msg_send() %s:%i: Target %" PRIkernel_pid
-//                   " has a msg_queue. Queueing message.\n", RIOT_FILE_RELATIVE,
-//                   __LINE__, target_pid);
-//             irq_restore(state);
-//             if (me->status == STATUS_REPLY_BLOCKED) {
-//                 thread_yield_higher();
-//             }
-//             return 1;
-//         }
-
-//         if (!block) {
-//             DEBUG("msg_send: %" PRIkernel_pid ": Receiver not waiting, block=%u\n",
-//                   me->pid, block);
-//             irq_restore(state);
-//             return 0;
-//         }
-
-//         DEBUG("msg_send: %" PRIkernel_pid ": going send blocked.\n",
-//               me->pid);
-
-//         me->wait_data = (void*) m;
-
-//         int newstatus;
-
-//         if (me->status == STATUS_REPLY_BLOCKED) {
-//             newstatus = STATUS_REPLY_BLOCKED;
-//         }
-//         else {
-//             newstatus = STATUS_SEND_BLOCKED;
-//         }
-
-//         sched_set_status((thread_t*) me, newstatus);
-
-//         thread_add_to_list(&(target->msg_waiters), me);
-
-// #if MODULE_CORE_THREAD_FLAGS
-//         target->flags |= THREAD_FLAG_MSG_WAITING;
-//         thread_flags_wake(target);
-// #endif
-
-//         irq_restore(state);
-//         thread_yield_higher();
-
-//         DEBUG("msg_send: %" PRIkernel_pid ": Back from send block.\n",
-//               me->pid);
-//     }
-//     else {
-//         DEBUG("msg_send: %" PRIkernel_pid ": Direct msg copy from %"
-//               PRIkernel_pid " to %" PRIkernel_pid ".\n",
-//               me->pid, thread_getpid(), target_pid);
-//         /* copy msg to target */
-//         msg_t *target_message = (msg_t*) target->wait_data;
-//         *target_message = *m;
-//         sched_set_status(target, STATUS_PENDING);
-
-//         irq_restore(state);
-//         thread_yield_higher();
-//     }
-
-//     return 1;
-// }
-
-// int msg_send_to_self(msg_t *m)
-// {
-//     unsigned state = irq_disable();
-
-//     m->sender_pid = sched_active_pid;
-//     int res = queue_msg((thread_t *) sched_active_thread, m);
-
-//     irq_restore(state);
-//     return res;
-// }
-
-// int msg_send_int(msg_t *m, kernel_pid_t target_pid)
-// {
-// #ifdef DEVELHELP
-//     if (!pid_is_valid(target_pid)) {
-//         DEBUG("msg_send(): target_pid is invalid, continuing anyways\n");
-//     }
-// #endif /* DEVELHELP */
-
-//     thread_t *target = (thread_t *) sched_threads[target_pid];
-
-//     if (target == NULL) {
-//         DEBUG("msg_send_int(): target thread does not exist\n");
-//         return -1;
-//     }
-
-//     m->sender_pid = KERNEL_PID_ISR;
-//     if (target->status == STATUS_RECEIVE_BLOCKED) {
-//         DEBUG("msg_send_int: Direct msg copy from %" PRIkernel_pid " to %"
-//               PRIkernel_pid ".\n", thread_getpid(), target_pid);
-
-
-//         /* copy msg to target */
-//         msg_t *target_message = (msg_t*) target->wait_data;
-//         *target_message = *m;
-//         sched_set_status(target, STATUS_PENDING);
-
-//         sched_context_switch_request = 1;
-//         return 1;
-//     }
-//     else {
-//         DEBUG("msg_send_int: Receiver not waiting.\n");
-//         return (queue_msg(target, m));
-//     }
-// }
-
-// int msg_send_receive(msg_t *m, msg_t *reply, kernel_pid_t target_pid)
-// {
-//     assert(sched_active_pid != target_pid);
-//     unsigned state = irq_disable();
-//     thread_t *me = (thread_t*) sched_threads[sched_active_pid];
-//     sched_set_status(me, STATUS_REPLY_BLOCKED);
-//     me->wait_data = (void*) reply;
-
-//     /* we re-use (abuse) reply for sending, because wait_data might be
-//      * overwritten if the target is not in RECEIVE_BLOCKED */
-//     *reply = *m;
-//     /* msg_send blocks until reply received */
-//     return _msg_send(reply, target_pid, true, state);
-// }
-
-// int msg_reply(msg_t *m, msg_t *reply)
-// {
-//     unsigned state = irq_disable();
-
-//     thread_t *target = (thread_t*) sched_threads[m->sender_pid];
-//     assert(target != NULL);
-
-//     if (target->status != STATUS_REPLY_BLOCKED) {
-//         DEBUG("msg_reply(): %" PRIkernel_pid ": Target \"%" PRIkernel_pid
-//               "\" not waiting for reply.", sched_active_thread->pid, target->pid);
-//         irq_restore(state);
-//         return -1;
-//     }
-
-//     DEBUG("msg_reply(): %" PRIkernel_pid ": Direct msg copy.\n",
-//           sched_active_thread->pid);
-//     /* copy msg to target */
-//     msg_t *target_message = (msg_t*) target->wait_data;
-//     *target_message = *reply;
-//     sched_set_status(target, STATUS_PENDING);
-//     uint16_t target_prio = target->priority;
-//     irq_restore(state);
-//     sched_switch(target_prio);
-
-//     return 1;
-// }
-
-// int msg_reply_int(msg_t *m, msg_t *reply)
-// {
-//     thread_t *target = (thread_t*) sched_threads[m->sender_pid];
-
-//     if (target->status != STATUS_REPLY_BLOCKED) {
-//         DEBUG("msg_reply_int(): %" PRIkernel_pid ": Target \"%" PRIkernel_pid
-//               "\" not waiting for reply.", sched_active_thread->pid, target->pid);
-//         return -1;
-//     }
-
-//     msg_t *target_message = (msg_t*) target->wait_data;
-//     *target_message = *reply;
-//     sched_set_status(target, STATUS_PENDING);
-//     sched_context_switch_request = 1;
-//     return 1;
-// }
-
-// int msg_try_receive(msg_t *m)
-// {
-//     return _msg_receive(m, 0);
-// }
-
-// int msg_receive(msg_t *m)
-// {
-//     return _msg_receive(m, 1);
-// }
-
-// static int _msg_receive(msg_t *m, int block)
-// {
-//     unsigned state = irq_disable();
-//     DEBUG("_msg_receive: %" PRIkernel_pid ": _msg_receive.\n",
-//           sched_active_thread->pid);
-
-//     thread_t *me = (thread_t*) sched_threads[sched_active_pid];
-
-//     int queue_index = -1;
-
-//     if (thread_has_msg_queue(me)) {
-//         queue_index = cib_get(&(me->msg_queue));
-//     }
-
-//     /* no message, fail */
-//     if ((!block) && ((!me->msg_waiters.next) && (queue_index == -1))) {
-//         irq_restore(state);
-//         return -1;
-//     }
-
-//     if (queue_index >= 0) {
-//         DEBUG("_msg_receive: %" PRIkernel_pid ": _msg_receive(): We've got a queued message.\n",
-//               sched_active_thread->pid);
-//         *m = me->msg_array[queue_index];
-//     }
-//     else {
-//         me->wait_data = (void *) m;
-//     }
-
-//     list_node_t *next = list_remove_head(&me->msg_waiters);
-
-//     if (next == NULL) {
-//         DEBUG("_msg_receive: %" PRIkernel_pid ": _msg_receive(): No thread in waiting list.\n",
-//               sched_active_thread->pid);
-
-//         if (queue_index < 0) {
-//             DEBUG("_msg_receive(): %" PRIkernel_pid ": No msg in queue. Going blocked.\n",
-//                   sched_active_thread->pid);
-//             sched_set_status(me, STATUS_RECEIVE_BLOCKED);
-
-//             irq_restore(state);
-//             thread_yield_higher();
-
-//             /* sender copied message */
-//             assert(sched_active_thread->status != STATUS_RECEIVE_BLOCKED);
-//         }
-//         else {
-//             irq_restore(state);
-//         }
-
-//         return 1;
-//     }
-//     else {
-//         DEBUG("_msg_receive: %" PRIkernel_pid ": _msg_receive(): Waking up waiting thread.\n",
-//               sched_active_thread->pid);
-
-//         thread_t *sender = container_of((clist_node_t*)next, thread_t, rq_entry);
-
-//         if (queue_index >= 0) {
-//             /* We've already got a message from the queue. As there is a
-//              * waiter, take it's message into the just freed queue space.
-//              */
-//             m = &(me->msg_array[cib_put(&(me->msg_queue))]);
-//         }
-
-//         /* copy msg */
-//         msg_t *sender_msg = (msg_t*) sender->wait_data;
-//         *m = *sender_msg;
-
-//         /* remove sender from queue */
-//         uint16_t sender_prio = THREAD_PRIORITY_IDLE;
-//         if (sender->status != STATUS_REPLY_BLOCKED) {
-//             sender->wait_data = NULL;
-//             sched_set_status(sender, STATUS_PENDING);
-//             sender_prio = sender->priority;
-//         }
-
-//         irq_restore(state);
-//         if (sender_prio < THREAD_PRIORITY_IDLE) {
-//             sched_switch(sender_prio);
-//         }
-//         return 1;
-//     }
-
-//     DEBUG("This should have never been reached!\n");
-// }
-
-// int msg_avail(void)
-// {
-//     DEBUG("msg_available: %" PRIkernel_pid ": msg_available.\n",
-//           sched_active_thread->pid);
-
-//     thread_t *me = (thread_t*) sched_active_thread;
-
-//     int queue_index = -1;
-
-//     if (thread_has_msg_queue(me)) {
-//         queue_index = cib_avail(&(me->msg_queue));
-//     }
-
-//     return queue_index;
-// }
-
-// void msg_init_queue(msg_t *array, int num)
-// {
-//     thread_t *me = (thread_t*) sched_active_thread;
-//     me->msg_array = array;
-//     cib_init(&(me->msg_queue), num);
-// }
-
-// void msg_queue_print(void)
-// {
-//     unsigned state = irq_disable();
-
-//     thread_t *thread =(thread_t *)sched_active_thread;
-//     cib_t *msg_queue = &thread->msg_queue;
-//     msg_t *msg_array = thread->msg_array;
-//     unsigned int i = msg_queue->read_count & msg_queue->mask;
-
-//     printf("Message queue of thread %" PRIkernel_pid "\n", thread->pid);
-//     printf("    size: %u (avail: %d)\n", msg_queue->mask + 1,
-//            cib_avail(msg_queue));
-
-//     for (; i != (msg_queue->write_count & msg_queue->mask);
-//          i = (i + 1) & msg_queue->mask) {
-//         msg_t *m = &msg_array[i];
-//         printf("    * %u: sender: %" PRIkernel_pid ", type: 0x%04" PRIu16
-//                ", content: %" PRIu32 " (%p)\n", i, m->sender_pid, m->type,
-//                m->content.value, m->content.ptr);
-//     }
-
-//     irq_restore(state);
-// }
+/*
+ * Copyright (C) 2014 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     core_msg
+ * @{
+ *
+ * @file
+ * @brief       Kernel messaging implementation
+ *
+ * @author      Kaspar Schleiser <kaspar@schleiser.de>
+ * @author      Oliver Hahm <oliver.hahm@inria.fr>
+ * @author      Kévin Roussel <Kevin.Roussel@inria.fr>
+ *
+ * @}
+ */
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "sched.h"
+#include "msg.h"
+#include "list.h"
+#include "thread.h"
+
+#define ENABLE_DEBUG    (0)
+#include "debug.h"
+
+#if MSG_POOL_SIZE > 32
+#error "MSG_POOL_SIZE must not exceed 32"
+#endif
+
+// What thread_t::msg_slot holds
+#define MSG_SLOT_EMPTY      (0)
+#define MSG_SLOT_SENDING    (1)     // message of a blocked send, the thread is on msg_waiters of msg_peer
+#define MSG_SLOT_RECEIVED   (2)     // message or reply handed over to this thread
+#define MSG_SLOT_FAILED     (3)     // msg_peer exited before it took the message or replied
+
+// Queues of all threads, handed out in aligned power of two blocks
+SM_DATA(sancus_sm_timer) static msg_t msg_pool[MSG_POOL_SIZE];
+SM_DATA(sancus_sm_timer) static uint32_t msg_pool_used;
+
+static inline uint32_t SM_FUNC(sancus_sm_timer) _msg_pool_mask(unsigned start, unsigned num)
+{
+    return (num >= 32 ? 0xffffffffUL : ((uint32_t)1 << num) - 1) << start;
+}
+
+static void SM_FUNC(sancus_sm_timer) _msg_free_queue(thread_t *thread)
+{
+    if (thread->msg_array) {
+        msg_pool_used &= ~_msg_pool_mask(thread->msg_array - msg_pool,
+                                         thread->msg_queue.mask + 1);
+        thread->msg_array = NULL;
+    }
+    cib_init(&thread->msg_queue, 0);
+}
+
+void SM_FUNC(sancus_sm_timer) msg_thread_init(thread_t *thread)
+{
+    thread->msg_waiters.next = NULL;
+    thread->msg_array = NULL;
+    cib_init(&thread->msg_queue, 0);
+    thread->msg_slot_state = MSG_SLOT_EMPTY;
+    thread->msg_peer = KERNEL_PID_UNDEF;
+}
+
+void SM_FUNC(sancus_sm_timer) msg_thread_exit(thread_t *thread)
+{
+    _msg_free_queue(thread);
+
+    // Exited right after it blocked in a send, before it yielded
+    if (thread->msg_slot_state == MSG_SLOT_SENDING) {
+        list_remove(&sched_threads[thread->msg_peer].msg_waiters,
+                    (list_node_t*)&thread->rq_entry);
+        thread->msg_slot_state = MSG_SLOT_EMPTY;
+    }
+
+    // Blocked senders and threads that wait for a reply would wait forever
+    for (kernel_pid_t i = KERNEL_PID_FIRST; i <= KERNEL_PID_LAST; i++) {
+        thread_t *other = &sched_threads[i];
+        if (other->in_use && other->msg_peer == thread->pid
+            && (other->status == STATUS_SEND_BLOCKED
+                || other->status == STATUS_REPLY_BLOCKED)) {
+            other->msg_slot_state = MSG_SLOT_FAILED;
+            sched_set_status(other, STATUS_PENDING);
+        }
+    }
+    thread->msg_waiters.next = NULL;
+}
+
+/**
+ * @brief Returns the active thread, unless it already blocked itself
+ */
+static thread_t* SM_FUNC(sancus_sm_timer) _msg_caller(void)
+{
+    thread_t *me = (thread_t*)sched_active_thread;
+    if (me == NULL || me->status != STATUS_RUNNING) {
+        return NULL;
+    }
+    return me;
+}
+
+/**
+ * @brief Returns the thread with @p pid if it exists
+ */
+static thread_t* SM_FUNC(sancus_sm_timer) _msg_target(kernel_pid_t pid)
+{
+    if (!pid_is_valid(pid) || !sched_threads[pid].in_use) {
+        return NULL;
+    }
+    return &sched_threads[pid];
+}
+
+/**
+ * @brief Requests a switch if @p woken runs before the active thread
+ */
+static int SM_FUNC(sancus_sm_timer) _msg_switch(thread_t *woken)
+{
+    sched_switch_internal_allow_yield(woken->priority, false);
+    return sched_context_switch_request ? MSG_YIELD : 1;
+}
+
+/**
+ * @brief Takes the message of the first blocked sender of @p me into @p dst
+ * and wakes the sender unless it waits for a reply.
+ */
+static thread_t* SM_FUNC(sancus_sm_timer) _msg_pop_waiter(thread_t *me, msg_t *dst)
+{
+    list_node_t *next = list_remove_head(&me->msg_waiters);
+    if (next == NULL) {
+        return NULL;
+    }
+
+    thread_t *sender = container_of((clist_node_t*)next, thread_t, rq_entry);
+    *dst = sender->msg_slot;
+    sender->msg_slot_state = MSG_SLOT_EMPTY;
+    if (sender->status == STATUS_SEND_BLOCKED) {
+        sched_set_status(sender, STATUS_PENDING);
+    }
+    return sender;
+}
+
+/**
+ * @brief Delivers @p m to @p target. Blocks the caller with @p blocked_status
+ * if @p blocking and the target can not take it now.
+ */
+static int SM_FUNC(sancus_sm_timer) _msg_deliver(msg_t *m, thread_t *target,
+                                                 int blocking, thread_status_t blocked_status)
+{
+    thread_t *me = (thread_t*)sched_active_thread;
+    msg_t msg = *m;
+    msg.sender_pid = me->pid;
+
+    if (target->status == STATUS_RECEIVE_BLOCKED) {
+        sancus_debug2("msg: %" PRIkernel_pid " hands over to %" PRIkernel_pid "\n",
+              me->pid, target->pid);
+        target->msg_slot = msg;
+        target->msg_slot_state = MSG_SLOT_RECEIVED;
+        sched_set_status(target, STATUS_PENDING);
+    }
+    else {
+        int idx = cib_put(&target->msg_queue);
+        if (idx >= 0) {
+            sancus_debug2("msg: %" PRIkernel_pid " queues for %" PRIkernel_pid "\n",
+                  me->pid, target->pid);
+            target->msg_array[idx] = msg;
+#ifdef MODULE_CORE_THREAD_FLAGS
+            thread_flags_set_internal(target, THREAD_FLAG_MSG_WAITING);
+#endif
+        }
+        else if (!blocking) {
+            return 0;
+        }
+        else {
+            sancus_debug2("msg: %" PRIkernel_pid " blocks on %" PRIkernel_pid "\n",
+                  me->pid, target->pid);
+            me->msg_slot = msg;
+            me->msg_slot_state = MSG_SLOT_SENDING;
+            me->msg_peer = target->pid;
+            sched_set_status(me, blocked_status);
+            thread_add_to_list(&target->msg_waiters, me);
+#ifdef MODULE_CORE_THREAD_FLAGS
+            thread_flags_set_internal(target, THREAD_FLAG_MSG_WAITING);
+#endif
+            return MSG_BLOCKED;
+        }
+    }
+
+    if (blocked_status == STATUS_REPLY_BLOCKED) {
+        me->msg_slot_state = MSG_SLOT_EMPTY;
+        me->msg_peer = target->pid;
+        sched_set_status(me, STATUS_REPLY_BLOCKED);
+        return MSG_BLOCKED;
+    }
+    if (target->status >= STATUS_ON_RUNQUEUE) {
+        return _msg_switch(target);
+    }
+    return 1;
+}
+
+int SM_ENTRY(sancus_sm_timer) _msg_send(msg_t *m, kernel_pid_t target_pid, int blocking)
+{
+    thread_t *me = _msg_caller();
+    thread_t *target = _msg_target(target_pid);
+
+    if (me == NULL || target == NULL
+        || !sancus_is_outside_sm(sancus_sm_timer, (void *)m, sizeof(msg_t))) {
+        return -1;
+    }
+
+    // Periodic threads are released by the timer, they can not block
+    if (target == me || me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        blocking = 0;
+    }
+    return _msg_deliver(m, target, blocking, STATUS_SEND_BLOCKED);
+}
+
+int SM_ENTRY(sancus_sm_timer) _msg_send_receive(msg_t *m, kernel_pid_t target_pid)
+{
+    thread_t *me = _msg_caller();
+    thread_t *target = _msg_target(target_pid);
+
+    if (me == NULL || target == NULL || target == me
+        || me->priority == SCHED_PERIODIC_PRIO_LEVEL
+        || !sancus_is_outside_sm(sancus_sm_timer, (void *)m, sizeof(msg_t))) {
+        return -1;
+    }
+    return _msg_deliver(m, target, 1, STATUS_REPLY_BLOCKED);
+}
+
+int SM_ENTRY(sancus_sm_timer) _msg_wait(msg_t *reply)
+{
+    thread_t *me = (thread_t*)sched_active_thread;
+
+    if (me == NULL) {
+        return -1;
+    }
+    if (me->status == STATUS_SEND_BLOCKED || me->status == STATUS_REPLY_BLOCKED) {
+        return MSG_BLOCKED;
+    }
+    if (me->msg_slot_state == MSG_SLOT_FAILED) {
+        me->msg_slot_state = MSG_SLOT_EMPTY;
+        return -1;
+    }
+    if (reply != NULL && me->msg_slot_state == MSG_SLOT_RECEIVED) {
+        if (!sancus_is_outside_sm(sancus_sm_timer, (void *)reply, sizeof(msg_t))) {
+            return -1;
+        }
+        *reply = me->msg_slot;
+        me->msg_slot_state = MSG_SLOT_EMPTY;
+    }
+    return 1;
+}
+
+int SM_ENTRY(sancus_sm_timer) _msg_receive(msg_t *m, int blocking)
+{
+    thread_t *me = _msg_caller();
+
+    if (me == NULL || !sancus_is_outside_sm(sancus_sm_timer, (void *)m, sizeof(msg_t))) {
+        return -1;
+    }
+
+    // Handed over while we were blocked
+    if (me->msg_slot_state == MSG_SLOT_RECEIVED) {
+        *m = me->msg_slot;
+        me->msg_slot_state = MSG_SLOT_EMPTY;
+        return 1;
+    }
+
+    thread_t *sender;
+    int idx = cib_get(&me->msg_queue);
+    if (idx >= 0) {
+        *m = me->msg_array[idx];
+        // Move the first blocked sender into the slot that opened up
+        if (me->msg_waiters.next == NULL) {
+            return 1;
+        }
+        sender = _msg_pop_waiter(me, &me->msg_array[cib_put(&me->msg_queue)]);
+    }
+    else {
+        sender = _msg_pop_waiter(me, m);
+    }
+
+    if (sender != NULL) {
+        if (sender->status >= STATUS_ON_RUNQUEUE) {
+            return _msg_switch(sender);
+        }
+        return 1;
+    }
+
+    if (!blocking || me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        return -1;
+    }
+
+    sancus_debug1("msg: %" PRIkernel_pid " waits for a message\n", me->pid);
+    sched_set_status(me, STATUS_RECEIVE_BLOCKED);
+    return MSG_BLOCKED;
+}
+
+int SM_ENTRY(sancus_sm_timer) _msg_reply(msg_t *m, msg_t *reply)
+{
+    thread_t *me = _msg_caller();
+
+    if (me == NULL
+        || !sancus_is_outside_sm(sancus_sm_timer, (void *)m, sizeof(msg_t))
+        || !sancus_is_outside_sm(sancus_sm_timer, (void *)reply, sizeof(msg_t))) {
+        return -1;
+    }
+
+    // Only the thread the sender waits for may answer
+    thread_t *target = _msg_target(m->sender_pid);
+    if (target == NULL || target->status != STATUS_REPLY_BLOCKED
+        || target->msg_peer != me->pid || target->msg_slot_state != MSG_SLOT_EMPTY) {
+        sancus_debug("msg_reply(): target not waiting for a reply from us\n");
+        return -1;
+    }
+
+    target->msg_slot = *reply;
+    target->msg_slot.sender_pid = me->pid;
+    target->msg_slot_state = MSG_SLOT_RECEIVED;
+    sched_set_status(target, STATUS_PENDING);
+    return _msg_switch(target);
+}
+
+int SM_ENTRY(sancus_sm_timer) msg_avail(void)
+{
+    thread_t *me = (thread_t*)sched_active_thread;
+
+    if (me == NULL || me->msg_array == NULL) {
+        return -1;
+    }
+    return cib_avail(&me->msg_queue);
+}
+
+int SM_ENTRY(sancus_sm_timer) msg_init_queue(unsigned num)
+{
+    thread_t *me = (thread_t*)sched_active_thread;
+
+    if (me == NULL || num == 0 || (num & (num - 1)) || num > MSG_POOL_SIZE) {
+        return -EINVAL;
+    }
+
+    // Queued messages would be lost with the old queue
+    if (me->msg_array && cib_avail(&me->msg_queue)) {
+        return -EBUSY;
+    }
+
+    // The old queue is empty, so the new one may reuse its messages. It is
+    // only returned once the new one is found, a failure keeps it.
+    uint32_t used = msg_pool_used;
+    if (me->msg_array) {
+        used &= ~_msg_pool_mask(me->msg_array - msg_pool, me->msg_queue.mask + 1);
+    }
+    for (unsigned start = 0; start + num <= MSG_POOL_SIZE; start += num) {
+        uint32_t mask = _msg_pool_mask(start, num);
+        if (!(used & mask)) {
+            msg_pool_used = used | mask;
+            me->msg_array = &msg_pool[start];
+            cib_init(&me->msg_queue, num);
+            return 0;
+        }
+    }
+    return -ENOMEM;
+}
+
+/**
+ * @brief Yields after a send until the message is taken
+ */
+static int _msg_finish(int res, msg_t *reply)
+{
+    if (res == MSG_YIELD) {
+        thread_yield_higher();
+        return 1;
+    }
+    while (res == MSG_BLOCKED) {
+        thread_yield_higher();
+        res = _msg_wait(reply);
+    }
+    return res;
+}
+
+int msg_send(msg_t *m, kernel_pid_t target_pid)
+{
+    return _msg_finish(_msg_send(m, target_pid, 1), NULL);
+}
+
+int msg_try_send(msg_t *m, kernel_pid_t target_pid)
+{
+    return _msg_finish(_msg_send(m, target_pid, 0), NULL);
+}
+
+int msg_send_to_self(msg_t *m)
+{
+    return _msg_send(m, thread_getpid(), 0) > 0;
+}
+
+int msg_send_receive(msg_t *m, msg_t *reply, kernel_pid_t target_pid)
+{
+    return _msg_finish(_msg_send_receive(m, target_pid), reply);
+}
+
+int msg_reply(msg_t *m, msg_t *reply)
+{
+    return _msg_finish(_msg_reply(m, reply), NULL);
+}
+
+int msg_receive(msg_t *m)
+{
+    int res;
+    while ((res = _msg_receive(m, 1)) == MSG_BLOCKED) {
+        thread_yield_higher();
+    }
+    return _msg_finish(res, NULL);
+}
+
+int msg_try_receive(msg_t *m)
+{
+    return _msg_finish(_msg_receive(m, 0), NULL);
+}
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include "mutex.h"
 #include "thread.h"
@@ -32,7 +33,122 @@
 #define ENABLE_DEBUG    (0)
 #include "debug.h"
 
-int SM_FUNC(sancus_sm_timer) _mutex_lock(mutex_t *mutex, int blocking)
+// Mutexes of unprotected code and SMs, zeroed they are unlocked
+SM_DATA(sancus_sm_timer) static mutex_t mutex_pool[MUTEX_NUMOF];
+
+/**
+ * @brief Take over @p mutex for @p thread
+ */
+static inline void SM_FUNC(sancus_sm_timer) _mutex_set_owner(mutex_t *mutex, thread_t *thread)
+{
+    mutex->owner = thread->pid;
+    mutex->next_held = thread->mutex_held;
+    thread->mutex_held = mutex;
+}
+
+/**
+ * @brief Priority the first waiter of @p mutex lends its owner
+ *
+ * Periodic threads are ordered by deadline, so the owner never joins their
+ * level. It gets the highest level below instead, which still keeps all
+ * other non-periodic threads from delaying the waiter.
+ */
+static uint8_t SM_FUNC(sancus_sm_timer) _mutex_lent_priority(mutex_t *mutex, uint8_t priority)
+{
+    if (mutex->queue.next == NULL || mutex->queue.next == mutex_LOCKED) {
+        return priority;
+    }
+
+    // The queue is sorted by priority, the head waits longest
+    thread_t *waiter = container_of((clist_node_t*)mutex->queue.next, thread_t, rq_entry);
+    uint8_t lent = waiter->priority;
+    if (lent == SCHED_PERIODIC_PRIO_LEVEL) {
+        lent++;
+    }
+    return lent < priority ? lent : priority;
+}
+
+void SM_FUNC(sancus_sm_timer) mutex_update_priority(thread_t *thread)
+{
+    // Follows the chain of owners: a thread whose priority changed while it
+    // waits on another mutex moves in that queue and passes the change on.
+    // Bounded by the number of threads, even for a deadlocked cycle.
+    for (unsigned depth = 0; depth <= KERNEL_PID_LAST; depth++) {
+        if (thread->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+            return;
+        }
+
+        // Recomputed from scratch, so nested and overlapping locks neither keep
+        // a priority nobody lends anymore nor drop one that is still lent
+        uint8_t priority = thread->base_priority;
+        for (mutex_t *held = thread->mutex_held; held != NULL; held = held->next_held) {
+            priority = _mutex_lent_priority(held, priority);
+        }
+
+        if (thread->priority == priority) {
+            return;
+        }
+        sancus_debug2("mutex: %" PRIkernel_pid " now runs with prio %" PRIu8 "\n",
+              thread->pid, priority);
+        sched_change_priority(thread, priority);
+
+        mutex_t *wait = thread->mutex_wait;
+        if (wait == NULL) {
+            return;
+        }
+        // Keep the queue sorted, its head decides what the owner is lent
+        list_remove(&wait->queue, (list_node_t *)&thread->rq_entry);
+        thread_add_to_list(&wait->queue, thread);
+        if (wait->owner == KERNEL_PID_UNDEF) {
+            return;
+        }
+        thread = &sched_threads[wait->owner];
+    }
+}
+
+/**
+ * @brief Gives up ownership of @p mutex and drops the priority it lent
+ */
+static void SM_FUNC(sancus_sm_timer) _mutex_release(mutex_t *mutex)
+{
+    if (mutex->owner == KERNEL_PID_UNDEF) {
+        return;
+    }
+
+    thread_t *owner = &sched_threads[mutex->owner];
+    for (mutex_t **held = &owner->mutex_held; *held != NULL; held = &(*held)->next_held) {
+        if (*held == mutex) {
+            *held = mutex->next_held;
+            break;
+        }
+    }
+    mutex->next_held = NULL;
+    mutex->owner = KERNEL_PID_UNDEF;
+    mutex_update_priority(owner);
+}
+
+/**
+ * @brief Hands @p mutex to the first waiter, which has to be queued
+ */
+static thread_t* SM_FUNC(sancus_sm_timer) _mutex_handover(mutex_t *mutex)
+{
+    list_node_t *next = list_remove_head(&mutex->queue);
+
+    thread_t *process = container_of((clist_node_t*)next, thread_t, rq_entry);
+
+    sched_set_status(process, STATUS_PENDING);
+    process->mutex_wait = NULL;
+    _mutex_set_owner(mutex, process);
+
+    if (!mutex->queue.next) {
+        mutex->queue.next = mutex_LOCKED;
+    }
+    // The new owner inherits from the waiters that are left
+    mutex_update_priority(process);
+    return process;
+}
+
+int SM_FUNC(sancus_sm_timer) _mutex_lock_internal(mutex_t *mutex, thread_t *me, int blocking)
 {
 
     sancus_debug1("PID[%" PRIkernel_pid "]: Mutex in use.\n", sched_active_pid);
@@ -40,12 +156,17 @@ int SM_FUNC(sancus_sm_timer) _mutex_lock(mutex_t *mutex, int blocking)
     if (mutex->queue.next == NULL) {
         /* mutex is unlocked. */
         mutex->queue.next = mutex_LOCKED;
+        if (me) {
+            _mutex_set_owner(mutex, me);
+        }
+        else {
+            mutex->owner = KERNEL_PID_UNDEF;
+        }
         sancus_debug1("PID[%" PRIkernel_pid "]: mutex_wait early out.\n",
               sched_active_pid);
         return 1;
     }
-    else if (blocking) {
-        thread_t *me = (thread_t*)sched_active_thread;
+    else if (blocking && me) {
         sancus_debug2("PID[%" PRIkernel_pid "]: Adding node to mutex queue: prio: %"
               PRIu32 "\n", sched_active_pid, (uint32_t)me->priority);
         sched_set_status(me, STATUS_MUTEX_BLOCKED);
@@ -56,14 +177,27 @@ int SM_FUNC(sancus_sm_timer) _mutex_lock(mutex_t *mutex, int blocking)
         else {
             thread_add_to_list(&mutex->queue, me);
         }
+        me->mutex_wait = mutex;
+        if (mutex->owner != KERNEL_PID_UNDEF) {
+            mutex_update_priority(&sched_threads[mutex->owner]);
+        }
+        return MUTEX_BLOCKED;
+    }
+    else {
+        return 0;
+    }
+}
+
+int SM_FUNC(sancus_sm_timer) _mutex_lock(mutex_t *mutex, int blocking)
+{
+    int res = _mutex_lock_internal(mutex, (thread_t*)sched_active_thread, blocking);
+    if (res == MUTEX_BLOCKED) {
         thread_yield_higher();
         /* We were woken up by scheduler. Waker removed us from queue.
          * We have the mutex now. */
         return 1;
     }
-    else {
-        return 0;
-    }
+    return res;
 }
 
 void SM_FUNC(sancus_sm_timer) mutex_unlock(mutex_t *mutex)
@@ -77,25 +211,19 @@ void SM_FUNC(sancus_sm_timer) mutex_unlock(mutex_t *mutex)
         return;
     }
 
+    _mutex_release(mutex);
+
     if (mutex->queue.next == mutex_LOCKED) {
         mutex->queue.next = NULL;
         /* the mutex was locked and no thread was waiting for it */
         return;
     }
 
-    list_node_t *next = list_remove_head(&mutex->queue);
+    thread_t *process = _mutex_handover(mutex);
 
-    thread_t *process = container_of((clist_node_t*)next, thread_t, rq_entry);
-
-    sancus_debug2("mutex_unlock: waking up waiting thread %" PRIkernel_pid " with prio %" PRIu16 " \n",
+    sancus_debug2("mutex_unlock: woke up waiting thread %" PRIkernel_pid " with prio %" PRIu16 " \n",
           process->pid, process->priority);
 
-    sched_set_status(process, STATUS_PENDING);
-
-    if (!mutex->queue.next) {
-        mutex->queue.next = mutex_LOCKED;
-    }
-
     uint16_t process_priority = process->priority;
     sancus_debug("mutex_unlock: done.\n");
     // sched_switch(process_priority);
@@ -109,18 +237,13 @@ void SM_FUNC(sancus_sm_timer) mutex_unlock_and_sleep(mutex_t *mutex)
     sancus_debug1("PID[%" PRIkernel_pid "]: unlocking mutex. taking a nap\n", sched_active_pid);
 
     if (mutex->queue.next) {
+        _mutex_release(mutex);
         if (mutex->queue.next == mutex_LOCKED) {
             mutex->queue.next = NULL;
         }
         else {
-            list_node_t *next = list_remove_head(&mutex->queue);
-            thread_t *process = container_of((clist_node_t*)next, thread_t,
-                                             rq_entry);
-            sancus_debug1("PID[%" PRIkernel_pid "]: waking up waiter.\n", process->pid);
-            sched_set_status(process, STATUS_PENDING);
-            if (!mutex->queue.next) {
-                mutex->queue.next = mutex_LOCKED;
-            }
+            thread_t *process = _mutex_handover(mutex);
+            sancus_debug1("PID[%" PRIkernel_pid "]: woke up waiter.\n", process->pid);
         }
     }
 
@@ -128,3 +251,121 @@ void SM_FUNC(sancus_sm_timer) mutex_unlock_and_sleep(mutex_t *mutex)
     sched_set_status((thread_t*)sched_active_thread, STATUS_SLEEPING);
     thread_yield_higher();
 }
+
+bool SM_FUNC(sancus_sm_timer) mutex_remove_waiter(mutex_t *mutex, thread_t *thread)
+{
+    if (mutex->queue.next == NULL || mutex->queue.next == mutex_LOCKED
+        || !list_remove(&mutex->queue, (list_node_t *)&thread->rq_entry)) {
+        return false;
+    }
+    thread->mutex_wait = NULL;
+    if (mutex->queue.next == NULL) {
+        mutex->queue.next = mutex_LOCKED;
+    }
+    if (mutex->owner != KERNEL_PID_UNDEF) {
+        mutex_update_priority(&sched_threads[mutex->owner]);
+    }
+    return true;
+}
+
+void SM_FUNC(sancus_sm_timer) mutex_thread_exit(thread_t *thread)
+{
+    // Waiters would block forever on a mutex of a thread that is gone
+    while (thread->mutex_held != NULL) {
+        mutex_unlock(thread->mutex_held);
+    }
+}
+
+mutex_t* SM_FUNC(sancus_sm_timer) mutex_get(unsigned id)
+{
+    return id < MUTEX_NUMOF ? &mutex_pool[id] : NULL;
+}
+
+/**
+ * @brief Returns the running thread that called an entry, NULL if there is none
+ */
+static thread_t* SM_FUNC(sancus_sm_timer) _mutex_caller(void)
+{
+    thread_t *me = (thread_t*)sched_active_thread;
+    if (me == NULL || me->status != STATUS_RUNNING) {
+        return NULL;
+    }
+    return me;
+}
+
+int SM_ENTRY(sancus_sm_timer) _mutex_lock_id(unsigned id, int blocking)
+{
+    thread_t *me = _mutex_caller();
+    mutex_t *mutex = mutex_get(id);
+
+    if (me == NULL || mutex == NULL) {
+        return -EINVAL;
+    }
+    // The caller would wait for itself
+    if (mutex->queue.next != NULL && mutex->owner == me->pid) {
+        return -EDEADLK;
+    }
+
+    // Periodic threads are released by the timer, they can not block
+    if (me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        blocking = 0;
+    }
+    return _mutex_lock_internal(mutex, me, blocking);
+}
+
+int SM_ENTRY(sancus_sm_timer) _mutex_wait(unsigned id)
+{
+    thread_t *me = (thread_t*)sched_active_thread;
+    mutex_t *mutex = mutex_get(id);
+
+    if (me == NULL || mutex == NULL) {
+        return -EINVAL;
+    }
+    // The unlocking thread handed the mutex over before it woke us
+    if (mutex->queue.next != NULL && mutex->owner == me->pid) {
+        return 1;
+    }
+    return me->status == STATUS_MUTEX_BLOCKED ? MUTEX_BLOCKED : 0;
+}
+
+int SM_ENTRY(sancus_sm_timer) _mutex_unlock_id(unsigned id)
+{
+    thread_t *me = _mutex_caller();
+    mutex_t *mutex = mutex_get(id);
+
+    if (me == NULL || mutex == NULL) {
+        return -EINVAL;
+    }
+    if (mutex->queue.next == NULL || mutex->owner != me->pid) {
+        return -EPERM;
+    }
+
+    // Also set if the caller dropped a lent priority
+    mutex_unlock(mutex);
+    return sched_context_switch_request ? MUTEX_YIELD : 1;
+}
+
+int mutex_lock_id(unsigned id)
+{
+    int res = _mutex_lock_id(id, 1);
+    while (res == MUTEX_BLOCKED) {
+        thread_yield_higher();
+        res = _mutex_wait(id);
+    }
+    return res;
+}
+
+int mutex_trylock_id(unsigned id)
+{
+    return _mutex_lock_id(id, 0);
+}
+
+int mutex_unlock_id(unsigned id)
+{
+    int res = _mutex_unlock_id(id);
+    if (res == MUTEX_YIELD) {
+        thread_yield_higher();
+        return 1;
+    }
+    return res;
+}
@@ -20,6 +20,7 @@
  */
 
 
+#include <errno.h>
 #include <stdint.h>
 
 #include "sched.h"
@@ -28,6 +29,7 @@
 #include "sm_irq.h"
 #include "cpu.h"
 #include "thread.h"
+#include "mutex.h"
 #include "log.h"
 #include "secure_mintimer.h"
 
@@ -36,6 +38,10 @@
 #include "mpu.h"
 #endif
 
+#ifdef MODULE_SPSC
+#include "spsc.h"
+#endif
+
 #define ENABLE_DEBUG 0
 #include "debug.h"
 
@@ -57,15 +63,47 @@ SM_DATA(sancus_sm_timer) volatile thread_t *sched_active_thread = NULL;
 SM_DATA(sancus_sm_timer) volatile kernel_pid_t sched_active_pid = KERNEL_PID_UNDEF;
 
 SM_DATA(sancus_sm_timer) clist_node_t sched_runqueues[SCHED_PRIO_LEVELS];
-SM_DATA(sancus_sm_timer) static uint32_t runqueue_bitcache = 0;
+// One bit per priority level, as narrow as SCHED_PRIO_LEVELS allows
+#if SCHED_PRIO_LEVELS <= 8
+typedef uint8_t runqueue_bitcache_t;
+#elif SCHED_PRIO_LEVELS <= 16
+typedef uint16_t runqueue_bitcache_t;
+#elif SCHED_PRIO_LEVELS <= 32
+typedef uint32_t runqueue_bitcache_t;
+#else
+#error "SCHED_PRIO_LEVELS must not exceed 32"
+#endif
+SM_DATA(sancus_sm_timer) static runqueue_bitcache_t runqueue_bitcache = 0;
+
+// Index of the lowest set bit of a nibble (the entry for 0 is never used)
+SM_DATA(sancus_sm_timer) static const uint8_t lsb_nibble[16] = {
+    0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
 
 SM_DATA(sancus_sm_timer) const uint8_t max_threads = ARRAY_SIZE(sched_threads);
 
 SM_DATA(sancus_sm_timer) bool initialization_done = false;
 SM_DATA(sancus_sm_timer) volatile void *scheduler_entry;
 
-// We need one scheduler specific timer that the scheduler can use to regain control again after a short time.
-SM_DATA(sancus_sm_timer) secure_mintimer_t scheduler_timer;
+// Utilisation reserved by all periodic threads, in SCHED_PERIODIC_UTIL_SCALE
+SM_DATA(sancus_sm_timer) static uint32_t periodic_reserved = 0;
+
+#ifdef SCHED_ACCOUNTING
+SM_DATA(sancus_sm_timer) sched_stats_t sched_stats[KERNEL_PID_LAST + 1];
+// Time of the last thread switch, the active thread is charged from there
+SM_DATA(sancus_sm_timer) static uint32_t sched_stats_since = 0;
+#endif
+
+#ifdef SCHED_TRACE
+#if (SCHED_TRACE_SIZE & (SCHED_TRACE_SIZE - 1)) || (SCHED_TRACE_SIZE > 256)
+#error "SCHED_TRACE_SIZE must be a power of two of at most 256"
+#endif
+// Trace ring, sched_trace_head is the next record to write
+SM_DATA(sancus_sm_timer) static sched_trace_record_t sched_trace_ring[SCHED_TRACE_SIZE];
+SM_DATA(sancus_sm_timer) static uint8_t sched_trace_head = 0;
+SM_DATA(sancus_sm_timer) static uint16_t sched_trace_count = 0;
+SM_DATA(sancus_sm_timer) static uint16_t sched_trace_lost = 0;
+#endif
 
 #ifdef MODULE_SCHED_CB
 static void (*sched_cb) (kernel_pid_t active_thread, kernel_pid_t next_thread) = NULL;
@@ -81,10 +119,6 @@ void SM_FUNC(sancus_sm_timer) scheduler_init(void){
         // scheduler entry is needed when restoring protected threads
         scheduler_entry = SM_GET_ENTRY(sancus_sm_timer);
 
-        // Set up the scheduler specific timer
-        scheduler_timer.thread = NULL;
-        scheduler_timer.next = NULL;
-
        initialization_done = true;
     }
 }
@@ -96,66 +130,122 @@ void SM_FUNC(sancus_sm_timer) scheduler_init(void){
  * */
 
 /**
- * This is a code duplication of the bitarithm.h code. Technically we could also 
- * define it as a MACRO there
+ * Lowest set bit of the runqueue bitcache. Unlike bitarithm_lsb, this narrows
+ * v down to a nibble and looks it up in lsb_nibble, so it takes the same time
+ * for every priority level. v must not be 0.
  * */
-static inline unsigned SM_FUNC(sancus_sm_timer) bitarithm_lsb_sm_timer(unsigned v){
-/* Source: http://graphics.stanford.edu/~seander/bithacks.html#IntegerLogObvious */
+static inline unsigned SM_FUNC(sancus_sm_timer) bitarithm_lsb_sm_timer(runqueue_bitcache_t v){
     unsigned r = 0;
 
-    while ((v & 0x01) == 0) {
-        v >>= 1;
-        r++;
-    };
+#if SCHED_PRIO_LEVELS > 16
+    if (!(v & 0xFFFF)) {
+        v >>= 16;
+        r += 16;
+    }
+#endif
+#if SCHED_PRIO_LEVELS > 8
+    if (!(v & 0xFF)) {
+        v >>= 8;
+        r += 8;
+    }
+#endif
+    if (!(v & 0x0F)) {
+        v >>= 4;
+        r += 4;
+    }
+
+    return r + lsb_nibble[v & 0x0F];
+}
 
-    return r;
+/**
+ * @brief Thread owning the run queue entry *node*
+ */
+static inline thread_t* SM_FUNC(sancus_sm_timer) sm_rq_thread(clist_node_t *node)
+{
+    return container_of(node, thread_t, rq_entry);
 }
 
 /**
- * @brief Appends *new_node* at the end of *list
+ * @brief Links *thread* into a run queue right after *prev*
+ *
+ * Besides the clist next pointers, run queues keep a back pointer in
+ * thread_t::rq_prev so that any thread can be unlinked in O(1).
  *
  * @note Complexity: O(1)
+ */
+static inline void SM_FUNC(sancus_sm_timer) sm_rq_link_after(clist_node_t *prev, thread_t *thread)
+{
+    clist_node_t *next = prev->next;
+
+    thread->rq_entry.next = next;
+    thread->rq_prev = prev;
+    prev->next = &thread->rq_entry;
+    sm_rq_thread(next)->rq_prev = &thread->rq_entry;
+}
+
+/**
+ * @brief Appends *thread* at the end of *list*
  *
- * @param[in,out]   list        Pointer to clist
- * @param[in,out]   new_node    Node which gets inserted.
+ * @note Complexity: O(1)
+ *
+ * @param[in,out]   list        Pointer to the run queue
+ * @param[in,out]   thread      Thread which gets inserted.
  *                              Must not be NULL.
  */
-static inline void SM_FUNC(sancus_sm_timer) sm_clist_rpush(clist_node_t *list, clist_node_t *new_node)
+static inline void SM_FUNC(sancus_sm_timer) sm_rq_rpush(clist_node_t *list, thread_t *thread)
 {
     if (list->next) {
-        new_node->next = list->next->next;
-        list->next->next = new_node;
+        sm_rq_link_after(list->next, thread);
     }
     else {
-        new_node->next = new_node;
+        thread->rq_entry.next = &thread->rq_entry;
+        thread->rq_prev = &thread->rq_entry;
     }
-    list->next = new_node;
+    list->next = &thread->rq_entry;
 }
 
+/**
+ * @brief Inserts *thread* at the head of *list*
+ *
+ * @note Complexity: O(1)
+ */
+static inline void SM_FUNC(sancus_sm_timer) sm_rq_lpush(clist_node_t *list, thread_t *thread)
+{
+    if (list->next) {
+        sm_rq_link_after(list->next, thread);
+    }
+    else {
+        thread->rq_entry.next = &thread->rq_entry;
+        thread->rq_prev = &thread->rq_entry;
+        list->next = &thread->rq_entry;
+    }
+}
 
 /**
- * @brief Removes and returns first element from list
+ * @brief Removes *thread* from *list*, wherever it is queued
  *
  * @note Complexity: O(1)
  *
- * @param[in,out]   list        Pointer to the *list* to remove first element
- *                              from.
+ * @param[in,out]   list        Pointer to the run queue of *thread*
+ * @param[in,out]   thread      Thread to remove, must be on *list*
  */
-static inline clist_node_t* SM_FUNC(sancus_sm_timer) sm_clist_lpop(clist_node_t *list)
+static inline void SM_FUNC(sancus_sm_timer) sm_rq_remove(clist_node_t *list, thread_t *thread)
 {
-    if (list->next) {
-        clist_node_t *first = list->next->next;
-        if (list->next == first) {
-            list->next = NULL;
-        }
-        else {
-            list->next->next = first->next;
-        }
-        return first;
+    clist_node_t *node = &thread->rq_entry;
+
+    if (node->next == node) {
+        list->next = NULL;
     }
     else {
-        return NULL;
+        thread->rq_prev->next = node->next;
+        sm_rq_thread(node->next)->rq_prev = thread->rq_prev;
+        if (list->next == node) {
+            // Removing the tail
+            list->next = thread->rq_prev;
+        }
     }
+    node->next = NULL;
+    thread->rq_prev = NULL;
 }
 
 /**
@@ -178,25 +268,193 @@ static inline void SM_FUNC(sancus_sm_timer) sm_clist_lpoprpush(clist_node_t *lis
     }
 }
 
-void SM_FUNC(sancus_sm_timer) periodic_thread_schedule_next_timer(thread_t *periodic_thread, uint32_t current_time){
-    
-    // Increment last_reference until it is in the future (but avoiding infinite loops on overflows)
-    while (periodic_thread->last_reference < current_time 
-        && current_time - periodic_thread->last_reference < current_time){
-        periodic_thread->last_reference += periodic_thread->period;
+/**
+ * @brief Remainder of @p late / @p period by shift and subtract.
+ *
+ * The MSP430 has no divider, and this runs a fixed number of rounds (32, or
+ * 64 once a thread is more than 2^32 ticks late), so the cost of catching up
+ * does not depend on how many periods a thread missed.
+ */
+static uint32_t SM_FUNC(sancus_sm_timer) periodic_remainder(uint64_t late, uint32_t period)
+{
+    uint32_t rem = 0;
+    uint8_t rounds = 64;
+
+    if (!(late >> 32)) {
+        late <<= 32;
+        rounds = 32;
     }
-    if(periodic_thread->last_reference < current_time){
-        //TODO: CATCH 32 bit overflows
-        sancus_debug("ERROR: 32 bit overflow for periodic thread");
+
+    while (rounds--) {
+        uint32_t carry = rem >> 31;
+        rem = (rem << 1) | (uint32_t)(late >> 63);
+        late <<= 1;
+        // rem < 2 * period here, so one subtraction is enough
+        if (carry || rem >= period) {
+            rem -= period;
+        }
     }
+
+    return rem;
+}
+
+/**
+ * @brief Absolute deadline of the current job of a periodic thread
+ *
+ * Deadlines are implicit, i.e. a job has to be done before the next release.
+ */
+static inline uint64_t SM_FUNC(sancus_sm_timer) periodic_deadline(thread_t *thread)
+{
+    return thread->last_reference + thread->period;
+}
+
+/**
+ * @brief Inserts a periodic thread into *list* ordered by deadline
+ *
+ * Threads with equal deadlines keep their arrival order.
+ *
+ * @note Complexity: O(n) with n being the number of ready periodic threads
+ */
+static void SM_FUNC(sancus_sm_timer) sm_rq_insert_by_deadline(clist_node_t *list, thread_t *thread)
+{
+    uint64_t deadline = periodic_deadline(thread);
+    clist_node_t *prev = list->next;
+
+    if (prev) {
+        do {
+            if (periodic_deadline(sm_rq_thread(prev->next)) > deadline) {
+                sm_rq_link_after(prev, thread);
+                return;
+            }
+            prev = prev->next;
+        } while (prev != list->next);
+    }
+
+    // Latest deadline so far, append at the end
+    sm_rq_rpush(list, thread);
+}
+
+/**
+ * @brief Utilisation of a periodic thread in SCHED_PERIODIC_UTIL_SCALE, rounded up
+ *
+ * Returns more than SCHED_PERIODIC_UTIL_SCALE if the thread can not even run on its own.
+ */
+uint32_t SM_FUNC(sancus_sm_timer) sched_periodic_utilisation(uint32_t runtime, uint32_t period)
+{
+    uint32_t demand = runtime + SCHEDULER_OVERHEAD_RUN;
+
+    if (demand > period) {
+        return SCHED_PERIODIC_UTIL_SCALE + 1;
+    }
+
+    // demand < 2^17, so this fits 32 bit
+    uint32_t scaled = demand * SCHED_PERIODIC_UTIL_SCALE;
+    uint32_t util = scaled / period;
+    if (util * period != scaled) {
+        util++;
+    }
+    return util;
+}
+
+/**
+ * @brief Whether the utilisation of @p runtime in @p period fits into @p budget
+ *
+ * Same as sched_periodic_utilisation() <= budget, but without the division.
+ */
+static bool SM_FUNC(sancus_sm_timer) periodic_fits(uint32_t runtime, uint32_t period, uint32_t budget)
+{
+    uint32_t demand = runtime + SCHEDULER_OVERHEAD_RUN;
+
+    return demand <= period
+        && (uint64_t)demand * SCHED_PERIODIC_UTIL_SCALE <= (uint64_t)budget * period;
+}
+
+/**
+ * @brief Largest runtime that fits into @p budget for a thread with @p period
+ */
+static uint32_t SM_FUNC(sancus_sm_timer) periodic_runtime_for(uint32_t budget, uint32_t period)
+{
+    uint64_t demand = ((uint64_t)budget * period) / SCHED_PERIODIC_UTIL_SCALE;
+
+    if (demand <= SCHEDULER_OVERHEAD_RUN) {
+        return 0;
+    }
+    demand -= SCHEDULER_OVERHEAD_RUN;
+    return (demand > UINT16_MAX) ? UINT16_MAX : (uint32_t)demand;
+}
+
+int SM_FUNC(sancus_sm_timer) sched_periodic_admit(thread_t *thread, uint32_t *runtime, uint32_t period)
+{
+    // Changing an existing reservation, 0 if there is none
+    uint32_t current = thread->utilisation;
+    uint32_t budget = SCHED_PERIODIC_UTIL_SCALE - periodic_reserved + current;
+    int res = 0;
+
+    if (!periodic_fits(*runtime, period, budget)) {
+#ifdef SCHED_PERIODIC_DOWNGRADE
+        // Give the thread whatever is left instead
+        *runtime = periodic_runtime_for(budget, period);
+        if (*runtime == 0) {
+            return -EOVERFLOW;
+        }
+        res = 1;
+#else
+        return -EOVERFLOW;
+#endif
+    }
+
+    // Only granted reservations are divided out, once
+    thread->utilisation = sched_periodic_utilisation(*runtime, period);
+    periodic_reserved = periodic_reserved - current + thread->utilisation;
+    return res;
+}
+
+void SM_FUNC(sancus_sm_timer) sched_periodic_release(thread_t *thread)
+{
+    periodic_reserved -= thread->utilisation;
+    thread->utilisation = 0;
+}
+
+uint32_t SM_ENTRY(sancus_sm_timer) sched_periodic_reserved(void)
+{
+    return periodic_reserved;
+}
+
+uint32_t SM_ENTRY(sancus_sm_timer) sched_periodic_free_runtime(uint32_t period)
+{
+    return periodic_runtime_for(SCHED_PERIODIC_UTIL_SCALE - periodic_reserved, period);
+}
+
+void SM_FUNC(sancus_sm_timer) periodic_thread_schedule_next_timer(thread_t *periodic_thread, uint32_t current_time, uint32_t long_term){
+    uint64_t now = ((uint64_t)long_term << 32) | current_time;
+
+    // Move last_reference to the first release that is not in the past
+    if (periodic_thread->last_reference < now) {
+        uint64_t late = now - periodic_thread->last_reference;
+
+        if (late < periodic_thread->period) {
+            // Common case: we are still in the period after the last release
+            periodic_thread->last_reference += periodic_thread->period;
+        } else {
+            // The thread missed whole periods, skip them in one step
+#ifdef SCHED_ACCOUNTING
+            sched_stats[periodic_thread->pid].deadline_misses++;
+#endif
+            uint32_t rem = periodic_remainder(late, periodic_thread->period);
+            periodic_thread->last_reference = now + (rem ? periodic_thread->period - rem : 0);
+        }
+    }
+
     // Set timer to that next reference
-    secure_mintimer_t* timer = get_available_timer(periodic_thread->pid);
+    secure_mintimer_t* timer = secure_mintimer_wakeup_timer(periodic_thread->pid);
+    // Releases are exact, the budget of the thread is accounted from them
+    timer->slack = 0;
     // timer->target = (uint32_t) periodic_thread->last_reference;
     // timer->long_target = (uint32_t) (periodic_thread->last_reference >> 32 );
     // timer->thread = periodic_thread;
     sched_set_status(periodic_thread, STATUS_SLEEPING);
     // _secure_mintimer_set_absolute_explicit( timer, current_time);
-    _secure_mintimer_set_absolute(timer, periodic_thread->last_reference);
+    _secure_mintimer_set_absolute(timer, (uint32_t)periodic_thread->last_reference);
     
 
     // Also reset the original idx
@@ -204,6 +462,110 @@ void SM_FUNC(sancus_sm_timer) periodic_thread_schedule_next_timer(thread_t *peri
     periodic_thread->last_runtime = 0;
 }
 
+#ifdef SCHED_ACCOUNTING
+/**
+ * @brief Charge the time since the last switch to the active thread and count
+ *        the switch to @p next_thread
+ */
+static void SM_FUNC(sancus_sm_timer) sched_account_switch(thread_t *active_thread, thread_t *next_thread)
+{
+    uint32_t now, long_term;
+    _secure_mintimer_now_internal(&now, &long_term);
+
+    // After sched_task_exit, active_thread is NULL but sched_active_pid is still the exited thread
+    if (sched_active_pid != KERNEL_PID_UNDEF) {
+        sched_stats[sched_active_pid].runtime += now - sched_stats_since;
+    }
+    if (active_thread && active_thread->status == STATUS_RUNNING) {
+        sched_stats[active_thread->pid].preemptions++;
+    }
+    sched_stats[next_thread->pid].switches++;
+    sched_stats_since = now;
+}
+
+void SM_FUNC(sancus_sm_timer) sched_stats_reset(kernel_pid_t pid)
+{
+    sched_stats[pid].runtime = 0;
+    sched_stats[pid].switches = 0;
+    sched_stats[pid].preemptions = 0;
+    sched_stats[pid].deadline_misses = 0;
+}
+
+int SM_ENTRY(sancus_sm_timer) sched_stats_snapshot(sched_stats_t *stats, unsigned count)
+{
+    if (count > KERNEL_PID_LAST + 1) {
+        count = KERNEL_PID_LAST + 1;
+    }
+    // Never write into the scheduler on behalf of the caller
+    if (!sancus_is_outside_sm(sancus_sm_timer, (void *)stats, count * sizeof(sched_stats_t))) {
+        return -EFAULT;
+    }
+
+    uint32_t now, long_term;
+    _secure_mintimer_now_internal(&now, &long_term);
+
+    for (unsigned i = 0; i < count; i++) {
+        stats[i] = sched_stats[i];
+    }
+    if (sched_active_pid != KERNEL_PID_UNDEF && (unsigned)sched_active_pid < count) {
+        stats[sched_active_pid].runtime += now - sched_stats_since;
+    }
+    return count;
+}
+#endif
+
+#ifdef SCHED_TRACE
+void SM_FUNC(sancus_sm_timer) sched_trace(uint8_t event, kernel_pid_t pid, uint16_t arg)
+{
+    uint32_t now, long_term;
+    _secure_mintimer_now_internal(&now, &long_term);
+
+    sched_trace_record_t *record = &sched_trace_ring[sched_trace_head];
+    record->time = now;
+    record->event = event;
+    record->pid = pid;
+    record->arg = arg;
+    sched_trace_head = (sched_trace_head + 1) & (SCHED_TRACE_SIZE - 1);
+
+    if (sched_trace_count < SCHED_TRACE_SIZE) {
+        sched_trace_count++;
+    }
+    else if (sched_trace_lost < UINT16_MAX) {
+        // The oldest record was overwritten
+        sched_trace_lost++;
+    }
+}
+
+int SM_ENTRY(sancus_sm_timer) sched_trace_drain(sched_trace_record_t *records, unsigned count)
+{
+    // No buffer of that size fits into the address space
+    if (count > UINT16_MAX / sizeof(sched_trace_record_t)) {
+        return -EFAULT;
+    }
+    if (count > sched_trace_count) {
+        count = sched_trace_count;
+    }
+    // Never write into the scheduler on behalf of the caller
+    if (!sancus_is_outside_sm(sancus_sm_timer, (void *)records, count * sizeof(sched_trace_record_t))) {
+        return -EFAULT;
+    }
+
+    unsigned tail = (sched_trace_head - sched_trace_count) & (SCHED_TRACE_SIZE - 1);
+    for (unsigned i = 0; i < count; i++) {
+        records[i] = sched_trace_ring[(tail + i) & (SCHED_TRACE_SIZE - 1)];
+    }
+    sched_trace_count -= count;
+    return count;
+}
+
+uint16_t SM_ENTRY(sancus_sm_timer) sched_trace_dropped(void)
+{
+    uint16_t lost = sched_trace_lost;
+    sched_trace_lost = 0;
+    return lost;
+}
+#endif
+
 int SM_FUNC(sancus_sm_timer) __attribute__((used)) sched_run_internal(void)
 {
     int changed_thread = 0;
@@ -217,24 +579,22 @@ int SM_FUNC(sancus_sm_timer) __attribute__((used)) sched_run_internal(void)
     // If we were executing a period job, check whether this job has run out of its limit (only if it did not yield)
     if( active_thread 
         && active_thread->status == STATUS_RUNNING  // Do not continue threads that want to exit and removed themselves.
-        && active_thread->priority == SCHED_PERIODIC_PRIO_LEVEL 
-        && !sched_context_switch_request){
+        && active_thread->priority == SCHED_PERIODIC_PRIO_LEVEL){
         // We interrupted a periodic thread. let's check whether this should put it to sleep again
         uint32_t current_time, long_term;
         _secure_mintimer_now_internal(&current_time, &long_term);
-        uint32_t runtime = active_thread->last_runtime - SCHEDULER_OVERHEAD_RUN;
-        
-        // We ignore 32 bit overflows here for now...
-        // TODO: Add 32 bit handling
-        runtime += (current_time - active_thread->last_reference);
-        
+
+        // Only charge the time since the job was switched in, not the time it
+        // spent preempted. The budget interrupt keeps this below the period,
+        // so the difference of the low 32 bit is exact.
+        active_thread->last_runtime += current_time - active_thread->last_dispatch;
+
         // Check whether thread is done
-        if(runtime >= active_thread->runtime){
+        if(active_thread->last_runtime >= active_thread->runtime){
             // This periodic job is done for this period. Put it to sleep.
-            periodic_thread_schedule_next_timer(active_thread, current_time);
-        } else {
-            // We will be scheduling this periodic thread again. Update last runtime and keep going
-            active_thread->last_runtime = runtime;
+            periodic_thread_schedule_next_timer(active_thread, current_time, long_term);
+        } else if (!sched_context_switch_request) {
+            // We will be scheduling this periodic thread again, keep going
             goto end;
         }
     }
@@ -247,7 +607,7 @@ int SM_FUNC(sancus_sm_timer) __attribute__((used)) sched_run_internal(void)
      * since the threading should not be started before at least the idle thread was started.
      */
     int nextrq = bitarithm_lsb_sm_timer(runqueue_bitcache);
-    thread_t *next_thread = container_of(sched_runqueues[nextrq].next->next, thread_t, rq_entry);
+    thread_t *next_thread = sm_rq_thread(sched_runqueues[nextrq].next->next);
 
     sancus_debug2("sched_run: active thread: %" PRIkernel_pid ", next thread: %" PRIkernel_pid "",
           (kernel_pid_t)((active_thread == NULL) ? KERNEL_PID_UNDEF : active_thread->pid),
@@ -258,6 +618,13 @@ int SM_FUNC(sancus_sm_timer) __attribute__((used)) sched_run_internal(void)
         goto end;
     }
 
+#ifdef SCHED_ACCOUNTING
+    sched_account_switch(active_thread, next_thread);
+#endif
+#ifdef SCHED_TRACE
+    sched_trace(SCHED_TRACE_SWITCH, next_thread->pid, sched_active_pid);
+#endif
+
     if (active_thread) {
         if (active_thread->status == STATUS_RUNNING) {
             active_thread->status = STATUS_PENDING;
@@ -281,19 +648,20 @@ int SM_FUNC(sancus_sm_timer) __attribute__((used)) sched_run_internal(void)
 
 end:
     if(sched_active_thread->priority == SCHED_PERIODIC_PRIO_LEVEL){
-        // Rotate periodic clist
-        sm_clist_lpoprpush(&sched_runqueues[SCHED_PERIODIC_PRIO_LEVEL]);
-
-        // We will schedule a periodic job next. Get timestamp for last_reference
+        // The periodic runqueue is ordered by deadline, so no rotation here.
+        // We will schedule a periodic job next. Its execution time counts from now on
         uint32_t short_term, long_term;
         _secure_mintimer_now_internal(&short_term, &long_term);
+        sched_active_thread->last_dispatch = short_term;
 
-        // Set scheduler timer to interrupt this periodic job after its runtime. 
-        // We use the scheduler specific timer for that
-        scheduler_timer.target = short_term + sched_active_thread->runtime - sched_active_thread->last_runtime;
-        scheduler_timer.long_target = long_term;
-        _secure_mintimer_set_absolute_explicit( &scheduler_timer, short_term);
-        // _secure_mintimer_set_absolute(&scheduler_timer, sched_active_thread->runtime - sched_active_thread->last_runtime);
+        // Interrupt this periodic job after its runtime. The budget has its own
+        // compare channel, so this does not touch the timers of the wheels.
+        uint32_t target = short_term + sched_active_thread->runtime - sched_active_thread->last_runtime;
+        secure_mintimer_budget_set(target, long_term + (target < short_term));
+    }
+    else if (changed_thread) {
+        // No periodic job runs, so there is no budget to enforce
+        secure_mintimer_budget_clear();
     }
     return changed_thread;
 }
@@ -312,18 +680,26 @@ void SM_FUNC(sancus_sm_timer) sched_set_status(thread_t *process, thread_status_
         if (!(process->status >= STATUS_ON_RUNQUEUE)) {
             sancus_debug2("sched_set_status: adding thread %" PRIkernel_pid " to runqueue %" PRIu8 ".",
                   process->pid, process->priority);
-            sm_clist_rpush(&sched_runqueues[process->priority], &(process->rq_entry));
-            runqueue_bitcache |= 1 << process->priority;
+#ifdef SCHED_TRACE
+            sched_trace(SCHED_TRACE_WAKEUP, process->pid, process->status);
+#endif
+            if (process->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+                sm_rq_insert_by_deadline(&sched_runqueues[process->priority], process);
+            }
+            else {
+                sm_rq_rpush(&sched_runqueues[process->priority], process);
+            }
+            runqueue_bitcache |= (runqueue_bitcache_t)1 << process->priority;
         }
     }
     else {
         if (process->status >= STATUS_ON_RUNQUEUE) {
             sancus_debug2("sched_set_status: removing thread %" PRIkernel_pid " from runqueue %" PRIu8 ".",
                   process->pid, process->priority);
-            sm_clist_lpop(&sched_runqueues[process->priority]);
+            sm_rq_remove(&sched_runqueues[process->priority], process);
 
             if (!sched_runqueues[process->priority].next) {
-                runqueue_bitcache &= ~(1 << process->priority);
+                runqueue_bitcache &= ~((runqueue_bitcache_t)1 << process->priority);
             }
         }
     }
@@ -337,6 +713,44 @@ void SM_ENTRY(sancus_sm_timer) sched_set_own_status(thread_status_t status){
     sched_set_status(me, status);
 }
 
+void SM_FUNC(sancus_sm_timer) sched_change_priority(thread_t *thread, uint8_t priority)
+{
+    uint8_t old = thread->priority;
+
+    if (old == priority) {
+        return;
+    }
+
+    if (thread->status >= STATUS_ON_RUNQUEUE) {
+        sm_rq_remove(&sched_runqueues[old], thread);
+        if (!sched_runqueues[old].next) {
+            runqueue_bitcache &= ~((runqueue_bitcache_t)1 << old);
+        }
+        // A raised thread runs before its new peers, a lowered one after them
+        if (priority < old) {
+            sm_rq_lpush(&sched_runqueues[priority], thread);
+        }
+        else {
+            sm_rq_rpush(&sched_runqueues[priority], thread);
+        }
+        runqueue_bitcache |= (runqueue_bitcache_t)1 << priority;
+    }
+    thread->priority = priority;
+
+    // Reschedule if the active thread was lowered or another runnable
+    // thread was raised above it
+    thread_t *active_thread = (thread_t *)sched_active_thread;
+    if (active_thread == thread) {
+        if (priority > old) {
+            sched_context_switch_request = 1;
+        }
+    }
+    else if (active_thread && thread->status >= STATUS_ON_RUNQUEUE
+             && priority < active_thread->priority) {
+        sched_context_switch_request = 1;
+    }
+}
+
 void sched_switch(USED_IN_ASM uint16_t other_prio)
 {   
     // move other_prio which is in r15 into r13
@@ -383,24 +797,106 @@ void SM_FUNC(sancus_sm_timer) sched_switch_internal(uint16_t other_prio){
     sched_switch_internal_allow_yield(other_prio, true);
 }
 
+int SM_FUNC(sancus_sm_timer) sched_yield_fast_internal(void){
+    thread_t *me = (thread_t *)sched_active_thread;
+
+    // Periodic threads leave the runqueue on a yield, so they always take the full path
+    if (me == NULL || me->status != STATUS_RUNNING || me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        return 0;
+    }
+    if (bitarithm_lsb_sm_timer(runqueue_bitcache) != me->priority) {
+        return 0;
+    }
+
+    // Alone on its runqueue, rotating it would pick the same thread again
+    clist_node_t *tail = sched_runqueues[me->priority].next;
+    return tail == &me->rq_entry && tail->next == tail;
+}
+
+#ifdef SCHED_TICKLESS_IDLE
+typedef struct {
+    uint16_t sr;            // status register bits that enter the mode
+    uint16_t latency;       // wake latency in secure_mintimer ticks
+    uint8_t stops_timer;    // whether the mode stops SMCLK and the secure_mintimer
+} sched_lpm_t;
+
+// Low-power modes for a parked thread, deepest first.
+// The secure_mintimer runs from SMCLK, which only LPM0 and LPM1 keep running.
+SM_DATA(sancus_sm_timer) static const sched_lpm_t sched_lpm_modes[] = {
+#ifdef SCHED_IDLE_STOP_TIMER
+    { CPUOFF | SCG0 | SCG1, SCHED_IDLE_LPM3_LATENCY, 1 },
+#endif
+    { CPUOFF | SCG0, SCHED_IDLE_LPM1_LATENCY, 0 },
+    { CPUOFF, SCHED_IDLE_LPM0_LATENCY, 0 },
+};
+
+SM_DATA(sancus_sm_timer) thread_t *sched_idle_parked = NULL;
+SM_DATA(sancus_sm_timer) uint16_t sched_idle_sr = 0;
+
+// Whether the thread is the only one that could run at all
+static int SM_FUNC(sancus_sm_timer) sched_idle_alone(thread_t *thread){
+    clist_node_t *tail = sched_runqueues[thread->priority].next;
+    return runqueue_bitcache == ((runqueue_bitcache_t)1 << thread->priority)
+        && tail == &thread->rq_entry && tail->next == tail;
+}
+
+void SM_FUNC(sancus_sm_timer) sched_idle_internal(void){
+    thread_t *me = (thread_t *)sched_active_thread;
+
+    // SMs are always restored with a clean status register, so only
+    // unprotected threads can be parked. A thread with others runnable
+    // below it would only stall them.
+    if (me != NULL && !me->is_sm && me->status == STATUS_RUNNING
+        && me->priority != SCHED_PERIODIC_PRIO_LEVEL && sched_idle_alone(me)) {
+        sched_idle_parked = me;
+    }
+}
+
+uint16_t SM_FUNC(sancus_sm_timer) sched_idle_lpm_internal(void){
+    thread_t *me = (thread_t *)sched_active_thread;
+
+    sched_idle_sr = 0;
+    if (me != sched_idle_parked) {
+        // The parked thread picks its mode again once it is restored
+        return 0;
+    }
+
+    if (me->status == STATUS_RUNNING && sched_idle_alone(me)) {
+        uint32_t distance = secure_mintimer_next_distance();
+        for (unsigned i = 0; i < ARRAY_SIZE(sched_lpm_modes); i++) {
+            if (sched_lpm_modes[i].latency < distance
+                && (!sched_lpm_modes[i].stops_timer || distance == UINT32_MAX)) {
+                sched_idle_sr = sched_lpm_modes[i].sr;
+                return sched_idle_sr;
+            }
+        }
+    }
+
+    // The next timer is too close or another thread got runnable: let it run
+    sched_idle_parked = NULL;
+    return 0;
+}
+#endif
+
 /**
  * This is a replacement for the old thread_yield that was in thread.c.
  * It simply places the thread back on the runqueue. After this, yield_higher should be called.
  * */
 void SM_FUNC(sancus_sm_timer) sched_yield(void){
     thread_t *me = (thread_t *)sched_active_thread;
-    if (me != NULL && me->status >= STATUS_ON_RUNQUEUE) {
+    // Periodic threads are not rotated, they leave the runqueue until their next release
+    if (me != NULL && me->status >= STATUS_ON_RUNQUEUE && me->priority != SCHED_PERIODIC_PRIO_LEVEL) {
         sm_clist_lpoprpush(&sched_runqueues[me->priority]);
     }
 
     if(me->priority == SCHED_PERIODIC_PRIO_LEVEL){
-        // Disable the pending scheduler timer
-        secure_mintimer_remove(&scheduler_timer);
+        // Disable the pending budget
+        secure_mintimer_budget_clear();
 
         // A periodic thread is sleeping --> Schedule next wakeup by making it sleep
         uint32_t short_term, long_term;
         _secure_mintimer_now_internal(&short_term, &long_term);
-        periodic_thread_schedule_next_timer(me, short_term);
+        periodic_thread_schedule_next_timer(me, short_term, long_term);
 
         sched_context_switch_request = 1;
     }
@@ -412,6 +908,20 @@ void SM_FUNC(sancus_sm_timer) sched_task_exit_internal(void){
         sancus_debug1("sched_task_exit: ending thread %" PRIkernel_pid "...\n", sched_active_thread->pid);
     
         sched_threads[sched_active_pid].in_use = 0;
+        sched_periodic_release((thread_t *)sched_active_thread);
+#ifdef SCHED_TICKLESS_IDLE
+        if (sched_idle_parked == sched_active_thread) {
+            sched_idle_parked = NULL;
+        }
+#endif
+        secure_mintimer_free_all(sched_active_pid);
+        mutex_thread_exit((thread_t *)sched_active_thread);
+#ifdef MODULE_CORE_MSG
+        msg_thread_exit((thread_t *)sched_active_thread);
+#endif
+#ifdef MODULE_SPSC
+        spsc_thread_exit(sched_active_pid);
+#endif
         
         sched_num_threads--;
 
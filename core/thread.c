@@ -146,9 +146,23 @@ kernel_pid_t SM_FUNC(sancus_sm_timer) _thread_create_scheduler_internal(uint8_t
     sched_threads[pid].in_use = 1;
     sched_threads[pid].pid = pid;
     sched_threads[pid].priority = priority;
+    sched_threads[pid].base_priority = priority;
+    sched_threads[pid].mutex_held = NULL;
+    sched_threads[pid].mutex_wait = NULL;
+    sched_threads[pid].utilisation = 0;
     sched_threads[pid].is_sm = is_sm;
     sched_threads[pid].sp = thread_sp_init;
     sched_threads[pid].rq_entry.next = NULL;
+    sched_threads[pid].rq_prev = NULL;
+#ifdef SCHED_ACCOUNTING
+    sched_stats_reset(pid);
+#endif
+#ifdef MODULE_CORE_MSG
+    msg_thread_init(&sched_threads[pid]);
+#endif
+#ifdef MODULE_CORE_THREAD_FLAGS
+    sched_threads[pid].flags = 0;
+#endif
     
     sched_num_threads++;
     sched_set_status(&sched_threads[pid], STATUS_PENDING);
@@ -223,13 +237,6 @@ kernel_pid_t thread_create(char *stack, int stacksize, uint8_t priority, int fla
         sched_switch(priority);
     }
 
-// #ifdef MODULE_CORE_MSG
-//     thread->wait_data = NULL;
-//     thread->msg_waiters.next = NULL;
-//     cib_init(&(thread->msg_queue), 0);
-//     thread->msg_array = NULL;
-// #endif
-
     return pid;
 }
 
@@ -269,30 +276,44 @@ kernel_pid_t thread_create_protected(
         sched_switch(priority);
     }
 
-// #ifdef MODULE_CORE_MSG
-//     thread->wait_data = NULL;
-//     thread->msg_waiters.next = NULL;
-//     cib_init(&(thread->msg_queue), 0);
-//     thread->msg_array = NULL;
-// #endif
-
     return pid;
 }
 
-void SM_ENTRY(sancus_sm_timer) thread_change_to_periodical(kernel_pid_t pid, uint16_t runtime, uint32_t period){
+int SM_ENTRY(sancus_sm_timer) thread_change_to_periodical(kernel_pid_t pid, uint16_t runtime, uint32_t period){
+
+    if (!pid_is_valid(pid) || !sched_threads[pid].in_use || period == 0) {
+        return -EINVAL;
+    }
+
+    // Periodic releases need the wakeup timer of the thread, make sure there is one
+    if (secure_mintimer_wakeup_timer(pid) == NULL) {
+        return -ENOMEM;
+    }
+
+    // Admission control: periodic threads are scheduled EDF, which meets all
+    // deadlines as long as their total utilisation stays at or below 100%.
+    uint32_t granted = runtime;
+    int res = sched_periodic_admit(&sched_threads[pid], &granted, period);
+    if (res < 0) {
+        sancus_debug1("thread_change_to_periodical: rejecting %" PRIkernel_pid ", not schedulable", pid);
+        return res;
+    }
 
     sched_set_status(&sched_threads[pid], STATUS_SLEEPING);
     sched_threads[pid].priority = SCHED_PERIODIC_PRIO_LEVEL;
+    sched_threads[pid].base_priority = SCHED_PERIODIC_PRIO_LEVEL;
     sched_threads[pid].period = period;
 
+    // The first job is released after one period
     uint32_t short_term, long_term;
     _secure_mintimer_now_internal(&short_term, &long_term);
-    sched_threads[pid].last_reference = short_term;
+    sched_threads[pid].last_reference = (((uint64_t)long_term << 32) | short_term) + period;
     
     sched_threads[pid].last_runtime = 0;
-    sched_threads[pid].runtime = runtime;
+    sched_threads[pid].runtime = granted;
     sched_threads[pid].original_idx = sched_threads[pid].sm_idx; // store original idx for later
     
     _secure_mintimer_tsleep_specific_pid(period, pid);
     
-}
\ No newline at end of file
+    return res;
+}
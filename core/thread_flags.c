@@ -19,6 +19,7 @@
  */
 
 
+#include <errno.h>
 #include "thread_flags.h"
 #include "irq.h"
 #include "thread.h"
@@ -26,82 +27,71 @@
 #define ENABLE_DEBUG (0)
 #include "debug.h"
 
-static thread_flags_t _thread_flags_clear_atomic(thread_t *thread, thread_flags_t mask)
+static thread_flags_t SM_FUNC(sancus_sm_timer) _thread_flags_clear(thread_t *thread, thread_flags_t mask)
 {
-    unsigned state = irq_disable();
     mask &= thread->flags;
     thread->flags &= ~mask;
-    irq_restore(state);
     return mask;
 }
 
-static void _thread_flags_wait(thread_flags_t mask, thread_t *thread, unsigned threadstate, unsigned irqstate)
+/**
+ * @brief Flags of @p thread that meet the condition of @p mode, 0 if none
+ */
+static thread_flags_t SM_FUNC(sancus_sm_timer) _thread_flags_ready(thread_t *thread,
+                                                                  thread_flags_t mask, unsigned mode)
 {
-    DEBUG("_thread_flags_wait: me->flags=0x%08x me->mask=0x%08x. going blocked.\n",
-            (unsigned)thread->flags, (unsigned)mask);
-
-    thread->wait_data = (void *)(unsigned)mask;
-    sched_set_status(thread, threadstate);
-    irq_restore(irqstate);
-    thread_yield_higher();
+    thread_flags_t set = thread->flags & mask;
+    switch (mode) {
+        case THREAD_FLAGS_WAIT_ALL:
+            return set == mask ? set : 0;
+        case THREAD_FLAGS_WAIT_ONE:
+            /* clear all but least significant bit */
+            return set & (~set + 1);
+        default:
+            return set;
+    }
 }
 
-thread_flags_t thread_flags_clear(thread_flags_t mask)
+thread_flags_t SM_ENTRY(sancus_sm_timer) thread_flags_clear(thread_flags_t mask)
 {
     thread_t *me = (thread_t*) sched_active_thread;
-    mask = _thread_flags_clear_atomic(me, mask);
-    DEBUG("thread_flags_clear(): pid %"PRIkernel_pid" clearing 0x%08x\n", thread_getpid(), mask);
+    if (me == NULL) {
+        return 0;
+    }
+    mask = _thread_flags_clear(me, mask);
+    sancus_debug2("thread_flags_clear(): pid %"PRIkernel_pid" clearing 0x%04x\n", me->pid, mask);
     return mask;
 }
 
-static void _thread_flags_wait_any(thread_flags_t mask)
+thread_flags_t SM_ENTRY(sancus_sm_timer) _thread_flags_wait(thread_flags_t mask, unsigned mode)
 {
     thread_t *me = (thread_t*) sched_active_thread;
-    unsigned state = irq_disable();
-    if (!(me->flags & mask)) {
-        _thread_flags_wait(mask, me, STATUS_FLAG_BLOCKED_ANY, state);
+    if (me == NULL) {
+        return 0;
     }
-    else {
-        irq_restore(state);
-    }
-}
-
-thread_flags_t thread_flags_wait_any(thread_flags_t mask)
-{
-    thread_t *me = (thread_t*) sched_active_thread;
-    _thread_flags_wait_any(mask);
-    return _thread_flags_clear_atomic(me, mask);
-}
-
-thread_flags_t thread_flags_wait_one(thread_flags_t mask)
-{
-    _thread_flags_wait_any(mask);
-    thread_t *me = (thread_t*) sched_active_thread;
-    thread_flags_t tmp = me->flags & mask;
-    /* clear all but least significant bit */
-    tmp &= (~tmp + 1);
-    return _thread_flags_clear_atomic(me, tmp);
-}
 
-thread_flags_t thread_flags_wait_all(thread_flags_t mask)
-{
-    unsigned state = irq_disable();
-    thread_t *me = (thread_t*) sched_active_thread;
-    if (!((me->flags & mask) == mask)) {
-        DEBUG("thread_flags_wait_all(): pid %"PRIkernel_pid" waiting for %08x\n", thread_getpid(), (unsigned)mask);
-        _thread_flags_wait(mask, me, STATUS_FLAG_BLOCKED_ALL, state);
+    thread_flags_t ready = _thread_flags_ready(me, mask, mode);
+    if (ready) {
+        return _thread_flags_clear(me, ready);
     }
-    else {
-        irq_restore(state);
+
+    // Periodic threads are released by the timer, a yield ends their job
+    if (me->priority == SCHED_PERIODIC_PRIO_LEVEL || me->status != STATUS_RUNNING) {
+        return 0;
     }
 
-    return _thread_flags_clear_atomic(me, mask);
+    sancus_debug2("_thread_flags_wait: me->flags=0x%04x mask=0x%04x. going blocked.\n",
+            (unsigned)me->flags, (unsigned)mask);
+    me->wait_flags = mask;
+    sched_set_status(me, mode == THREAD_FLAGS_WAIT_ALL ?
+                     STATUS_FLAG_BLOCKED_ALL : STATUS_FLAG_BLOCKED_ANY);
+    return 0;
 }
 
-inline int __attribute__((always_inline)) thread_flags_wake(thread_t *thread)
+int SM_FUNC(sancus_sm_timer) thread_flags_wake(thread_t *thread)
 {
     unsigned wakeup;
-    thread_flags_t mask = (uint16_t)(unsigned)thread->wait_data;
+    thread_flags_t mask = thread->wait_flags;
     switch(thread->status) {
         case STATUS_FLAG_BLOCKED_ANY:
             wakeup = (thread->flags & mask);
@@ -115,24 +105,63 @@ inline int __attribute__((always_inline)) thread_flags_wake(thread_t *thread)
     }
 
     if (wakeup) {
-        DEBUG("_thread_flags_wake(): waking up pid %"PRIkernel_pid"\n", thread->pid);
+        sancus_debug1("_thread_flags_wake(): waking up pid %"PRIkernel_pid"\n", thread->pid);
         sched_set_status(thread, STATUS_PENDING);
-        sched_context_switch_request = 1;
     }
 
     return wakeup;
 }
 
-void thread_flags_set(thread_t *thread, thread_flags_t mask)
+int SM_FUNC(sancus_sm_timer) thread_flags_set_internal(thread_t *thread, thread_flags_t mask)
 {
-    DEBUG("thread_flags_set(): setting 0x%08x for pid %"PRIkernel_pid"\n", mask, thread->pid);
-    unsigned state = irq_disable();
     thread->flags |= mask;
-    if (thread_flags_wake(thread)) {
-        irq_restore(state);
+    if (!thread_flags_wake(thread) || sched_active_thread == NULL) {
+        return 0;
+    }
+    // Only request the switch, the interrupted or calling thread is still active
+    sched_switch_internal_allow_yield(thread->priority, false);
+    return thread->priority < sched_active_thread->priority;
+}
+
+int SM_ENTRY(sancus_sm_timer) _thread_flags_set(kernel_pid_t pid, thread_flags_t mask)
+{
+    if (!pid_is_valid(pid) || !sched_threads[pid].in_use) {
+        return -EINVAL;
+    }
+
+    sancus_debug2("thread_flags_set(): setting 0x%04x for pid %"PRIkernel_pid"\n", mask, pid);
+    return thread_flags_set_internal(&sched_threads[pid], mask);
+}
+
+int thread_flags_set(kernel_pid_t pid, thread_flags_t mask)
+{
+    int res = _thread_flags_set(pid, mask);
+    if (res > 0 && !irq_is_in()) {
         thread_yield_higher();
     }
-    else {
-        irq_restore(state);
+    return res < 0 ? res : 0;
+}
+
+static thread_flags_t _thread_flags_wait_mode(thread_flags_t mask, unsigned mode)
+{
+    thread_flags_t res;
+    while ((res = _thread_flags_wait(mask, mode)) == 0) {
+        thread_yield_higher();
     }
+    return res;
+}
+
+thread_flags_t thread_flags_wait_any(thread_flags_t mask)
+{
+    return _thread_flags_wait_mode(mask, THREAD_FLAGS_WAIT_ANY);
+}
+
+thread_flags_t thread_flags_wait_one(thread_flags_t mask)
+{
+    return _thread_flags_wait_mode(mask, THREAD_FLAGS_WAIT_ONE);
+}
+
+thread_flags_t thread_flags_wait_all(thread_flags_t mask)
+{
+    return _thread_flags_wait_mode(mask, THREAD_FLAGS_WAIT_ALL);
 }
@@ -8,6 +8,8 @@
  * directory for more details.
  */
 
+#include <errno.h>
+
 #include "secure_mintimer.h"
 #include "cpu.h"
 #include "irq.h"
@@ -19,7 +21,47 @@
 
 const SM_DATA(sancus_sm_timer) int thread_sm_idx_offset = offsetof(thread_t, sm_idx);
 
+#ifdef SCHED_WCET
+SM_DATA(sancus_sm_timer) uint16_t sched_wcet_start;
+SM_DATA(sancus_sm_timer) uint8_t sched_wcet_path = SCHED_WCET_PATHS;
+SM_DATA(sancus_sm_timer) static uint16_t sched_wcet_max[SCHED_WCET_PATHS];
+
+void SM_FUNC(sancus_sm_timer) sched_wcet_stop(void)
+{
+    // Paths are much shorter than a timer period, 16 bit suffice
+    uint16_t ticks = TIMER_BASE->R - sched_wcet_start;
+
+    // The path of exitless_entry comes from the caller, ignore unknown ones
+    if (sched_wcet_path < SCHED_WCET_PATHS && ticks > sched_wcet_max[sched_wcet_path]) {
+        sched_wcet_max[sched_wcet_path] = ticks;
+    }
+    sched_wcet_path = SCHED_WCET_PATHS;
+}
+
+int SM_ENTRY(sancus_sm_timer) sched_wcet_snapshot(uint16_t *max, unsigned count)
+{
+    if (count > SCHED_WCET_PATHS) {
+        count = SCHED_WCET_PATHS;
+    }
+    // Never write into the scheduler on behalf of the caller
+    if (!sancus_is_outside_sm(sancus_sm_timer, (void *)max, count * sizeof(uint16_t))) {
+        return -EFAULT;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        max[i] = sched_wcet_max[i];
+    }
+    return count;
+}
+#endif
+
 void thread_yield_higher(void){
+    // First ask the scheduler whether we would be picked again anyway.
+    // If so, we can skip the full context save and restore.
+    ___MACRO_EXITLESS_CALL_FAST(EXITLESS_FUNCTION_TYPE_YIELD_FAST)
+    __asm__ ("tst r15");
+    __asm__ ("jnz yield_higher_continue");
+
     //store pc as continue label
     __asm__ ("mov #yield_higher_continue, r10");
 
@@ -95,6 +137,51 @@ void SM_ENTRY(sancus_sm_timer)  __attribute__((naked, noreturn)) exitless_entry(
     // to denote a return. If not, we do not change anything.
     // we can use r15 for caller id since it is not used by the function call
     
+    /*
+     * Fast yield: This does not touch the state of the active thread at all.
+     * If the caller would be scheduled again, we return right away with r15 = 1,
+     * otherwise with r15 = 0 so that it does a full yield.
+    */
+    ___MACRO_WCET_START_EXITLESS
+
+    __asm__("cmp %0, r15" : : "i"(EXITLESS_FUNCTION_TYPE_YIELD_FAST));
+    __asm__("jne 4f");
+    // Only unprotected callers can be resumed with a reti to their own stack.
+    // Protected callers fall through and are treated like a normal yield.
+    __asm__("push r15");
+    __asm__(".word 0x1387"); // sancus_get_caller_id
+    __asm__("cmp %0, r15" : : "i"(SM_ID_UNPROTECTED));
+    __asm__("pop r15");
+    __asm__("jne 4f");
+        // A pending timer interrupt has to be handled by the full path
+        __asm__("clr r15");
+        __asm__("bit %0, %1" : : "i"(TIMER_CTL_IFG), "m"(TIMER_BASE->CTL));
+        __asm__("jnz 5f");
+        __asm__("bit %0, %1" : : "i"(TIMER_CCTL_CCIFG), "m"(TIMER_BASE->CCTL[0]));
+        __asm__("jnz 5f");
+        // Keep the caller SP, the call may clobber r14
+        __asm__("push r14");
+        __asm__("call %0" : : "i"(sched_yield_fast_internal));
+        __asm__("pop r14");
+        __asm__("5:");
+#ifdef SCHED_WCET
+        __asm__("push r15");
+        __asm__("push r14");
+        ___MACRO_WCET_STOP
+        __asm__("pop r14");
+        __asm__("pop r15");
+#endif
+        // Clear what the scheduler may have left and return to the caller
+        __asm__("clr r12");
+        __asm__("clr r13");
+        __asm__("mov r14, r1");
+        __asm__("clr r14");
+        // Same as in the restore context, never let callers set CPUOFF or SCG1
+        __asm__ volatile("bic  %0, 0(r1)" : : "i"(CPUOFF));
+        __asm__ volatile("bic  %0, 0(r1)" : : "i"(SCG1));
+        __asm__ volatile("reti");
+    __asm__("4:");
+
     /*
      * First, store context of active thread.
     */
@@ -171,13 +258,25 @@ void SM_ENTRY(sancus_sm_timer)  __attribute__((naked, noreturn)) exitless_entry(
     __asm__("cmp %0, r15" : : "i"(EXITLESS_FUNCTION_TYPE_SLEEP));
     __asm__("jne 1f");
         // We are timer sleep
-        // In this case, we have a uint32_t in r13 and r12.
+        // In this case, we have a uint32_t in r13 and r12 and the long offset in r9 and r8.
         __asm__("mov r13, r15");
         __asm__("mov r12, r14");
+        __asm__("mov r9, r13");
+        __asm__("mov r8, r12");
         __asm__("call %0" : : "i"(_secure_mintimer_tsleep_internal));
         // After sleeping, yield to a higher thread.
         __asm__("jmp .default");
 
+#ifdef SCHED_TICKLESS_IDLE
+    __asm__("1:");
+    __asm__("cmp %0, r15" : : "i"(EXITLESS_FUNCTION_TYPE_IDLE));
+    __asm__("jne 1f");
+        // We are idle
+        // Park the thread, the restore context below then enters the low-power mode.
+        __asm__("call %0" : : "i"(sched_idle_internal));
+        __asm__("jmp .default");
+#endif
+
     // default: yield
     // on yield, set sched_context_switch_request to 1. 
     __asm__("1:");
@@ -3,9 +3,20 @@
 #ifdef EVALUATION_ENABLED
 timing_measurement_t timings[EVALUATION_TIMING_SIZE];
 uint16_t timing_counter = 0;
+uint16_t timing_dropped = 0;
 bool timing_running = false;
 uint8_t clock_divider;
 
+static const char *timing_type_names[TIMING_TYPE_COUNT] = {
+    [TIMING_TYPE_UNUSED]            = "unused",
+    [TIMING_TYPE_THREAD_CREATE]     = "create",
+    [TIMING_TYPE_SWITCH_PERIODIC]   = "periodic_switch",
+    [TIMING_TYPE_CONTEXT_EXIT]      = "exit",
+    [TIMING_TYPE_SLEEP]             = "sleep",
+    [TIMING_TYPE_YIELD]             = "yield",
+    [TIMING_TYPE_GET_TIME]          = "get_time",
+};
+
 void init_eval_helper(){
     switch(TIMERA_CLOCK_DIVIDER){
         case TIMER_CTL_ID_DIV2:
@@ -21,4 +32,24 @@ void init_eval_helper(){
         clock_divider = 1;
     }
 }
-#endif
\ No newline at end of file
+
+void eval_dump(void){
+    // A measurement that is still running stays in the table
+    uint16_t done = timing_counter;
+
+    printf("bench_divider,%u\n", clock_divider);
+    for(uint16_t i=0; i < done; i++){
+        printf("bench,%s,%s,%lu,%lu\n", timing_type_names[timings[i].type],
+            timings[i].desc, timings[i].start, timings[i].end);
+    }
+    if(timing_dropped){
+        printf("bench_dropped,%u\n", timing_dropped);
+    }
+
+    if(timing_running){
+        timings[0] = timings[done];
+    }
+    timing_counter = 0;
+    timing_dropped = 0;
+}
+#endif
@@ -152,6 +152,8 @@ extern "C" {
 #define EXITLESS_FUNCTION_TYPE_EXIT  2
 #define EXITLESS_FUNCTION_TYPE_SCHED_SWITCH  3
 #define EXITLESS_FUNCTION_TYPE_SLEEP  4
+#define EXITLESS_FUNCTION_TYPE_YIELD_FAST  5
+#define EXITLESS_FUNCTION_TYPE_IDLE  6
 
 #define USED_IN_ASM __attribute__ ((unused))
 
@@ -177,13 +179,59 @@ extern "C" {
     __asm__ ("pop r13");                                             \
     __asm__ ("pop r12");                                             
     
+/**
+ * Registers an SM declares live across an exitless yield or sleep.
+ * The callee-save registers r4-r11 are always preserved as they come back
+ * through the return frame of the SM entry stub (__ret_entry). Of r12-r15,
+ * only the registers marked live are saved and restored.
+ */
+#define SM_LIVE_R12     (1 << 12)
+#define SM_LIVE_R13     (1 << 13)
+#define SM_LIVE_R14     (1 << 14)
+#define SM_LIVE_R15     (1 << 15)
+#define SM_LIVE_NONE    0
+#define SM_LIVE_ALL     (SM_LIVE_R12 | SM_LIVE_R13 | SM_LIVE_R14 | SM_LIVE_R15)
+
+#define ___MACRO_STR(x)     #x
+#define ___MACRO_XSTR(x)    ___MACRO_STR(x)
+
+/* The live mask is evaluated by the assembler so it has to be a constant expression */
+#define ___MACRO_SAVE_LIVE_REGISTER(reg, mask, live)                             \
+    __asm__ (".if (" ___MACRO_XSTR(live) ") & (" ___MACRO_XSTR(mask) ")\n\t"     \
+             "push " #reg "\n\t"                                                 \
+             ".endif");
+
+#define ___MACRO_RESTORE_LIVE_REGISTER(reg, mask, live)                          \
+    __asm__ (".if (" ___MACRO_XSTR(live) ") & (" ___MACRO_XSTR(mask) ")\n\t"     \
+             "pop " #reg "\n\t"                                                  \
+             ".endif");
+
+#define ___MACRO_SAVE_LIVE_REGISTERS(live)                   \
+    ___MACRO_SAVE_LIVE_REGISTER(r15, SM_LIVE_R15, live)     \
+    ___MACRO_SAVE_LIVE_REGISTER(r14, SM_LIVE_R14, live)     \
+    ___MACRO_SAVE_LIVE_REGISTER(r13, SM_LIVE_R13, live)     \
+    ___MACRO_SAVE_LIVE_REGISTER(r12, SM_LIVE_R12, live)
+
+#define ___MACRO_RESTORE_LIVE_REGISTERS(live)                \
+    ___MACRO_RESTORE_LIVE_REGISTER(r12, SM_LIVE_R12, live)  \
+    ___MACRO_RESTORE_LIVE_REGISTER(r13, SM_LIVE_R13, live)  \
+    ___MACRO_RESTORE_LIVE_REGISTER(r14, SM_LIVE_R14, live)  \
+    ___MACRO_RESTORE_LIVE_REGISTER(r15, SM_LIVE_R15, live)
+
 #define ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_COMMON(function_type, sm)   \
-    ___MACRO_SAVE_REGISTERS                                         \
-    /* Back up r10 and store next PC jump point at end of this macro*/\
-    __asm__ ("mov #9f, r10");                   \
-    /* Push next PC (in r10) ret later */               \
-    __asm__ ("push r10");                                           \
-    /* Push context */                                              \
+    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_LIVE(function_type, sm, SM_LIVE_ALL)
+
+#define ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_LIVE(function_type, sm, live)   \
+    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_ARGS(function_type, sm, live, )
+
+/* args is emitted right before the call, after r4-r11 are saved and cleared.
+ * It can load extra arguments into r8 and r9 (e.g. the long sleep offset).
+*/
+#define ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_ARGS(function_type, sm, live, args) \
+    ___MACRO_SAVE_LIVE_REGISTERS(live)                              \
+    /* Push next PC (end of this macro) to ret to later */          \
+    __asm__ ("push #9f");                                           \
+    /* Push context in the order __ret_entry pops it */             \
     __asm__ ("push r6");                                            \
     __asm__ ("clr r6");                                             \
     __asm__ ("push r7");                                            \
@@ -208,11 +256,12 @@ extern "C" {
     /* Save r1 as SP */                                             \
     /* __sm_foo_ssa_sp */             \
     __asm__ ("mov r1, &__sm_" #sm "_sp");                       \
+    args                                                            \
     /* Perform the call to scheduler */                             \
     ___MACRO_PREPARE_EXITLESS_CALL_COMMON(function_type)            \
-    /* End label and pop r10 again */                               \
+    /* End label, __ret_entry already restored r4-r11 */            \
     __asm__ ("9:");                            \
-    ___MACRO_RESTORE_REGISTERS                                       
+    ___MACRO_RESTORE_LIVE_REGISTERS(live)
 
 /**
  * Internal version for yielding. Is called by the scheduler.c
@@ -238,6 +287,31 @@ NORETURN SM_FUNC(sancus_sm_timer) __attribute__((naked)) void thread_yield_highe
     /* restore r10 */                                   \
     __asm__ ("pop r10");                                
 
+/**
+ * Cheap exitless call for unprotected threads that only asks whether the scheduler would
+ * pick the caller again. Instead of the full context, only the PC and r2 for a reti and the
+ * registers clobbered by the scheduler entry (r6, r7, r10, r11) are pushed. 
+ * Afterwards, r15 is 1 if the caller can simply continue and 0 if it has to do a full yield.
+ * */
+#define ___MACRO_EXITLESS_CALL_FAST(function_type)             \
+    /* store registers the scheduler entry clobbers */  \
+    __asm__ ("push r11");                               \
+    __asm__ ("push r7");                                \
+    __asm__ ("push r6");                                \
+    __asm__ ("push r10");                               \
+    /* store pc as continue label */                    \
+    __asm__ ("mov #9f, r10");                           \
+    /* Push PC (in r10) and r2 for reti later */        \
+    __asm__ ("push r10");                               \
+    __asm__ ("push r2");                                \
+    /* Then do the exitless call */                     \
+    ___MACRO_PREPARE_EXITLESS_CALL(function_type)       \
+    __asm__ ("9:");                                     \
+    __asm__ ("pop r10");                                \
+    __asm__ ("pop r6");                                 \
+    __asm__ ("pop r7");                                 \
+    __asm__ ("pop r11");
+
 /**
  * Function to use as an entry point for exitless calls (calls that are not direclty
  * returned to but indirectly through the next scheduling.)
@@ -431,7 +505,56 @@ extern char SM_DATA(sancus_sm_timer) __isr_stack[ISR_STACKSIZE];
  * This means first checking whether the scheduled thread is an sm or not and then
  * executing the corresponding restore macro
  */
+#ifdef SCHED_TICKLESS_IDLE
+/**
+ * @brief   Pick the low-power mode if the parked idle thread is restored
+ * Leaves the status register bits in sched_idle_sr, see sched_idle_lpm_internal.
+ */
+#define ___MACRO_IDLE_SELECT_LPM                                             \
+    __asm__ volatile ("tst &%0" : : "m"(sched_idle_parked));                 \
+    __asm__ volatile ("jz 6f");                                              \
+    __asm__ volatile ("call %0" : : "i"(sched_idle_lpm_internal));           \
+    __asm__ volatile ("6:");
+
+/**
+ * @brief   Let the reti of an untrusted thread enter the chosen low-power mode
+ */
+#define ___MACRO_IDLE_ENTER_LPM                                              \
+    __asm__ volatile("bic  %0, 0(r1)" : : "i"(SCG0));                       \
+    __asm__ volatile("bis  &%0, 0(r1)" : : "m"(sched_idle_sr));
+#else
+#define ___MACRO_IDLE_SELECT_LPM
+#define ___MACRO_IDLE_ENTER_LPM
+#endif
+
+#ifdef SCHED_WCET
+/**
+ * @brief   Stamp the start of a path through the scheduler, see SCHED_WCET
+ * Only moves between memory locations, so no register or flag is touched.
+ * exitless_entry takes the path from its function type in r15.
+ */
+#define ___MACRO_WCET_START_EXITLESS                                         \
+    __asm__ volatile ("mov %1, &%0" : "=m"(sched_wcet_start) : "m"(TIMER_BASE->R));\
+    __asm__ volatile ("mov.b r15, &%0" : "=m"(sched_wcet_path));
+
+#define ___MACRO_WCET_START(path)                                            \
+    __asm__ volatile ("mov %1, &%0" : "=m"(sched_wcet_start) : "m"(TIMER_BASE->R));\
+    __asm__ volatile ("mov.b %1, &%0" : "=m"(sched_wcet_path) : "i"(path));
+
+/**
+ * @brief   Record the length of the current path, clobbers r12 to r15
+ */
+#define ___MACRO_WCET_STOP                                                   \
+    __asm__ volatile ("call %0" : : "i"(sched_wcet_stop));
+#else
+#define ___MACRO_WCET_START_EXITLESS
+#define ___MACRO_WCET_START(path)
+#define ___MACRO_WCET_STOP
+#endif
+
 #define ___MACRO_RESTORE_CONTEXT                                             \
+    ___MACRO_IDLE_SELECT_LPM                                                 \
+    ___MACRO_WCET_STOP                                                       \
     /* First, restore the untrusted SP */                                    \
     __asm__ volatile ("mov.w %0,&__unprotected_sp" : : "m"(sched_active_thread->sp));\
     /* Check whether we restore an sm. At this point we still allow the compiler to clobber registers */\
@@ -450,6 +573,8 @@ extern char SM_DATA(sancus_sm_timer) __isr_stack[ISR_STACKSIZE];
     /*  them before a reti. */                              \
     __asm__ volatile("bic  %0, 0(r1)" : : "i"(CPUOFF));                                 \
     __asm__ volatile("bic  %0, 0(r1)" : : "i"(SCG1));                                   \
+    /*  Only a parked idle thread gets them set again by the scheduler. */               \
+    ___MACRO_IDLE_ENTER_LPM                                                             \
     __asm__ volatile ("2: reti");
 
 
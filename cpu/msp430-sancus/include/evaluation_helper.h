@@ -10,6 +10,10 @@
  * */
 // #define EVALUATION_ENABLED
 #ifdef EVALUATION_ENABLED
+// The timings read the timer state of the scheduler, which is only
+// accessible with DEBUG_TIMER
+#include "secure_mintimer.h"
+
 /**
  * Evaluation helpers
  * */
@@ -20,40 +24,71 @@ typedef enum {
     TIMING_TYPE_CONTEXT_EXIT,
     TIMING_TYPE_SLEEP,
     TIMING_TYPE_YIELD,
-    TIMING_TYPE_GET_TIME
+    TIMING_TYPE_GET_TIME,
+    TIMING_TYPE_COUNT
 } timing_measurement_type_t;
 struct _measurement
 {
-    uint32_t start_short;
-    uint32_t start_long;
-    uint32_t end_short;
-    uint32_t end_long;
+    uint32_t start;
+    uint32_t end;
     timing_measurement_type_t type;
     char* desc;
 };
 typedef struct _measurement timing_measurement_t;
 
+/**
+ * Number of measurements kept until eval_dump() is called. Measurements
+ * started while the table is full are counted in timing_dropped.
+ */
+#ifndef EVALUATION_TIMING_SIZE
 #define EVALUATION_TIMING_SIZE 100
+#endif
 extern timing_measurement_t timings[EVALUATION_TIMING_SIZE];
 extern uint16_t timing_counter;
+extern uint16_t timing_dropped;
 extern bool timing_running;
 extern uint8_t clock_divider;
 
 void init_eval_helper(void);
 
+/**
+ * Prints all measurements as CSV lines and empties the table:
+ *      bench,<type>,<description>,<start>,<end>
+ * Start and end are the lower 32 bit of the timer in ticks, use
+ * dist/tools/benchmark to turn them into statistics.
+ */
+void eval_dump(void);
+
+/**
+ * Lower 32 bit of the timer. Rereads the high count in case an overflow
+ * got handled in between. An overflow that is still pending is not seen,
+ * the host tool corrects for that.
+ */
+static inline uint32_t eval_now(void)
+{
+    uint32_t high;
+    uint16_t low;
+    do {
+        high = _secure_mintimer_high_cnt;
+        low = TIMER_A->R;
+    } while (high != _secure_mintimer_high_cnt);
+    return high | low;
+}
+
 // Defines to start, stop a timing and do a full one. Only considers lower 32 bit counters.
-// With the shared 
 #define ___MACRO_START_TIMING(TYPE, DESC)                                   \
+if (timing_counter < EVALUATION_TIMING_SIZE) {                              \
 timing_running = true;                                                      \
 timings[timing_counter].type = TYPE;                                        \
 timings[timing_counter].desc = DESC;                                        \
-timings[timing_counter].start_long = _secure_mintimer_high_cnt;             \
-timings[timing_counter].start_short =TIMER_A->R;
+timings[timing_counter].start = eval_now();                                 \
+} else {                                                                    \
+timing_dropped++;                                                           \
+}
 
 #define ___MACRO_END_TIMING                                                 \
 if(timing_running){                                                         \
-timings[timing_counter].end_short = TIMER_A->R;                           \
-timings[timing_counter].end_long = _secure_mintimer_high_cnt;             \
+timings[timing_counter].end = eval_now();                                   \
 timing_counter++;                                                           \
 timing_running = false;                                                     \
 }
@@ -385,6 +385,16 @@ typedef struct {
 #define TIMER_CCTL_CM_MASK            (0xc000)
 /** @} */
 
+/**
+ * @brief   Timer interrupt vector values, the channel is (value >> 1)
+ * @{
+ */
+#define TIMER_TAIV_NONE               (0x0000)
+#define TIMER_TAIV_CCR1               (0x0002)
+#define TIMER_TAIV_CCR2               (0x0004)
+#define TIMER_TAIV_OVERFLOW           (0x000a)
+/** @} */
+
 /**
  * @brief   Base register address definitions
  * @{
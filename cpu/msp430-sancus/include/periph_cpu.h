@@ -131,6 +131,13 @@ void gpio_periph_mode(gpio_t pin, bool enable);
 #define PERIPH_SPI_NEEDS_TRANSFER_REGS
 /** @} */
 
+#ifdef SCHED_TICKLESS_IDLE
+/**
+ * @brief   pm_set_lowest() parks the caller in the scheduler, see SCHED_TICKLESS_IDLE
+ */
+#define PROVIDES_PM_SET_LOWEST
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -52,22 +52,153 @@ void riot_enable_sm(struct SancusModule* sm);
  * We do this with Macros that directly call into the scheduler and perform one of the exitless calls.
 */
 #define ___MACRO_CALL_SLEEP_FROM_SM(offset_lsb, offset_msb, sm)      \
-    /* move offset into r13 and r12 */                               \
-    __asm__ ("push r12");                                             \
-    __asm__ ("push r13");                                             \
-    __asm__("mov.w %0, r12" : : "i"(offset_lsb));                    \
-    __asm__("mov.w %0, r13" : : "i"(offset_msb));                    \
-    /* perform a full save context and exitless call */              \
-    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_COMMON(EXITLESS_FUNCTION_TYPE_SLEEP, sm)\
-    __asm__ ("pop r13");                                             \
-    __asm__ ("pop r12");                                             
+    ___MACRO_CALL_SLEEP_FROM_SM_LIVE(offset_lsb, offset_msb, sm, SM_LIVE_ALL)
 
 #define ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)      \
-    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_COMMON(EXITLESS_FUNCTION_TYPE_YIELD, sm)
+    ___MACRO_CALL_THREAD_YIELD_FROM_SM_LIVE(sm, SM_LIVE_ALL)
 
 #define ___MACRO_CALL_THREAD_EXIT_FROM_SM(sm)      \
-    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_COMMON(EXITLESS_FUNCTION_TYPE_EXIT, sm)
+    /* Nothing is live after an exit */             \
+    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_LIVE(EXITLESS_FUNCTION_TYPE_EXIT, sm, SM_LIVE_NONE)
+
+/* Variants that only keep the argument registers given in live (see SM_LIVE_ALL).
+ * r4-r11 are always kept. Code that knows which of r12-r15 it still needs after
+ * the call can save the rest of the context switch.
+*/
+#define ___MACRO_CALL_SLEEP_FROM_SM_LIVE(offset_lsb, offset_msb, sm, live)  \
+    /* keep r12 and r13 before they get the offset, if live */       \
+    ___MACRO_SAVE_LIVE_REGISTER(r12, SM_LIVE_R12, live)              \
+    ___MACRO_SAVE_LIVE_REGISTER(r13, SM_LIVE_R13, live)              \
+    __asm__("mov.w %0, r12" : : "i"(offset_lsb));                    \
+    __asm__("mov.w %0, r13" : : "i"(offset_msb));                    \
+    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_LIVE(EXITLESS_FUNCTION_TYPE_SLEEP, sm, \
+            (live) & (SM_LIVE_R14 | SM_LIVE_R15))                    \
+    ___MACRO_RESTORE_LIVE_REGISTER(r13, SM_LIVE_R13, live)           \
+    ___MACRO_RESTORE_LIVE_REGISTER(r12, SM_LIVE_R12, live)
+
+/* Sleep for offset + 2^32 * long_offset ticks. The long offset is passed in
+ * r9 and r8, these are restored by __ret_entry on resume. The _LIVE variant
+ * takes a live mask like ___MACRO_CALL_SLEEP_FROM_SM_LIVE.
+*/
+#define ___MACRO_CALL_SLEEP64_FROM_SM(offset_lsb, offset_msb, long_lsb, long_msb, sm) \
+    ___MACRO_CALL_SLEEP64_FROM_SM_LIVE(offset_lsb, offset_msb, long_lsb, long_msb, sm, SM_LIVE_ALL)
+
+#define ___MACRO_CALL_SLEEP64_FROM_SM_LIVE(offset_lsb, offset_msb, long_lsb, long_msb, sm, live) \
+    ___MACRO_SAVE_LIVE_REGISTER(r12, SM_LIVE_R12, live)              \
+    ___MACRO_SAVE_LIVE_REGISTER(r13, SM_LIVE_R13, live)              \
+    __asm__("mov.w %0, r12" : : "i"(offset_lsb));                    \
+    __asm__("mov.w %0, r13" : : "i"(offset_msb));                    \
+    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_ARGS(EXITLESS_FUNCTION_TYPE_SLEEP, sm, \
+            (live) & (SM_LIVE_R14 | SM_LIVE_R15),                    \
+            __asm__("mov.w %0, r8" : : "i"(long_lsb));               \
+            __asm__("mov.w %0, r9" : : "i"(long_msb));)              \
+    ___MACRO_RESTORE_LIVE_REGISTER(r13, SM_LIVE_R13, live)           \
+    ___MACRO_RESTORE_LIVE_REGISTER(r12, SM_LIVE_R12, live)
+
+#define ___MACRO_CALL_THREAD_YIELD_FROM_SM_LIVE(sm, live)      \
+    ___MACRO_PREPARE_EXITLESS_CALL_FROM_SM_LIVE(EXITLESS_FUNCTION_TYPE_YIELD, sm, live)
+
+/* Message passing for SMs (see msg.h), the counterparts of msg_send(),
+ * msg_receive(), msg_send_receive() and msg_reply(). The scheduler blocks the
+ * SM and the macros yield with an exitless call until it is woken again.
+ * The msg_t buffers have to lie in unprotected memory. res gets the return
+ * value of the corresponding function. For the non-blocking variants, call
+ * _msg_send(m, pid, 0) or _msg_receive(m, 0) directly, they succeeded if > 0.
+*/
+#define ___MACRO_MSG_FINISH_FROM_SM(res, reply, sm)                  \
+    if ((res) == MSG_YIELD) {                                        \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        (res) = 1;                                                   \
+    }                                                                \
+    while ((res) == MSG_BLOCKED) {                                   \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        (res) = _msg_wait(reply);                                    \
+    }
+
+#define ___MACRO_MSG_SEND_FROM_SM(m, target_pid, res, sm)            \
+    (res) = _msg_send((m), (target_pid), 1);                         \
+    ___MACRO_MSG_FINISH_FROM_SM(res, NULL, sm)
+
+#define ___MACRO_MSG_RECEIVE_FROM_SM(m, res, sm)                     \
+    while (((res) = _msg_receive((m), 1)) == MSG_BLOCKED) {          \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+    }                                                                \
+    ___MACRO_MSG_FINISH_FROM_SM(res, NULL, sm)
+
+#define ___MACRO_MSG_SEND_RECEIVE_FROM_SM(m, reply, target_pid, res, sm) \
+    (res) = _msg_send_receive((m), (target_pid));                    \
+    ___MACRO_MSG_FINISH_FROM_SM(res, reply, sm)
+
+#define ___MACRO_MSG_REPLY_FROM_SM(m, reply, res, sm)                \
+    (res) = _msg_reply((m), (reply));                                \
+    ___MACRO_MSG_FINISH_FROM_SM(res, NULL, sm)
+
+/* Mutexes and condition variables for SMs (see mutex.h, cond.h and rmutex.h),
+ * the counterparts of mutex_lock_id(), mutex_unlock_id(), cond_wait_id(),
+ * cond_signal_id(), cond_broadcast_id(), rmutex_lock_id() and
+ * rmutex_unlock_id(). The objects are the ones of the scheduler, given by id.
+ * res gets the return value of the corresponding function. For the
+ * non-blocking variants, call _mutex_lock_id(id, 0) or _rmutex_lock_id(id, 0)
+ * directly, they succeeded if 1.
+*/
+#define ___MACRO_MUTEX_YIELD_FROM_SM(res, sm)                        \
+    if ((res) == MUTEX_YIELD) {                                      \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        (res) = 1;                                                   \
+    }
+
+#define ___MACRO_MUTEX_LOCK_FROM_SM(id, res, sm)                     \
+    (res) = _mutex_lock_id((id), 1);                                 \
+    while ((res) == MUTEX_BLOCKED) {                                 \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        (res) = _mutex_wait(id);                                     \
+    }
+
+/* Like ___MACRO_MUTEX_LOCK_FROM_SM, res is 0 or -1 as with
+ * secure_mintimer_mutex_lock_timeout() */
+#define ___MACRO_MUTEX_LOCK_TIMEOUT_FROM_SM(id, us, res, sm)         \
+    (res) = _secure_mintimer_mutex_lock_timeout((id), (us));         \
+    while ((res) == MUTEX_BLOCKED) {                                 \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        (res) = _secure_mintimer_mutex_wait(id);                     \
+    }
+
+#define ___MACRO_MUTEX_UNLOCK_FROM_SM(id, res, sm)                   \
+    (res) = _mutex_unlock_id(id);                                    \
+    ___MACRO_MUTEX_YIELD_FROM_SM(res, sm)
+
+#define ___MACRO_COND_WAIT_FROM_SM(cond, mutex, res, sm)             \
+    (res) = _cond_wait_id((cond), (mutex));                          \
+    if ((res) == COND_BLOCKED) {                                     \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        ___MACRO_MUTEX_LOCK_FROM_SM(mutex, res, sm)                  \
+    }                                                                \
+    else if ((res) == 0) {                                           \
+        (res) = 1;                                                   \
+    }
+
+#define ___MACRO_COND_SIGNAL_FROM_SM(cond, res, sm)                  \
+    (res) = _cond_signal_id((cond), 0);                              \
+    if ((res) == COND_YIELD) {                                       \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        (res) = 1;                                                   \
+    }
+
+#define ___MACRO_COND_BROADCAST_FROM_SM(cond, res, sm)               \
+    (res) = _cond_signal_id((cond), 1);                              \
+    if ((res) == COND_YIELD) {                                       \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+        (res) = 1;                                                   \
+    }
+
+#define ___MACRO_RMUTEX_LOCK_FROM_SM(id, res, sm)                    \
+    while (((res) = _rmutex_lock_id((id), 1)) == MUTEX_BLOCKED) {    \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+    }
 
+#define ___MACRO_RMUTEX_UNLOCK_FROM_SM(id, res, sm)                  \
+    (res) = _rmutex_unlock_id(id);                                   \
+    ___MACRO_MUTEX_YIELD_FROM_SM(res, sm)
 
 // This macro can help to debug issues with the timer. Comment it out to enable protection on the timer.
 // and leave it in to disable protections on the timer and enable the idle threat to print out the current timers.
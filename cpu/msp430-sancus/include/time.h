@@ -32,10 +32,23 @@ extern "C" {
 
 int SM_FUNC(sancus_sm_timer) sm_timer_init(tim_t dev, unsigned long freq, timer_cb_t cb);
 void SM_FUNC(sancus_sm_timer) sm_timer_set_absolute(int channel, unsigned int value);
+void SM_FUNC(sancus_sm_timer) sm_timer_clear(int channel);
+void SM_FUNC(sancus_sm_timer) sm_timer_set_pending(int channel);
+void SM_FUNC(sancus_sm_timer) sm_timer_isr_dispatch(void);
+uint16_t SM_FUNC(sancus_sm_timer) sm_timer_get_taiv();
 unsigned int SM_FUNC(sancus_sm_timer) sm_timer_read_internal(tim_t dev);
 void SM_FUNC(sancus_sm_timer) sm_timer_start();
 void SM_FUNC(sancus_sm_timer) sm_timer_stop();
 
+#ifdef SECURE_MINTIMER_CALIBRATE
+/**
+ * Ticks from the entry of the timer ISR to the channel 0 callback, for the
+ * ISR backoff of secure_mintimer. Only valid during that callback, 0 if the
+ * callback was not taken through CCR0.
+ */
+SM_DATA(sancus_sm_timer) extern uint16_t sm_timer_isr_latency;
+#endif
+
 // For hardware deployments, use a divider of 8 to clock down the timera
 // #define TIMERA_CLOCK_DIVIDER TIMER_CTL_ID_DIV8
 // For simulations, no clock divider is fine
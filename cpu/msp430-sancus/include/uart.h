@@ -14,6 +14,8 @@ void uart_write_byte(unsigned char b);
 void uart_write(const unsigned char* buf, size_t size);
 unsigned char uart_read_byte(void);
 void uart_read(unsigned char* buf, size_t size);
+size_t uart_read_some(unsigned char* buf, size_t size);
+void uart_set_line_mode(int enable);
 void uart_flush(void);
 void uart_print_receive_buffer(void);
 void uart2_write_byte(unsigned char b);
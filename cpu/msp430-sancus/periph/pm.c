@@ -20,6 +20,7 @@
  */
 
 #include "cpu.h"
+#include "periph/pm.h"
 
 void pm_reboot(void)
 {
@@ -29,3 +30,12 @@ void pm_reboot(void)
         WDTCTL = 0x0000;
     }
 }
+
+#ifdef SCHED_TICKLESS_IDLE
+void pm_set_lowest(void)
+{
+    // Only the scheduler may set CPUOFF and the SCG bits. It keeps us in the
+    // deepest mode that the next timer allows and returns once we have to run.
+    ___MACRO_EXITLESS_CALL_WITH_RESUME(EXITLESS_FUNCTION_TYPE_IDLE)
+}
+#endif
@@ -49,6 +49,14 @@ static SM_DATA(sancus_sm_timer) timer_cb_t isr_cb;
  */
 SM_DATA(sancus_sm_timer) char __timer_isr_stack[ISR_STACKSIZE];
 
+#ifdef SECURE_MINTIMER_CALIBRATE
+/**
+ * @brief Timer value at the entry of the ISR, see sm_timer_isr_latency
+ */
+static SM_DATA(sancus_sm_timer) uint16_t sm_timer_isr_start;
+SM_DATA(sancus_sm_timer) uint16_t sm_timer_isr_latency;
+#endif
+
 /**
  * @brief    Save argument for the ISR callback
  * For sancus we disable this arg feature and do not support it.
@@ -152,7 +160,68 @@ void SM_FUNC(sancus_sm_timer) mmio_timer_clear(
 }
 
 void SM_FUNC(sancus_sm_timer) sm_timer_clear(int channel){
-    mmio_timer_clear(channel);
+    if (channel == 0) {
+        mmio_timer_clear(channel);
+    }
+    else {
+        TIMER_BASE->CCTL[channel] &= ~(TIMER_CCTL_CCIE);
+    }
+}
+
+/**
+ * Raise the interrupt of a channel in software, e.g. if the counter passed
+ * its compare value before it was written.
+ * */
+void SM_FUNC(sancus_sm_timer) sm_timer_set_pending(int channel){
+    TIMER_BASE->CCTL[channel] |= (TIMER_CCTL_CCIFG);
+}
+
+/**
+ * Call the callback for every channel that fired.
+ *
+ * CCR0 has its own vector which clears its CCIFG when taken, so it is also
+ * treated as fired once the counter reached the compare value or overflowed.
+ * The other channels share the CCX vector and are taken from TAIV, highest
+ * priority first. Reading TAIV clears the CCIFG of the channel it reports.
+ * An overflow that TAIV still reports was not handled through CCR0, so it
+ * goes to the channel 0 callback as well.
+ * */
+void SM_FUNC(sancus_sm_timer) sm_timer_isr_dispatch(void){
+    uint16_t taiv;
+
+    if ((TIMER_BASE->CCTL[0] & TIMER_CCTL_CCIE)
+        && ((TIMER_BASE->CCTL[0] & TIMER_CCTL_CCIFG)
+            || (TIMER_BASE->CTL & TIMER_CTL_IFG)
+            || TIMER_BASE->R >= TIMER_BASE->CCR[0])) {
+        TIMER_BASE->CCTL[0] &= ~(TIMER_CCTL_CCIE);
+#ifdef SCHED_WCET
+        sched_wcet_path |= 1 << 0;
+#endif
+#ifdef SECURE_MINTIMER_CALIBRATE
+        sm_timer_isr_latency = TIMER_BASE->R - sm_timer_isr_start;
+        isr_cb(0);
+        sm_timer_isr_latency = 0;
+#else
+        isr_cb(0);
+#endif
+    }
+
+    while ((taiv = sm_timer_get_taiv()) != TIMER_TAIV_NONE) {
+        if (taiv == TIMER_TAIV_OVERFLOW) {
+            // Reading TAIV cleared TAIFG. Set it again so the channel 0
+            // callback advances to the next period, it clears TAIFG itself.
+            TIMER_BASE->CTL |= TIMER_CTL_IFG;
+#ifdef SCHED_WCET
+            sched_wcet_path |= 1 << 0;
+#endif
+            isr_cb(0);
+            continue;
+        }
+#ifdef SCHED_WCET
+        sched_wcet_path |= 1 << (taiv >> 1);
+#endif
+        isr_cb(taiv >> 1);
+    }
 }
 
 int timer_clear(__attribute__((unused)) tim_t dev, __attribute__((unused)) int channel)
@@ -250,6 +319,12 @@ void SM_FUNC(sancus_sm_timer) isr_error(){
 
 void SM_FUNC(sancus_sm_timer) __attribute__((naked, used)) __sm_sancus_sm_timer_isr_func(unsigned __attribute__ ((unused)) num_name)
 {
+    ___MACRO_WCET_START(SCHED_WCET_PATH_ISR)
+#ifdef SECURE_MINTIMER_CALIBRATE
+    // memory to memory, like the WCET stamp, so no register is touched yet
+    __asm__ volatile ("mov %1, &%0" : "=m"(sm_timer_isr_start) : "m"(TIMER_BASE->R));
+#endif
+
     // check whether this is a violation 
     __asm__("mov r15, &__sm_sancus_sm_timer_tmp");
     __asm__(".word 0x1387");
@@ -258,6 +333,14 @@ void SM_FUNC(sancus_sm_timer) __attribute__((naked, used)) __sm_sancus_sm_timer_
     __asm__("jne 1f"); // not a violation, jump to enter ISR
         // If we are a violation, kill the current thread -- treat this as a context_switch_context_exit call
         __asm__ volatile ("mov.w %0,r1" : : "i"(__isr_stack + ISR_STACKSIZE)); // set up sp
+        ___MACRO_WCET_START(SCHED_WCET_PATH_VIOLATION)
+#ifdef SCHED_TRACE
+        // sched_trace(SCHED_TRACE_VIOLATION, sched_active_pid, 0);
+        __asm__("mov %0, r15" : : "i"(SCHED_TRACE_VIOLATION));
+        __asm__("mov &%0, r14" : : "m"(sched_active_pid));
+        __asm__("clr r13");
+        __asm__("call %0" : : "i"(sched_trace));
+#endif
         __asm__("call %0" : : "i"(sched_task_exit_internal));
         
         __asm__("mov %0, r15" : : "m"(TIMER_BASE->CTL));
@@ -277,26 +360,8 @@ void SM_FUNC(sancus_sm_timer) __attribute__((naked, used)) __sm_sancus_sm_timer_
     __MACRO_ENTER_ISR
     __asm__("after_context_save:"); // possible jump label for IRQ handling inside violations above
 
-    // TIMER_BASE->CCTL[0] &= ~(TIMER_CCTL_CCIE);
-    __asm__ volatile ("mov %0, r12" : : "m"(TIMER_BASE->CCTL[0]));
-    __asm__ volatile ("and %0, r12" : : "i"(~(TIMER_CCTL_CCIE)));
-    __asm__ volatile ("mov r12, %0" : "=m"(TIMER_BASE->CCTL[0]));
-    // TODO: For more sophisticated interrupt schemes, we should check whith IRQ called us.
-    // for now we just assume CCR0 overflow here.
-    // Check interrupt source and abort if it is not a timer A overflow (for now)
-    // __asm__("call %0" : : "i"(sm_timer_get_taiv));
-    // __asm__("cmp #10, r15");
-    // __asm__("jeq 1f");
-    // for now abort for any other interrupt but later on we can multiplex either here or in the ISR entry stub
-    // __asm__("call %0" : : "i"(isr_error));
-
-    __asm__("1:");
-    // isr_cb(isr_arg, 0);
-    // __asm__ volatile ("mov &%0, r15" : : "m"(isr_arg));
-    __asm__ volatile ("clr r15");
-    __asm__ volatile ("clr r14");
-    // __asm__ volatile ("mov &%0, r12" : : "m"(isr_cb));
-    __asm__("call &%0" : : "m"(isr_cb));
+    // Find the channels that fired and call isr_cb for each
+    __asm__("call %0" : : "i"(sm_timer_isr_dispatch));
 
     // __exit_isr();
     __MACRO_EXIT_ISR
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+
+# Copyright (C) 2026 KU Leuven
+#
+# This file is subject to the terms and conditions of the GNU Lesser
+# General Public License v2.1. See the file LICENSE in the top level
+# directory for more details.
+
+"""Summarise the measurements of examples/evaluation.
+
+Runs the application in sancus-sim (or reads a captured log), computes
+min/median/p99/max per measurement type and compares them to a baseline.
+Exits with 1 if a statistic got slower than the baseline allows.
+"""
+
+import argparse
+import csv
+import json
+import math
+import subprocess
+import sys
+
+STATS = ('min', 'median', 'p99', 'max')
+
+# statistics compared against the baseline, min and max are too noisy
+CHECKED = ('median', 'p99')
+
+
+def duration(start, end):
+    """Ticks between two lower 32 bit timer values.
+
+    The end value is taken before a pending overflow of the 16 bit hardware
+    counter got handled if it lies before the start, add the missing period.
+    """
+    ticks = (end - start) & 0xFFFFFFFF
+    if ticks & 0x80000000:
+        ticks = (ticks + 0x10000) & 0xFFFFFFFF
+    if ticks & 0x80000000:
+        return None
+    return ticks
+
+
+def parse(lines):
+    """Collect the durations per type from the bench lines of a log"""
+    samples = {}
+    divider = 1
+    dropped = 0
+    invalid = 0
+    done = False
+    for line in lines:
+        fields = line.strip().split(',')
+        if fields[0] == 'bench' and len(fields) == 5:
+            _, kind, _, start, end = fields
+            ticks = duration(int(start), int(end))
+            if ticks is None:
+                invalid += 1
+                continue
+            samples.setdefault(kind, []).append(ticks)
+        elif fields[0] == 'bench_divider' and len(fields) == 2:
+            divider = int(fields[1])
+        elif fields[0] == 'bench_dropped' and len(fields) == 2:
+            dropped += int(fields[1])
+        elif fields[0] == 'bench_done':
+            done = True
+    if invalid:
+        print('warning: ignored {} measurements that end before they start'
+              .format(invalid), file=sys.stderr)
+    return samples, divider, dropped, done
+
+
+def percentile(ordered, p):
+    """Nearest rank percentile of a sorted list"""
+    rank = max(1, math.ceil(p / 100 * len(ordered)))
+    return ordered[rank - 1]
+
+
+def summarise(samples, divider):
+    """Statistics per type, in cpu cycles"""
+    result = {}
+    for kind, values in sorted(samples.items()):
+        ordered = sorted(v * divider for v in values)
+        result[kind] = {
+            'count': len(ordered),
+            'min': ordered[0],
+            'median': percentile(ordered, 50),
+            'p99': percentile(ordered, 99),
+            'max': ordered[-1],
+        }
+    return result
+
+
+def compare(result, baseline, tolerance):
+    """Yields a message for every statistic that regressed"""
+    for kind, stats in sorted(result.items()):
+        if kind not in baseline:
+            continue
+        for stat in CHECKED:
+            allowed = baseline[kind][stat] * (1 + tolerance / 100)
+            if stats[stat] > allowed:
+                yield '{} {}: {} cycles, baseline {}'.format(
+                    kind, stat, stats[stat], baseline[kind][stat])
+
+
+def run_sim(elf, timeout):
+    """Runs the application until it shut down the scheduler"""
+    sim = subprocess.run(['sancus-sim', elf, '--stop-after-sm-violation=-1'],
+                         stdout=subprocess.PIPE, universal_newlines=True,
+                         timeout=timeout, check=False)
+    return sim.stdout.splitlines()
+
+
+def write_csv(result, output):
+    writer = csv.writer(output)
+    writer.writerow(('type', 'count') + STATS)
+    for kind, stats in result.items():
+        writer.writerow([kind, stats['count']] + [stats[s] for s in STATS])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--sim', metavar='ELF',
+                        help='run ELF (with filled in MACs) in sancus-sim')
+    source.add_argument('--log', type=argparse.FileType('r'),
+                        help='read a captured output log instead')
+    parser.add_argument('--timeout', type=int, default=600,
+                        help='seconds to wait for the simulation')
+    parser.add_argument('--json', metavar='FILE',
+                        help='write the statistics as JSON to FILE')
+    parser.add_argument('--baseline', metavar='FILE',
+                        help='JSON statistics to compare against')
+    parser.add_argument('--tolerance', type=float, default=5,
+                        help='allowed slow down in percent (default: 5)')
+    parser.add_argument('--update-baseline', action='store_true',
+                        help='store the statistics as the new baseline')
+    args = parser.parse_args()
+
+    lines = run_sim(args.sim, args.timeout) if args.sim else args.log
+    samples, divider, dropped, done = parse(lines)
+    if not done:
+        sys.exit('benchmark did not finish, no bench_done in the output')
+    if dropped:
+        print('warning: {} measurements dropped, increase '
+              'EVALUATION_TIMING_SIZE'.format(dropped), file=sys.stderr)
+
+    result = summarise(samples, divider)
+    write_csv(result, sys.stdout)
+    if args.json:
+        with open(args.json, 'w') as output:
+            json.dump(result, output, indent=2, sort_keys=True)
+
+    if not args.baseline:
+        return
+    if args.update_baseline:
+        with open(args.baseline, 'w') as output:
+            json.dump(result, output, indent=2, sort_keys=True)
+        return
+    try:
+        with open(args.baseline) as base:
+            baseline = json.load(base)
+    except FileNotFoundError:
+        print('no baseline {}, use --update-baseline to create it'
+              .format(args.baseline), file=sys.stderr)
+        return
+
+    regressions = list(compare(result, baseline, args.tolerance))
+    for regression in regressions:
+        print('regression: ' + regression, file=sys.stderr)
+    if regressions:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+
+# Copyright (C) 2026 KU Leuven
+#
+# This file is subject to the terms and conditions of the GNU Lesser
+# General Public License v2.1. See the file LICENSE in the top level
+# directory for more details.
+
+"""Turn scheduler trace dumps (SCHED_TRACE) into Chrome trace JSON.
+
+The output can be loaded into chrome://tracing or https://ui.perfetto.dev.
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+# sched_trace_record_t: uint32_t time, uint8_t event, uint8_t pid, uint16_t arg
+RECORD = struct.Struct('<IBBH')
+
+SWITCH = 1
+WAKEUP = 2
+TIMER = 3
+BUDGET = 4
+VIOLATION = 5
+
+EVENT_NAMES = {
+    WAKEUP: 'wakeup',
+    TIMER: 'timer',
+    BUDGET: 'budget exhausted',
+    VIOLATION: 'violation',
+}
+
+HEX_RECORD = re.compile(r'([0-9a-fA-F]{16})\s*$')
+
+
+def read_records(dump, binary):
+    """Yield (time, event, pid, arg) for every record in the dump"""
+    if binary:
+        data = dump.read()
+        for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+            yield RECORD.unpack_from(data, offset)
+        return
+    # one record per line as 16 hex digits, other lines are ignored
+    for line in dump:
+        match = HEX_RECORD.search(line.decode('ascii', 'replace'))
+        if match:
+            yield RECORD.unpack(bytes.fromhex(match.group(1)))
+
+
+def unwrap(records):
+    """Extend the 32 bit timestamps, they are assumed to be in order"""
+    high = 0
+    last = None
+    for time, event, pid, arg in records:
+        if last is not None and time < last:
+            high += 1 << 32
+        last = time
+        yield high + time, event, pid, arg
+
+
+def to_chrome_trace(records, hz):
+    """Convert records to a list of Chrome trace events"""
+    scale = 1e6 / hz
+    events = []
+    running = None
+    since = None
+    time = None
+
+    for time, event, pid, arg in unwrap(records):
+        ts = time * scale
+        if event == SWITCH:
+            if running is not None:
+                events.append({'name': 'running', 'ph': 'X', 'pid': 0,
+                               'tid': running, 'ts': since,
+                               'dur': ts - since})
+            running = pid
+            since = ts
+        elif event in EVENT_NAMES:
+            args = {}
+            if event == WAKEUP:
+                args['old status'] = arg
+            events.append({'name': EVENT_NAMES[event], 'ph': 'i', 's': 't',
+                           'pid': 0, 'tid': pid, 'ts': ts, 'args': args})
+        else:
+            print('unknown event {} at {}'.format(event, time),
+                  file=sys.stderr)
+
+    if running is not None:
+        # the last slice is still open, end it at the last record
+        events.append({'name': 'running', 'ph': 'X', 'pid': 0,
+                       'tid': running, 'ts': since,
+                       'dur': time * scale - since})
+
+    threads = sorted({e['tid'] for e in events})
+    for tid in threads:
+        events.append({'name': 'thread_name', 'ph': 'M', 'pid': 0,
+                       'tid': tid, 'args': {'name': 'pid {}'.format(tid)}})
+    return events
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('dump', type=argparse.FileType('rb'),
+                        help='trace dump, hex records per line by default')
+    parser.add_argument('-b', '--binary', action='store_true',
+                        help='dump holds raw 8 byte records')
+    parser.add_argument('-f', '--hz', type=int, default=1000000,
+                        help='secure_mintimer frequency (default: 1000000)')
+    parser.add_argument('-o', '--output', type=argparse.FileType('w'),
+                        default=sys.stdout, help='output file')
+    args = parser.parse_args()
+
+    events = to_chrome_trace(read_records(args.dump, args.binary), args.hz)
+    json.dump({'traceEvents': events, 'displayTimeUnit': 'ns'}, args.output)
+    args.output.write('\n')
+
+
+if __name__ == '__main__':
+    main()
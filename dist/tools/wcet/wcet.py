@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+
+# Copyright (C) 2026 KU Leuven
+#
+# This file is subject to the terms and conditions of the GNU Lesser
+# General Public License v2.1. See the file LICENSE in the top level
+# directory for more details.
+
+"""Derive the scheduler overhead constants from SCHED_WCET measurements.
+
+Runs examples/wcet in sancus-sim (or reads a captured log) and writes a
+header with SCHEDULER_OVERHEAD_RUN and SECURE_MINTIMER_OVERHEAD. With
+--compare, the paths are also listed next to those of a baseline log.
+"""
+
+import argparse
+import subprocess
+import sys
+
+# exitless_entry function types, see EXITLESS_FUNCTION_TYPE_* in cpu.h
+EXITLESS = ['boot', 'yield', 'exit', 'sched_switch', 'sleep', 'yield_fast',
+            'idle']
+VIOLATION = 7
+ISR = 8
+PATHS = 16
+
+# paths that can end a periodic job
+JOB_END = (1, 2, 3, 4, 5)
+
+HEADER = '''/*
+ * Generated by dist/tools/wcet from the longest measured scheduler paths,
+ * do not edit. Overheads in timer ticks with a clock divider of {divider}
+ * and a margin of {margin}%.
+ */
+#ifndef SCHED_OVERHEAD_H
+#define SCHED_OVERHEAD_H
+
+/* timer ISR ({isr} cycles) and end of a job ({end} cycles) */
+#define SCHEDULER_OVERHEAD_RUN ({run})
+
+/* timer ISR dispatching the main channel ({timer} cycles) */
+#define SECURE_MINTIMER_OVERHEAD ({overhead})
+
+#endif /* SCHED_OVERHEAD_H */
+'''
+
+
+def path_name(path):
+    if path < len(EXITLESS):
+        return 'exitless ' + EXITLESS[path]
+    if path == VIOLATION:
+        return 'isr violation'
+    channels = [str(c) for c in range(3) if path & (1 << c)]
+    return 'isr channels ' + (','.join(channels) or 'none')
+
+
+def parse(lines):
+    """Longest run in cycles per path"""
+    maxima = [0] * PATHS
+    done = False
+    for line in lines:
+        fields = line.strip().split(',')
+        if fields[0] == 'wcet' and len(fields) == 3:
+            path = int(fields[1])
+            if 0 <= path < PATHS:
+                maxima[path] = int(fields[2])
+        elif fields[0] == 'wcet_done':
+            done = True
+    return maxima, done
+
+
+def run_sim(elf, timeout):
+    sim = subprocess.run(['sancus-sim', elf, '--stop-after-sm-violation=-1'],
+                         stdout=subprocess.PIPE, universal_newlines=True,
+                         timeout=timeout, check=False)
+    return sim.stdout.splitlines()
+
+
+def ticks(cycles, divider, margin):
+    """Cycles with margin as timer ticks, rounded up"""
+    with_margin = -(-cycles * (100 + margin) // 100)
+    return -(-with_margin // divider)
+
+
+def compare(maxima, baseline):
+    """Print every path next to the same path of the baseline"""
+    print('{:<24} {:>8} {:>8} {:>8}'.format('path', 'baseline', 'now', 'delta'))
+    for path, cycles in enumerate(maxima):
+        if cycles or baseline[path]:
+            print('{:<24} {:>8} {:>8} {:>+8}'.format(
+                path_name(path), baseline[path], cycles, cycles - baseline[path]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--sim', metavar='ELF',
+                        help='run ELF (with filled in MACs) in sancus-sim')
+    source.add_argument('--log', type=argparse.FileType('r'),
+                        help='read a captured output log instead')
+    parser.add_argument('--timeout', type=int, default=600,
+                        help='seconds to wait for the simulation')
+    parser.add_argument('--divider', type=int, default=1,
+                        help='timer clock divider of the deployed build')
+    parser.add_argument('--margin', type=int, default=10,
+                        help='percent added to the measurements (default: 10)')
+    parser.add_argument('--header', metavar='FILE',
+                        help='write the overhead defines to FILE')
+    parser.add_argument('--compare', metavar='LOG', type=argparse.FileType('r'),
+                        help='list the paths next to those of a captured '
+                             'baseline log')
+    args = parser.parse_args()
+
+    lines = run_sim(args.sim, args.timeout) if args.sim else args.log
+    maxima, done = parse(lines)
+    if not done:
+        sys.exit('workload did not finish, no wcet_done in the output')
+
+    if args.compare:
+        baseline, baseline_done = parse(args.compare)
+        if not baseline_done:
+            sys.exit('baseline workload did not finish, no wcet_done in it')
+        compare(maxima, baseline)
+    else:
+        for path, cycles in enumerate(maxima):
+            if cycles:
+                print('{:<24} {:>6} cycles'.format(path_name(path), cycles))
+
+    isr = max(maxima[ISR:])
+    timer = max(maxima[p] for p in range(ISR, PATHS) if p & 1)
+    end = max(maxima[p] for p in JOB_END)
+    if not isr or not timer or not end:
+        sys.exit('the workload did not reach all paths, no overheads derived')
+
+    values = {
+        'divider': args.divider,
+        'margin': args.margin,
+        'isr': isr,
+        'end': end,
+        'timer': timer,
+        'run': ticks(isr + end, args.divider, args.margin),
+        'overhead': ticks(timer, args.divider, args.margin),
+    }
+    print('SCHEDULER_OVERHEAD_RUN {run}, SECURE_MINTIMER_OVERHEAD {overhead}'
+          .format(**values))
+    if args.header:
+        with open(args.header, 'w') as header:
+            header.write(HEADER.format(**values))
+
+
+if __name__ == '__main__':
+    main()
@@ -6,6 +6,7 @@
 #include "secure_mintimer.h"
 #include "log.h"
 #include "sancus_helpers.h"
+#include "spsc.h"
 
 
 #define ___MACRO_CLIX(clix_length)  \
@@ -25,34 +26,36 @@
 DECLARE_SM(ioenclave,  0x1234);
 
 #ifdef _HAVE_IO_THREAD
-#define IO_BUFS        4
-SM_DATA(ioenclave) unsigned char io_bufs[IO_BUFS] = {0, 0, 0, 0};
-SM_DATA(ioenclave) bool io_ready[IO_BUFS] = {false, false, false, false};
+// Every app writes to the IO thread through its own channel, the IO thread
+// blocks on one notification id until any of them has data.
+#define IO_CHAN_SIZE   16
+#define IO_NOTIFY      0
+static uint8_t io_chan_a[SPSC_REGION_SIZE(IO_CHAN_SIZE)] __attribute__((aligned(2)));
+static uint8_t io_chan_b[SPSC_REGION_SIZE(IO_CHAN_SIZE)] __attribute__((aligned(2)));
+SM_DATA(ioenclave) spsc_t io_from_a;
+SM_DATA(ioenclave) spsc_t io_from_b;
+
+// Producer side, runs inside the calling app
+#define IO_CHAN_WRITE(chan, b)                                      \
+    do {                                                            \
+        bool notify;                                                \
+        unsigned char byte = (b);                                   \
+        spsc_write(&(chan), &byte, 1, &notify);                     \
+        if (notify) { spsc_notify(IO_NOTIFY); }                     \
+    } while (0)
 #endif
 
+#ifndef _HAVE_IO_THREAD
 // Output 
 bool SM_ENTRY(ioenclave) io_uart_write_byte(unsigned char b)
 {
-#ifdef _HAVE_IO_THREAD
-    // Async I/O
-    ___MACRO_CLIX(50);
-    int caller = (int) sancus_get_caller_id();
-    if (!caller || caller >= IO_BUFS) { caller = 0; }
-    if (io_ready[caller]) {
-      return (false);
-    } else {
-      io_bufs[caller]  = b;
-      io_ready[caller] = true;
-      return (true);
-    }
-#else
     // Sync I/O
     ___MACRO_CLIX(30);
     while (UART_STAT & UART_TX_FULL) {}       // !!
     UART_TXD = b;
     return (true);
-#endif
 }
+#endif
 
 // Read sensor
 uint64_t SM_ENTRY(ioenclave) io_get_reading(void)
@@ -63,22 +66,36 @@ uint64_t SM_ENTRY(ioenclave) io_get_reading(void)
 
 #ifdef _HAVE_IO_THREAD
 static char sm3_unprotected_stack[THREAD_EXTRA_STACKSIZE_PRINTF];
+// Writes everything the channel holds to the UART
+static uint16_t SM_FUNC(ioenclave) io_drain(spsc_t *chan)
+{
+    uint16_t len, total = 0;
+    const uint8_t *data;
+
+    while ((data = spsc_read_ptr(chan, &len)), len) {
+      for (uint16_t i = 0; i < len; i++) {
+        ___MACRO_CLIX(30);
+        while (UART_STAT & UART_TX_FULL) {} // !!
+        UART_TXD = data[i];
+      }
+      spsc_release(chan, len);
+      total += len;
+    }
+    return total;
+}
+
 // Async I/O thread
 void SM_ENTRY(ioenclave) io_thread(void)
 {
+    spsc_init(&io_from_a, (spsc_shared_t *)io_chan_a, IO_CHAN_SIZE, IO_NOTIFY, false);
+    spsc_init(&io_from_b, (spsc_shared_t *)io_chan_b, IO_CHAN_SIZE, IO_NOTIFY, false);
     while (true) {
       // this could implement *any* policy.
-      for (int i = 0; i < IO_BUFS; i++) {
-        if (io_ready[i]) {
-          ___MACRO_CLIX(30);
-          while (UART_STAT & UART_TX_FULL) {} // !!
-          UART_TXD = io_bufs[i];
-          io_ready[i] = false;
-        }
+      uint16_t written = io_drain(&io_from_a) + io_drain(&io_from_b);
+      // Blocks in the scheduler until an app notifies
+      if (written == 0 && _spsc_wait(IO_NOTIFY) == SPSC_BLOCKED) {
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(ioenclave)
       }
-#ifdef _HAVE_APP_SLEEP
-      ___MACRO_CALL_SLEEP_FROM_SM(0x0100, 0x0001, ioenclave)
-#endif
     }
     return;
 }
@@ -92,16 +109,29 @@ static char sm1_unprotected_stack[THREAD_EXTRA_STACKSIZE_PRINTF];
 DECLARE_SM(appa,       0x1234);
 
 SM_DATA(appa) uint64_t reading_a = 0;
+#ifdef _HAVE_IO_THREAD
+SM_DATA(appa) spsc_t a_out;
+#endif
 
 void SM_ENTRY(appa) a_entry(void)
 {
     printf2("A: ID %d, called by %d\n",
         sancus_get_self_id(), sancus_get_caller_id());
 
+#ifdef _HAVE_IO_THREAD
+    spsc_init(&a_out, (spsc_shared_t *)io_chan_a, IO_CHAN_SIZE, IO_NOTIFY, false);
+#endif
+
     while (true) { 
       reading_a = io_get_reading();
       printf1("A: t is %lu\n", reading_a);
-      if (reading_a >= 50000) { io_uart_write_byte('A'); }
+      if (reading_a >= 50000) {
+#ifdef _HAVE_IO_THREAD
+        IO_CHAN_WRITE(a_out, 'A');
+#else
+        io_uart_write_byte('A');
+#endif
+      }
 #ifdef _HAVE_APP_SLEEP
       ___MACRO_CALL_SLEEP_FROM_SM(0x0100, 0x0001, appa)
 #endif
@@ -116,16 +146,29 @@ static char sm2_unprotected_stack[THREAD_EXTRA_STACKSIZE_PRINTF];
 DECLARE_SM(appb,       0x1234);
 
 SM_DATA(appb) uint64_t reading_b = 0;
+#ifdef _HAVE_IO_THREAD
+SM_DATA(appb) spsc_t b_out;
+#endif
 
 void SM_ENTRY(appb) b_entry(void)
 {
     printf2("B: ID %d, called by %d\n",
         sancus_get_self_id(), sancus_get_caller_id());
 
+#ifdef _HAVE_IO_THREAD
+    spsc_init(&b_out, (spsc_shared_t *)io_chan_b, IO_CHAN_SIZE, IO_NOTIFY, false);
+#endif
+
     while (true) {
       reading_b = io_get_reading();
       printf1("B: t is %lu\n", reading_b);
-      if (reading_b >= 50000) { io_uart_write_byte('B'); }
+      if (reading_b >= 50000) {
+#ifdef _HAVE_IO_THREAD
+        IO_CHAN_WRITE(b_out, 'B');
+#else
+        io_uart_write_byte('B');
+#endif
+      }
 #ifdef _HAVE_APP_SLEEP
       ___MACRO_CALL_SLEEP_FROM_SM(0x0100, 0x0001, appb)
 #endif
@@ -141,6 +184,13 @@ int main(void)
 
     while(sancus_enable(&ioenclave) == 0);
 
+#ifdef _HAVE_IO_THREAD
+    // Start the channels empty before any end uses them
+    spsc_t chan;
+    spsc_init(&chan, (spsc_shared_t *)io_chan_a, IO_CHAN_SIZE, IO_NOTIFY, true);
+    spsc_init(&chan, (spsc_shared_t *)io_chan_b, IO_CHAN_SIZE, IO_NOTIFY, true);
+#endif
+
 #ifdef _HAVE_APPA
     while(sancus_enable(&appa) == 0);
 #endif
@@ -12,6 +12,10 @@
 
 uint8_t threads_done = 0;
 
+// Set for the eval thread whenever a thread finished
+#define EVAL_FLAG_THREAD_DONE   (0x0001)
+kernel_pid_t eval_pid = KERNEL_PID_UNDEF;
+
 /**
  * Thread creation helpers
  * Note, standard Sancus has a max of 4 SMs (including scheduler)
@@ -60,7 +64,6 @@ void SM_ENTRY(name) name##_greet(void){                             \
     ___MACRO_START_TIMING(TIMING_TYPE_SLEEP, "SM" #name);           \
     ___MACRO_CALL_SLEEP_FROM_SM(lsb, msb, name)                     \
     ___MACRO_END_TIMING;                                            \
-    threads_done++;                                                 \
     ___MACRO_START_TIMING(TIMING_TYPE_CONTEXT_EXIT, "SM" #name);            \
     ___MACRO_CALL_THREAD_EXIT_FROM_SM(name)                         \
 };
@@ -102,6 +105,7 @@ static void *name##_trampoline(void *arg){              \
         thread_yield_higher();                          \
         ___MACRO_END_TIMING;                            \
         threads_done++;                                 \
+        thread_flags_set(eval_pid, EVAL_FLAG_THREAD_DONE); \
         ___MACRO_START_TIMING(TIMING_TYPE_CONTEXT_EXIT, "EXIT " #name);\
         cpu_switch_context_exit();                      \
     }
@@ -133,64 +137,52 @@ DEFINE_SLEEPY_THREAD(fooK, 0x00000000)
 DEFINE_SLEEPY_THREAD(fooL, 0x00000000)
 DEFINE_SLEEPY_THREAD(fooM, 0x00005000) // 13
 
-// Function to print an eval table from the timing struct
-void print_eval_table(timing_measurement_type_t type){
-    LOG_WARNING("Printing measurements for type %u ", type);
-    switch(type){
-        case TIMING_TYPE_THREAD_CREATE:
-        LOG_WARNING("(type Create Thread)\n");
-        break;
-        case TIMING_TYPE_SWITCH_PERIODIC:
-        LOG_WARNING("(type Switch to periodic)\n");
-        break;
-        case TIMING_TYPE_CONTEXT_EXIT:
-        LOG_WARNING("(type Context Exit)\n");
-        break;
-        case TIMING_TYPE_SLEEP:
-        LOG_WARNING("(type Sleep)\n");
-        break;
-        case TIMING_TYPE_YIELD:
-        LOG_WARNING("(type Yield)\n");
-        break;
-        case TIMING_TYPE_GET_TIME:
-        LOG_WARNING("(type Get time)\n");
-        break;
-        default:
-        LOG_ERROR("(Type unknown.!)\n");
-        break;
-    }
-    LOG_DEBUG("Duration ticks | Duration cycles | Description \n");
-
-    for(int i=0; i< EVALUATION_TIMING_SIZE; i++){
-        if(timings[i].type == type){
-            uint32_t start =  timings[i].start_long | timings[i].start_short;
-            uint32_t end = timings[i].end_long | timings[i].end_short;
-            uint32_t duration = end-start;
-            LOG_INFO("%10lu     | %10lu      | %s\n", duration, duration * clock_divider, timings[i].desc);
-        }
-    }
-}
+#define CREATE_NORMAL_THREADS()                         \
+    CREATE_NORMAL_THREAD(fooD, 4)                       \
+    CREATE_NORMAL_THREAD(fooE, 5)                       \
+    CREATE_NORMAL_THREAD(fooF, 6)                       \
+    CREATE_NORMAL_THREAD(fooG, 7)                       \
+    CREATE_NORMAL_THREAD(fooH, 8)                       \
+    CREATE_NORMAL_THREAD(fooI, 9)                       \
+    CREATE_NORMAL_THREAD(fooJ, 10)                      \
+    CREATE_NORMAL_THREAD(fooK, 11)                      \
+    CREATE_NORMAL_THREAD(fooL, 12)                      \
+    CREATE_NORMAL_THREAD(fooM, 13)
 
+#define NORMAL_THREADS 10
 
-// Lastly, define the final eval thread that will sum up all the data
+// Number of times the unprotected threads are created, run and dumped
+#ifndef EVALUATION_ROUNDS
+#define EVALUATION_ROUNDS 20
+#endif
+
+
+// Lastly, define the final eval thread that runs the rounds and dumps the
+// measurements of each round for dist/tools/benchmark
 const char *eval_description = "Eval thread"; 
 static char eval_stack[THREAD_STACKSIZE_MAIN];
 static void *eval_trampoline(void *arg){    
     (void) arg;                           
-    while(threads_done < 10){
+    for(unsigned round = 0; round < EVALUATION_ROUNDS; round++){
+        // The threads of the first round are created by main
+        if(round > 0){
+            ___MACRO_END_TIMING;
+            CREATE_NORMAL_THREADS()
+        }
+        // Block until the threads signal, no polling wakeups
+        while(threads_done < NORMAL_THREADS){
+            ___MACRO_END_TIMING;
+            LOG_DEBUG("EVAL: Waiting for more threads done. Have %u\n", threads_done);
+            // Not timed, blocking on flags is no sleep and would skew its statistics
+            thread_flags_wait_any(EVAL_FLAG_THREAD_DONE);
+        }
         ___MACRO_END_TIMING;
-        LOG_WARNING("EVAL: Waiting for more threads done. Have %u\n", threads_done);
-        ___MACRO_START_TIMING(TIMING_TYPE_SLEEP, "eval_thread");
-        _secure_mintimer_tsleep32(0x00001000);      
-    }       
-    LOG_ERROR("Eval done. Dumping logs now..\n");
-    // Once all threads are done, we can print eval tables
-    print_eval_table(TIMING_TYPE_THREAD_CREATE);
-    print_eval_table(TIMING_TYPE_SWITCH_PERIODIC);
-    print_eval_table(TIMING_TYPE_CONTEXT_EXIT);
-    print_eval_table(TIMING_TYPE_SLEEP);
-    print_eval_table(TIMING_TYPE_YIELD);
-    print_eval_table(TIMING_TYPE_GET_TIME);
+        threads_done = 0;
+        LOG_WARNING("EVAL: Round %u done.\n", round);
+        eval_dump();
+    }
+    LOG_ERROR("Eval done.\n");
+    printf("bench_done\n");
 
     sched_shut_down();
     
@@ -218,23 +210,16 @@ int main(void)
     // Now we have started the timer...do our thing
 
     // Switch two SMs to periodic SMs
-    // ___MACRO_MEASURE_TIME(thread_change_to_periodical(pid1, 0xA000, 0x00020000), TIMING_TYPE_SWITCH_PERIODIC, "PERIODIC foo" )
-    // ___MACRO_MEASURE_TIME(thread_change_to_periodical(pid2, 0xA000, 0x00020000), TIMING_TYPE_SWITCH_PERIODIC, "PERIODIC bar" )
+#ifdef EVALUATION_PERIODIC
+    ___MACRO_MEASURE_TIME(thread_change_to_periodical(pid1, 0xA000, 0x00020000), TIMING_TYPE_SWITCH_PERIODIC, "PERIODIC foo" )
+    ___MACRO_MEASURE_TIME(thread_change_to_periodical(pid2, 0xA000, 0x00020000), TIMING_TYPE_SWITCH_PERIODIC, "PERIODIC bar" )
+#endif
 
     // create some normal threads
-    CREATE_NORMAL_THREAD(fooD, 4)
-    CREATE_NORMAL_THREAD(fooE, 5)
-    CREATE_NORMAL_THREAD(fooF, 6)
-    CREATE_NORMAL_THREAD(fooG, 7)
-    CREATE_NORMAL_THREAD(fooH, 8)
-    CREATE_NORMAL_THREAD(fooI, 9)
-    CREATE_NORMAL_THREAD(fooJ, 10)
-    CREATE_NORMAL_THREAD(fooK, 11)
-    CREATE_NORMAL_THREAD(fooL, 12)
-    CREATE_NORMAL_THREAD(fooM, 13)
+    CREATE_NORMAL_THREADS()
     
     // Create an eval thread
-    ___MACRO_MEASURE_TIME(thread_create(eval_stack, sizeof(eval_stack),      
+    ___MACRO_MEASURE_TIME(eval_pid = thread_create(eval_stack, sizeof(eval_stack),      
     14,                                              
     THREAD_CREATE_WOUT_YIELD | THREAD_CREATE_STACKTEST,
     eval_trampoline,                                 
@@ -4,11 +4,176 @@
 #include "secure_mintimer.h"
 #include "log.h"
 #include "sancus_helpers.h"
+#include "thread.h"
+
+/**
+ * The Makefile starts the timer shortly before the low 32 bit of the 64 bit
+ * time roll over into _long_cnt (SECURE_MINTIMER_HIGH_CNT_INIT). Each sleep
+ * below has to wake up no earlier than its target and at most
+ * ROLLOVER_LATENESS after it. Cases that are meant to cross the rollover
+ * check that their target lies behind it. Results are printed as
+ *      rollover,<case>,ok|FAIL
+ *
+ * Sleeps with a long offset last more than 2^32 ticks, over an hour of
+ * simulated time. They only run with ROLLOVER_LONG set (make sim-long): one
+ * from main through _secure_mintimer_tsleep64() and one at the same time from
+ * an SM through ___MACRO_CALL_SLEEP64_FROM_SM.
+ */
+#ifndef ROLLOVER_LONG
+#define ROLLOVER_LONG (0)
+#endif
+
+#define ROLLOVER_LATENESS   (0x1000)
+// Long offset of the long sleeps, the short part is ROLLOVER_LONG_OFFSET
+#define ROLLOVER_LONG_OFFSET (0x8000)
+
+static void rollover_check(const char *name, uint64_t before, uint64_t target,
+                           uint64_t after, int crosses)
+{
+    int ok = after >= target && after - target <= ROLLOVER_LATENESS
+        && ((target >> 32) != (before >> 32)) == !!crosses;
+    printf("rollover,%s,%s\n", name, ok ? "ok" : "FAIL");
+    if (!ok) {
+        printf("  start %08lx%08lx target %08lx%08lx woke %08lx%08lx\n",
+               (uint32_t)(before >> 32), (uint32_t)before,
+               (uint32_t)(target >> 32), (uint32_t)target,
+               (uint32_t)(after >> 32), (uint32_t)after);
+    }
+}
+
+static void rollover_sleep(const char *name, uint32_t ticks, int crosses)
+{
+    uint64_t before = _secure_mintimer_now64();
+
+    _secure_mintimer_tsleep32(ticks);
+
+    rollover_check(name, before, before + ticks, _secure_mintimer_now64(), crosses);
+}
+
+#if ROLLOVER_LONG
+static char longsleeper_unprotected_stack[THREAD_EXTRA_STACKSIZE_PRINTF];
+const char *longsleeper_description = "SM longsleeper";
+DECLARE_SM(longsleeper, 0x1234);
+
+// Unprotected, main prints them
+static volatile bool longsleeper_done;
+static uint64_t longsleeper_before, longsleeper_after;
+
+void SM_ENTRY(longsleeper) longsleeper_job(void)
+{
+    longsleeper_before = _secure_mintimer_now64();
+    ___MACRO_CALL_SLEEP64_FROM_SM(ROLLOVER_LONG_OFFSET, 0, 1, 0, longsleeper)
+    longsleeper_after = _secure_mintimer_now64();
+    longsleeper_done = true;
+    ___MACRO_CALL_THREAD_EXIT_FROM_SM(longsleeper)
+}
+
+static void rollover_long_test(void)
+{
+    while(sancus_enable(&longsleeper) == 0);
+    thread_create_protected(longsleeper_unprotected_stack, THREAD_EXTRA_STACKSIZE_PRINTF,
+        THREAD_PRIORITY_MAIN - 1, THREAD_CREATE_WOUT_YIELD, SM_GET_ENTRY(longsleeper),
+        SM_GET_ENTRY_IDX(longsleeper, longsleeper_job), longsleeper_description);
+
+    uint64_t ticks = (1ull << 32) + ROLLOVER_LONG_OFFSET;
+    uint64_t before = _secure_mintimer_now64();
+    _secure_mintimer_tsleep64(ticks);
+    rollover_check("long", before, before + ticks, _secure_mintimer_now64(), 1);
+
+    while (!longsleeper_done) {
+        _secure_mintimer_tsleep32(ROLLOVER_LATENESS);
+    }
+    rollover_check("long_sm", longsleeper_before, longsleeper_before + ticks,
+                   longsleeper_after, 1);
+}
+#endif
+
+static void rollover_test(void)
+{
+    uint32_t to_rollover = 0 - (uint32_t)_secure_mintimer_now64();
+
+    // Boot must leave enough time to sleep up to the rollover first
+    if (to_rollover < 0x10000) {
+        printf("rollover,start,FAIL\n");
+        return;
+    }
+
+    // Stays in the same long period
+    rollover_sleep("before", to_rollover / 2, 0);
+    // Target lies behind the rollover, the timer waits in the overflow wheel
+    to_rollover = 0 - (uint32_t)_secure_mintimer_now64();
+    rollover_sleep("across", to_rollover + 0x8000, 1);
+    // A sleep in the new long period
+    rollover_sleep("after", 0x1000, 0);
+    // Further ahead than the long wheel reaches, waits in the far list
+    rollover_sleep("far", 0x180000, 0);
+#if ROLLOVER_LONG
+    rollover_long_test();
+#endif
+}
+
+/**
+ * SLACK_THREADS threads sleep to targets SLACK_SPACING ticks apart, all with
+ * a sleep slack of SLACK_TICKS. Every thread has to wake up within
+ * [target, target + SLACK_TICKS + SLACK_LATENCY]. The windows overlap, so the
+ * interrupt of the first thread should take along all others: the last one
+ * has to wake up before the end of its own window. Results are printed as
+ *      slack,<thread>,ok|FAIL
+ *      slack,coalesced,ok|FAIL
+ */
+#define SLACK_THREADS   (4)
+#define SLACK_TICKS     (0x1000)
+#define SLACK_SPACING   (0x400)
+// Time from the interrupt until a woken thread reads the time
+#define SLACK_LATENCY   (0x800)
+
+static char slack_stacks[SLACK_THREADS][THREAD_STACKSIZE_DEFAULT];
+static uint64_t slack_base;
+static uint64_t slack_woke[SLACK_THREADS];
+
+static void *slack_sleeper(void *arg)
+{
+    unsigned i = (uintptr_t)arg;
+    uint64_t target = slack_base + i * SLACK_SPACING;
+
+    secure_mintimer_set_sleep_slack(SLACK_TICKS);
+    _secure_mintimer_tsleep32((uint32_t)(target - _secure_mintimer_now64()));
+    slack_woke[i] = _secure_mintimer_now64();
+
+    return NULL;
+}
+
+static void slack_test(void)
+{
+    slack_base = _secure_mintimer_now64() + 0x4000;
+    for (unsigned i = 0; i < SLACK_THREADS; i++) {
+        thread_create(slack_stacks[i], THREAD_STACKSIZE_DEFAULT, THREAD_PRIORITY_MAIN - 1,
+            THREAD_CREATE_WOUT_YIELD, slack_sleeper, (void *)(uintptr_t)i, "slack");
+    }
+
+    // Until all windows are over
+    _secure_mintimer_tsleep32((uint32_t)(slack_base - _secure_mintimer_now64())
+        + SLACK_THREADS * SLACK_SPACING + SLACK_TICKS + SLACK_LATENCY);
+
+    for (unsigned i = 0; i < SLACK_THREADS; i++) {
+        uint64_t target = slack_base + i * SLACK_SPACING;
+        int ok = slack_woke[i] >= target && slack_woke[i] <= target + SLACK_TICKS + SLACK_LATENCY;
+        printf("slack,%u,%s\n", i, ok ? "ok" : "FAIL");
+        if (!ok) {
+            printf("  target %08lx woke %08lx\n", (uint32_t)target, (uint32_t)slack_woke[i]);
+        }
+    }
+    uint64_t last = slack_base + (SLACK_THREADS - 1) * SLACK_SPACING;
+    printf("slack,coalesced,%s\n", slack_woke[SLACK_THREADS - 1] < last + SLACK_TICKS ? "ok" : "FAIL");
+}
 
 int main(void)
 {
     LOG_INFO("######## Riot on Sancus\n");
     LOG_INFO("Simple secure_mintimer application based on Riot Xtimer\n");
+
+    rollover_test();
+    slack_test();
     printf("Testing colored logs..");
     LOG_DEBUG("Debug ");
     LOG_INFO("Info ");
@@ -0,0 +1,128 @@
+#include <msp430.h>
+#include <stdio.h>
+#include "kernel_defines.h"
+#include "secure_mintimer.h"
+#include "log.h"
+#include "sancus_helpers.h"
+#include "msp430_regs.h"
+
+/**
+ * Adversarial workloads for the SCHED_WCET measurement:
+ *  - every timer of the pool is armed by sleepers on all unprotected priorities,
+ *  - sleepers expire just before the overflow so that it hits their callback,
+ *  - sleepers sleep for several periods so that the long timers fill up,
+ *  - a periodic SM exhausts its budget while it yields in a loop,
+ *  - another periodic SM is released and exits every period.
+ * After WCET_DURATION ticks, main prints the longest run of every path as
+ *      wcet,<path>,<ticks>
+ * for dist/tools/wcet.
+ */
+
+// Ticks the workloads run before the maxima are printed
+#ifndef WCET_DURATION
+#define WCET_DURATION (0x00400000)
+#endif
+
+// The periodic SMs and main take one timer of the pool each
+#define SLEEPERS (SECURE_MINTIMER_POOL_SIZE - 3)
+#define SLEEPER_STACKSIZE (256)
+
+static char sleeper_stacks[SLEEPERS][SLEEPER_STACKSIZE];
+
+static void *sleeper(void *arg)
+{
+    uint16_t seed = (uintptr_t)arg;
+    uint16_t to_overflow;
+
+    while (1) {
+        seed = seed * 25173 + 13849;
+        switch (seed >> 14) {
+            case 0:
+                // Expire right before the overflow
+                to_overflow = 0 - TIMER_A->R;
+                if (to_overflow > (seed & 0x3f)) {
+                    _secure_mintimer_tsleep32(to_overflow - (seed & 0x3f));
+                }
+                break;
+            case 1:
+                thread_yield_higher();
+                break;
+            case 2:
+                // Lands on the long wheel, or deep in the long list
+                _secure_mintimer_tsleep32(0x20000 + ((uint32_t)(seed & 0x3fff) << 4));
+                break;
+            default:
+                _secure_mintimer_tsleep32(0x100 + (seed & 0xfff));
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+// Periodic SMs
+#define DEFINE_PERIODIC_SM(name)                                    \
+static char name##_unprotected_stack[THREAD_EXTRA_STACKSIZE_PRINTF];\
+const char *name##_description = "SM " #name;                       \
+DECLARE_SM(name, 0x1234);
+
+#define CREATE_SM_THREAD(name, pid)                 \
+    riot_enable_sm(&name);                          \
+    pid = thread_create_protected(                  \
+        name##_unprotected_stack,                   \
+        THREAD_EXTRA_STACKSIZE_PRINTF,              \
+        SCHED_MAX_PRIO_LEVEL_UNPROTECTED - 1,       \
+        THREAD_CREATE_WOUT_YIELD,                   \
+        SM_GET_ENTRY(name),                         \
+        SM_GET_ENTRY_IDX(name, name##_job),         \
+        name##_description);
+
+DEFINE_PERIODIC_SM(spinner)
+DEFINE_PERIODIC_SM(pulse)
+
+// Yields until the budget of the job runs out
+void SM_ENTRY(spinner) spinner_job(void)
+{
+    while (1) {
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(spinner)
+    }
+}
+
+void SM_ENTRY(pulse) pulse_job(void)
+{
+    ___MACRO_CALL_THREAD_EXIT_FROM_SM(pulse)
+}
+
+int main(void)
+{
+    LOG_INFO("######## Riot on Sancus\n");
+    LOG_INFO("Scheduler WCET workloads\n");
+
+    kernel_pid_t spinner_pid, pulse_pid;
+    CREATE_SM_THREAD(spinner, spinner_pid)
+    CREATE_SM_THREAD(pulse, pulse_pid)
+    thread_change_to_periodical(spinner_pid, 0x0800, 0x00004000);
+    thread_change_to_periodical(pulse_pid, 0x0100, 0x00003000);
+
+    // Populate all priorities of unprotected threads
+    for (unsigned i = 0; i < SLEEPERS; i++) {
+        uint8_t prio = SCHED_MAX_PRIO_LEVEL_UNPROTECTED
+            + i % (THREAD_PRIORITY_IDLE - SCHED_MAX_PRIO_LEVEL_UNPROTECTED);
+        thread_create(sleeper_stacks[i], SLEEPER_STACKSIZE, prio,
+            THREAD_CREATE_WOUT_YIELD, sleeper, (void *)(uintptr_t)(i + 1), "sleeper");
+    }
+
+    _secure_mintimer_tsleep32(WCET_DURATION);
+
+    uint16_t max[SCHED_WCET_PATHS];
+    int count = sched_wcet_snapshot(max, SCHED_WCET_PATHS);
+    for (int i = 0; i < count; i++) {
+        printf("wcet,%d,%u\n", i, max[i]);
+    }
+    printf("wcet_done\n");
+
+    sched_shut_down();
+
+    UNREACHABLE();
+    return 0;
+}
@@ -16,9 +16,12 @@
  *
  * The implementation takes one low-level timer and multiplexes it.
  *
- * Insertion and removal of timers has O(n) complexity with (n) being the
- * number of active timers.  The reason for this is that multiplexing is
- * realized by next-first singly linked lists.
+ * Removal of timers and finding the next one to fire have O(1) complexity.
+ * Multiplexing is realized by timing wheels: one for the current and one for
+ * the next period of the low-level timer, a long wheel with one slot per
+ * upcoming period and a far list for everything beyond. The slots of the two
+ * short wheels are kept sorted, so inserting a timer walks the timers sharing
+ * its slot, see @ref SECURE_MINTIMER_WHEEL_BITS.
  *
  * @{
  * @file
@@ -72,14 +75,32 @@ typedef void (*secure_mintimer_callback_t)(void*);
  */
 typedef struct secure_mintimer {
     struct secure_mintimer *next;         /**< reference to next timer in timer lists */
+    struct secure_mintimer **pprev;       /**< reference to the pointer to this timer,
+                                               NULL if the timer is not armed */
     uint32_t target;             /**< lower 32bit absolute target time */
     uint32_t long_target;        /**< upper 32bit absolute target time */
     thread_t* thread;       /** Thread this timer is associated with **/
-    // secure_mintimer_callback_t callback;  /**< callback function to call when timer
-                                    //  expires */
-    // void *arg;                   /**< argument to pass to callback function */
+    uint8_t slot;                /**< timing wheel slot the timer is in */
+    uint16_t slack;              /**< ticks the timer may fire late to share
+                                      a wakeup with other timers, at most
+                                      SECURE_MINTIMER_MAX_SLACK */
+    secure_mintimer_callback_t callback;  /**< callback function to call when timer
+                                     expires, NULL to wake up the thread */
+    void *arg;                   /**< argument to pass to callback function */
 } secure_mintimer_t;
 
+/**
+ * @brief Handle of a timer in the secure_mintimer pool
+ *
+ * Handles are one byte, so they are cheaper to store than pointers.
+ */
+typedef uint8_t secure_mintimer_handle_t;
+
+/**
+ * @brief Handle that refers to no timer
+ */
+#define SECURE_MINTIMER_HANDLE_NONE (0)
+
 /**
  * @brief get the current system time as 32bit time stamp value
  *
@@ -135,7 +156,7 @@ void SM_FUNC(sancus_sm_timer) secure_mintimer_init(void);
  *
  * @param[in] seconds   the amount of seconds the thread should sleep
  */
-void SM_FUNC(sancus_sm_timer) _secure_mintimer_tsleep_internal();
+void SM_FUNC(sancus_sm_timer) _secure_mintimer_tsleep_internal(uint32_t offset, uint32_t long_offset);
 static inline void secure_mintimer_sleep(uint32_t seconds);
 
 /**
@@ -219,23 +240,134 @@ static inline void SM_FUNC(sancus_sm_timer) secure_mintimer_spin(secure_mintimer
  * @param[in] offset_us   time in microseconds from now specifying that timer's
  *                        callback's execution time
  */
-// static inline void secure_mintimer_set64(secure_mintimer_t *timer, uint64_t offset_us);
+static inline void SM_FUNC(sancus_sm_timer) secure_mintimer_set64(secure_mintimer_t *timer, uint64_t offset_us);
 void SM_FUNC(sancus_sm_timer) _secure_mintimer_set(secure_mintimer_t *timer, uint32_t offset);
 
+/**
+ * @brief Set a timer @p offset + 2^32 * @p long_offset ticks in the future
+ *
+ * @note @p long_offset is limited to 2^(SECURE_MINTIMER_WIDTH - 1) - 1,
+ *       longer timers fire at that limit.
+ */
+void SM_FUNC(sancus_sm_timer) _secure_mintimer_set64(secure_mintimer_t *timer, uint32_t offset, uint32_t long_offset);
+
+/**
+ * @brief Allocate a timer from the pool
+ *
+ * Timers are owned by a thread, which may hold at most
+ * SECURE_MINTIMER_THREAD_QUOTA of them. The timer wakes up @p owner unless
+ * a callback is set.
+ *
+ * @param[in] owner     thread the timer is charged to
+ *
+ * @return  an unarmed timer, or NULL if the pool or the quota of @p owner is exhausted
+ */
+secure_mintimer_t* SM_FUNC(sancus_sm_timer) secure_mintimer_alloc(thread_t *owner);
+
+/**
+ * @brief Disarm a timer and give it back to the pool
+ *
+ * @param[in] timer     timer from secure_mintimer_alloc()
+ */
+void SM_FUNC(sancus_sm_timer) secure_mintimer_free(secure_mintimer_t *timer);
+
+/**
+ * @brief Give back all timers of a thread, e.g. when it exits
+ *
+ * @param[in] pid       owner of the timers
+ */
+void SM_FUNC(sancus_sm_timer) secure_mintimer_free_all(kernel_pid_t pid);
+
+/**
+ * @brief Get the wakeup timer of a thread
+ *
+ * Every thread uses one timer for sleeping and for its periodic releases.
+ * It is allocated on first use and any pending wakeup is cancelled.
+ *
+ * @param[in] pid       thread to wake up
+ *
+ * @return  the disarmed wakeup timer, or NULL if none could be allocated
+ */
+secure_mintimer_t* SM_FUNC(sancus_sm_timer) secure_mintimer_wakeup_timer(kernel_pid_t pid);
+
+/**
+ * @brief Handle of a timer from the pool
+ */
+secure_mintimer_handle_t SM_FUNC(sancus_sm_timer) secure_mintimer_handle(secure_mintimer_t *timer);
+
+/**
+ * @brief Timer of a handle
+ *
+ * @return  the timer, or NULL if @p handle is not valid
+ */
+secure_mintimer_t* SM_FUNC(sancus_sm_timer) secure_mintimer_from_handle(secure_mintimer_handle_t handle);
+
 // Set explicit timer without checking time again.
-secure_mintimer_t* SM_FUNC(sancus_sm_timer) get_available_timer(kernel_pid_t pid);
 int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute(secure_mintimer_t *timer, uint32_t target);
 int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute_explicit(secure_mintimer_t *timer, uint32_t now);
 
 /**
  * @brief remove a timer
  *
- * @note this function runs in O(n) with n being the number of active timers
+ * @note this function runs in O(1)
  *
  * @param[in] timer ptr to timer structure that will be removed
  */
 void SM_FUNC(sancus_sm_timer) secure_mintimer_remove(secure_mintimer_t *timer);
 
+/**
+ * @brief let a timer fire up to @p slack ticks late to share a wakeup
+ *
+ * Takes effect the next time the timer is set.
+ *
+ * @param[in] timer  the timer
+ * @param[in] slack  slack in ticks, limited to SECURE_MINTIMER_MAX_SLACK
+ */
+static inline void secure_mintimer_set_slack(secure_mintimer_t *timer, uint16_t slack);
+
+/**
+ * @brief set the slack of the calling thread's sleeps
+ *
+ * Sleeps of the thread may then end up to @p slack ticks late, so that
+ * threads with close wakeup times share one timer interrupt and one run of
+ * the scheduler. Periodic releases always stay exact.
+ *
+ * @param[in] slack  slack in ticks, limited to SECURE_MINTIMER_MAX_SLACK
+ *
+ * @return 0 on success, -ENOMEM if the thread has no timer left, -EINVAL if
+ *         no thread is running yet
+ */
+int SM_ENTRY(sancus_sm_timer) secure_mintimer_set_sleep_slack(uint16_t slack);
+
+/**
+ * @brief ticks until the next armed timer has to fire
+ *
+ * Exact for timers of the current and the next period of the low-level timer,
+ * timers further ahead are counted from the start of their period.
+ *
+ * @return the distance in ticks, 0 if a timer is due,
+ *         UINT32_MAX if no timer is armed at all
+ */
+uint32_t SM_FUNC(sancus_sm_timer) secure_mintimer_next_distance(void);
+
+/**
+ * @brief request a run of the scheduler at an absolute time
+ *
+ * Used to enforce the budget of periodic threads. The budget has its own
+ * compare channel, SECURE_MINTIMER_BUDGET_CHAN, so it does not go through
+ * the timing wheels. Only one budget is armed at a time, setting a new one
+ * replaces it.
+ *
+ * @param[in] target        lower 32bit absolute time
+ * @param[in] long_target   upper 32bit absolute time
+ */
+void SM_FUNC(sancus_sm_timer) secure_mintimer_budget_set(uint32_t target, uint32_t long_target);
+
+/**
+ * @brief disarm the budget set by secure_mintimer_budget_set()
+ */
+void SM_FUNC(sancus_sm_timer) secure_mintimer_budget_clear(void);
+
 /**
  * @brief Convert microseconds to secure_mintimer ticks
  *
@@ -341,15 +473,32 @@ static inline bool secure_mintimer_less(secure_mintimer_ticks32_t a, secure_mint
 static inline bool secure_mintimer_less64(secure_mintimer_ticks64_t a, secure_mintimer_ticks64_t b);
 
 /**
- * @brief lock a mutex but with timeout
+ * @brief lock a mutex of the scheduler but with timeout
+ *
+ * The timeout uses a timer from the pool of the calling thread. Periodic
+ * threads can not block, they only get the mutex if it is free. SMs use
+ * ___MACRO_MUTEX_LOCK_TIMEOUT_FROM_SM() instead.
  *
- * @param[in]    mutex  mutex to lock
+ * @param[in]    id     mutex to lock, see mutex_lock_id()
  * @param[in]    us     timeout in microseconds relative
  *
  * @return       0, when returned after mutex was locked
- * @return       -1, when the timeout occcured
+ * @return       -1, when the timeout occcured, no timer was left or the
+ *               caller already holds the mutex
  */
-int secure_mintimer_mutex_lock_timeout(mutex_t *mutex, uint64_t us);
+int secure_mintimer_mutex_lock_timeout(unsigned id, uint32_t us);
+
+/**
+ * @name Scheduler side of secure_mintimer_mutex_lock_timeout()
+ *
+ * _secure_mintimer_mutex_lock_timeout() returns MUTEX_BLOCKED once the caller
+ * is queued, it then has to yield and call _secure_mintimer_mutex_wait()
+ * until that returns something else.
+ * @{
+ */
+int SM_ENTRY(sancus_sm_timer) _secure_mintimer_mutex_lock_timeout(unsigned id, uint32_t us);
+int SM_ENTRY(sancus_sm_timer) _secure_mintimer_mutex_wait(unsigned id);
+/** @} */
 
 /**
  * @brief    Set timeout thread flag after @p timeout
@@ -357,10 +506,10 @@ int secure_mintimer_mutex_lock_timeout(mutex_t *mutex, uint64_t us);
  * This function will set THREAD_FLAG_TIMEOUT on the current thread after @p
  * timeout usec have passed.
  *
- * @param[in]   t       timer struct to use
+ * @param[in]   t       timer struct to use, see secure_mintimer_alloc()
  * @param[in]   timeout timeout in usec
  */
-void secure_mintimer_set_timeout_flag(secure_mintimer_t *t, uint32_t timeout);
+void SM_FUNC(sancus_sm_timer) secure_mintimer_set_timeout_flag(secure_mintimer_t *t, uint32_t timeout);
 
 // Used to call the timer callback at arbitrary times unrelated to timer.c (e.g. after operations)
 void SM_FUNC(sancus_sm_timer) secure_mintimer_timer_callback(void);
@@ -369,7 +518,7 @@ void SM_FUNC(sancus_sm_timer) secure_mintimer_timer_callback(void);
  * @brief secure_mintimer backoff value
  *
  * All timers that are less than SECURE_MINTIMER_BACKOFF microseconds in the future will
- * just spin.
+ * just spin (see SECURE_MINTIMER_DEFERRED).
  *
  * This is supposed to be defined per-device in e.g., periph_conf.h.
  */
@@ -394,7 +543,8 @@ void SM_FUNC(sancus_sm_timer) secure_mintimer_timer_callback(void);
  * but when the timer triggers, secure_mintimer will spin-lock until a timer's target
  * time is reached, so timers will never trigger early.
  *
- * This is supposed to be defined per-device in e.g., periph_conf.h.
+ * This is supposed to be defined per-device in e.g., periph_conf.h, or
+ * generated from measurements with examples/wcet.
  */
 #ifndef SECURE_MINTIMER_OVERHEAD
 #define SECURE_MINTIMER_OVERHEAD 300
@@ -412,6 +562,78 @@ void SM_FUNC(sancus_sm_timer) secure_mintimer_timer_callback(void);
 #define SECURE_MINTIMER_ISR_BACKOFF 200
 #endif
 
+/**
+ * @def SECURE_MINTIMER_DEFERRED
+ * @brief Define to fire near-term timers from an interrupt instead of spinning
+ *
+ * Timers less than SECURE_MINTIMER_BACKOFF (or SECURE_MINTIMER_ISR_BACKOFF in
+ * the timer interrupt) ahead are then kept on a separate list and fired by
+ * the compare channel SECURE_MINTIMER_NEAR_CHAN, so other threads run until
+ * they expire.
+ */
+
+/**
+ * @def SECURE_MINTIMER_CALIBRATE
+ * @brief Define to measure SECURE_MINTIMER_BACKOFF and
+ *        SECURE_MINTIMER_ISR_BACKOFF in secure_mintimer_init()
+ *
+ * The compile time values are then only used until the measurement is done.
+ * SECURE_MINTIMER_ISR_BACKOFF keeps growing with the latency from the entry of
+ * the timer ISR to its callback, measured on every timer interrupt.
+ */
+
+#ifndef SECURE_MINTIMER_CALIBRATE_ROUNDS
+/**
+ * @brief   Rounds of each measurement of SECURE_MINTIMER_CALIBRATE
+ *
+ * The largest cost seen is taken, twice that is used as backoff.
+ */
+#define SECURE_MINTIMER_CALIBRATE_ROUNDS (8)
+#endif
+
+#ifndef SECURE_MINTIMER_POOL_SIZE
+/**
+ * @brief   Number of timers in the secure_mintimer pool
+ */
+#define SECURE_MINTIMER_POOL_SIZE (16)
+#endif
+
+#ifndef SECURE_MINTIMER_THREAD_QUOTA
+/**
+ * @brief   Number of pool timers a single thread may hold
+ *
+ * One of them is the wakeup timer used for sleeping and periodic releases,
+ * the others can be used for timeouts.
+ */
+#define SECURE_MINTIMER_THREAD_QUOTA (3)
+#endif
+
+#ifndef SECURE_MINTIMER_WHEEL_BITS
+/**
+ * @brief   log2 of the number of slots per secure_mintimer timing wheel
+ *
+ * Each slot of the short wheels covers
+ * 2^(SECURE_MINTIMER_WIDTH - SECURE_MINTIMER_WHEEL_BITS) ticks, the long wheel
+ * looks 2^SECURE_MINTIMER_WHEEL_BITS periods of the low-level timer ahead.
+ * Inserting a timer into a short wheel walks the timers of its slot, at most
+ * SECURE_MINTIMER_POOL_SIZE. More slots keep these lists shorter. Slot maps
+ * are 16 bit wide, so at most 4.
+ */
+#define SECURE_MINTIMER_WHEEL_BITS (4)
+#endif
+
+#ifndef SECURE_MINTIMER_MAX_SLACK
+/**
+ * @brief   Largest slack of a timer, in hardware ticks
+ *
+ * A timer with slack fires at the latest slack ticks after its target, or
+ * earlier together with any other timer whose wakeup falls into that window.
+ * On every timer interrupt, the short wheel slots up to this many ticks ahead
+ * are searched for such timers.
+ */
+#define SECURE_MINTIMER_MAX_SLACK (4096)
+#endif
+
 #ifndef SECURE_MINTIMER_PERIODIC_SPIN
 /**
  * @brief   secure_mintimer_periodic_wakeup spin cutoff
@@ -456,6 +678,22 @@ void SM_FUNC(sancus_sm_timer) secure_mintimer_timer_callback(void);
 
 #endif
 
+#ifndef SECURE_MINTIMER_BUDGET_CHAN
+/**
+ * @brief Hardware timer channel for the budget of periodic threads, see
+ *        secure_mintimer_budget_set()
+ */
+#define SECURE_MINTIMER_BUDGET_CHAN (1)
+#endif
+
+#ifndef SECURE_MINTIMER_NEAR_CHAN
+/**
+ * @brief Hardware timer channel for near-term timers, see
+ *        SECURE_MINTIMER_DEFERRED
+ */
+#define SECURE_MINTIMER_NEAR_CHAN (2)
+#endif
+
 #ifndef SECURE_MINTIMER_WIDTH
 /**
  * @brief secure_mintimer timer width
@@ -535,9 +773,16 @@ void SM_FUNC(sancus_sm_timer) secure_mintimer_timer_callback(void);
 #endif
 
 #ifdef DEBUG_TIMER
-extern secure_mintimer_t secure_mintimer_timer_list [];
+extern secure_mintimer_t secure_mintimer_pool [];
 extern secure_mintimer_t *timer_list_head;
-extern secure_mintimer_t *long_list_head;
+extern secure_mintimer_t *secure_mintimer_wheel[];
+#ifdef SECURE_MINTIMER_DEFERRED
+/* two short wheels, the long wheel, the far list and the near-term list */
+#define SECURE_MINTIMER_WHEEL_SLOT_COUNT ((3 << SECURE_MINTIMER_WHEEL_BITS) + 2)
+#else
+/* two short wheels, the long wheel and the far list */
+#define SECURE_MINTIMER_WHEEL_SLOT_COUNT ((3 << SECURE_MINTIMER_WHEEL_BITS) + 1)
+#endif
 extern uint32_t _long_cnt;
 extern uint32_t _secure_mintimer_high_cnt;
 #endif
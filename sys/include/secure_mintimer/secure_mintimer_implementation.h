@@ -70,7 +70,6 @@ uint64_t _secure_mintimer_now64(void);
  * @param[in] target  Absolute target value in ticks.
  */
 // int _secure_mintimer_set_absolute(secure_mintimer_t *timer, uint32_t target);
-// void _secure_mintimer_set64(secure_mintimer_t *timer, uint32_t offset, uint32_t long_offset);
 // void _secure_mintimer_set_wakeup(secure_mintimer_t *timer, uint32_t offset, kernel_pid_t pid);
 // void _secure_mintimer_set_wakeup64(secure_mintimer_t *timer, uint64_t offset, kernel_pid_t pid);
 
@@ -151,12 +150,16 @@ static inline void secure_mintimer_tsleep64(secure_mintimer_ticks64_t ticks)
 }
 
 
-// Removed
-// static inline void secure_mintimer_set64(secure_mintimer_t *timer, uint64_t period_us)
-// {
-//     uint64_t ticks = _secure_mintimer_ticks_from_usec64(period_us);
-//     _secure_mintimer_set64(timer, ticks, ticks >> 32);
-// }
+static inline void SM_FUNC(sancus_sm_timer) secure_mintimer_set64(secure_mintimer_t *timer, uint64_t period_us)
+{
+    uint64_t ticks = _secure_mintimer_ticks_from_usec64(period_us);
+    _secure_mintimer_set64(timer, ticks, ticks >> 32);
+}
+
+static inline void secure_mintimer_set_slack(secure_mintimer_t *timer, uint16_t slack)
+{
+    timer->slack = (slack > SECURE_MINTIMER_MAX_SLACK) ? SECURE_MINTIMER_MAX_SLACK : slack;
+}
 
 static inline uint32_t secure_mintimer_usec_from_ticks(secure_mintimer_ticks32_t ticks)
 {
@@ -0,0 +1,308 @@
+/*
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @defgroup    sys_spsc Shared memory channels
+ * @ingroup     sys
+ * @brief       Single-producer/single-consumer byte rings in shared memory
+ *
+ * A channel is a ring of a power of two bytes in unprotected memory that
+ * both ends can access directly, e.g. an SM and an unprotected thread, or
+ * two SMs. Data moves without entering any enclave. The producer only writes
+ * spsc_shared_t::head and the consumer only spsc_shared_t::tail.
+ *
+ * Every end keeps its own spsc_t, which an SM places in its SM_DATA. The
+ * shared region is not trusted: indices read from it are bounded by the
+ * size of the private descriptor, so a corrupted region can lose or repeat
+ * data but never make an end access memory outside its ring.
+ *
+ * A consumer that finds the ring empty blocks in the scheduler on the
+ * notification id of the channel with spsc_wait() (or
+ * ___MACRO_SPSC_WAIT_FROM_SM). The producer calls spsc_notify() whenever
+ * a spsc_commit() made the ring non-empty, so a burst costs one scheduler
+ * entry instead of one per byte. Channels that are drained by the same
+ * thread can share one id.
+ *
+ * @{
+ * @file
+ * @brief       Shared memory channel interface
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "kernel_types.h"
+#include "sancus_helpers.h"
+#include "sancus_modules.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @def SPSC_NOTIFY_NUMOF
+ * @brief Number of notification ids the scheduler keeps for channels.
+ */
+#ifndef SPSC_NOTIFY_NUMOF
+#define SPSC_NOTIFY_NUMOF (4)
+#endif
+
+/**
+ * @name Notification ids of system drivers
+ *
+ * These come on top of the SPSC_NOTIFY_NUMOF ids of applications, which can
+ * therefore use all of theirs.
+ * @{
+ */
+#define SPSC_NOTIFY_UART_RX     (SPSC_NOTIFY_NUMOF)     /**< UART receive ring */
+#define SPSC_NOTIFY_RESERVED    (1)                     /**< number of system ids */
+/** @} */
+
+/**
+ * @brief Return value of _spsc_wait() if the caller is blocked and has to yield
+ */
+#define SPSC_BLOCKED    (3)
+
+/**
+ * @brief Shared part of a channel, lies in unprotected memory
+ */
+typedef struct {
+    volatile uint16_t head;     /**< bytes written in total, producer only */
+    volatile uint16_t tail;     /**< bytes read in total, consumer only */
+    uint8_t data[];             /**< ring storage */
+} spsc_shared_t;
+
+/**
+ * @brief Region size for a channel of @p size bytes
+ */
+#define SPSC_REGION_SIZE(size) (sizeof(spsc_shared_t) + (size))
+
+/**
+ * @brief One end of a channel
+ */
+typedef struct {
+    spsc_shared_t *shared;      /**< shared region */
+    uint16_t mask;              /**< ring size - 1 */
+    uint8_t notify;             /**< notification id in the scheduler */
+} spsc_t;
+
+/**
+ * @brief Sets up an end of a channel
+ *
+ * @param[out] c        end to set up
+ * @param[in] shared    shared region of SPSC_REGION_SIZE(@p size) bytes
+ * @param[in] size      ring size in bytes, a power of two up to 2^15
+ * @param[in] notify    notification id, below SPSC_NOTIFY_NUMOF
+ * @param[in] reset     clears the indices, only one end may do this
+ *                      before the other end uses the channel
+ */
+static inline void spsc_init(spsc_t *c, spsc_shared_t *shared, uint16_t size,
+                             uint8_t notify, bool reset)
+{
+    c->shared = shared;
+    c->mask = size - 1;
+    c->notify = notify;
+    if (reset) {
+        shared->head = 0;
+        shared->tail = 0;
+    }
+}
+
+/**
+ * @brief Bytes the consumer can read
+ */
+static inline uint16_t spsc_avail(const spsc_t *c)
+{
+    uint16_t used = c->shared->head - c->shared->tail;
+    // A broken region reads as empty
+    return used > c->mask + 1u ? 0 : used;
+}
+
+/**
+ * @brief Bytes the producer can write
+ */
+static inline uint16_t spsc_free(const spsc_t *c)
+{
+    uint16_t used = c->shared->head - c->shared->tail;
+    return used > c->mask + 1u ? 0 : c->mask + 1u - used;
+}
+
+/**
+ * @brief Contiguous space to write to without copying
+ *
+ * @param[in] c         producer end
+ * @param[out] len      bytes that can be written at the returned address
+ *
+ * @return start of the space, pass the number of bytes written to
+ *         spsc_commit()
+ */
+static inline uint8_t *spsc_write_ptr(spsc_t *c, uint16_t *len)
+{
+    uint16_t head = c->shared->head & c->mask;
+    uint16_t to_end = c->mask + 1u - head;
+    uint16_t free = spsc_free(c);
+
+    *len = free < to_end ? free : to_end;
+    return &c->shared->data[head];
+}
+
+/**
+ * @brief Publishes @p n bytes written at spsc_write_ptr()
+ *
+ * @return true if the ring was empty before, the consumer then needs a
+ *         spsc_notify()
+ */
+static inline bool spsc_commit(spsc_t *c, uint16_t n)
+{
+    uint16_t head = c->shared->head;
+
+    // The data has to be in place before the consumer sees the new head
+    __asm__ volatile ("" : : : "memory");
+    c->shared->head = head + n;
+    __asm__ volatile ("" : : : "memory");
+    return c->shared->tail == head;
+}
+
+/**
+ * @brief Contiguous data to read without copying
+ *
+ * @param[in] c         consumer end
+ * @param[out] len      bytes that can be read at the returned address
+ *
+ * @return start of the data, pass the number of bytes consumed to
+ *         spsc_release()
+ */
+static inline const uint8_t *spsc_read_ptr(spsc_t *c, uint16_t *len)
+{
+    uint16_t tail = c->shared->tail & c->mask;
+    uint16_t to_end = c->mask + 1u - tail;
+    uint16_t avail = spsc_avail(c);
+
+    *len = avail < to_end ? avail : to_end;
+    return &c->shared->data[tail];
+}
+
+/**
+ * @brief Returns @p n bytes read at spsc_read_ptr() to the producer
+ */
+static inline void spsc_release(spsc_t *c, uint16_t n)
+{
+    __asm__ volatile ("" : : : "memory");
+    c->shared->tail += n;
+}
+
+/**
+ * @brief Copies up to @p len bytes into the ring
+ *
+ * @return bytes written, and whether a notification is due in @p notify
+ */
+static inline uint16_t spsc_write(spsc_t *c, const void *buf, uint16_t len,
+                                  bool *notify)
+{
+    const uint8_t *src = buf;
+    uint16_t done = 0;
+
+    *notify = false;
+    while (done < len) {
+        uint16_t n;
+        uint8_t *dst = spsc_write_ptr(c, &n);
+        if (n == 0) {
+            break;
+        }
+        if (n > len - done) {
+            n = len - done;
+        }
+        // No memcpy, it would be an outcall from an SM
+        for (uint16_t i = 0; i < n; i++) {
+            dst[i] = src[done + i];
+        }
+        *notify |= spsc_commit(c, n);
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * @brief Copies up to @p len bytes out of the ring
+ *
+ * @return bytes read
+ */
+static inline uint16_t spsc_read(spsc_t *c, void *buf, uint16_t len)
+{
+    uint8_t *dst = buf;
+    uint16_t done = 0;
+
+    while (done < len) {
+        uint16_t n;
+        const uint8_t *src = spsc_read_ptr(c, &n);
+        if (n == 0) {
+            break;
+        }
+        if (n > len - done) {
+            n = len - done;
+        }
+        for (uint16_t i = 0; i < n; i++) {
+            dst[done + i] = src[i];
+        }
+        spsc_release(c, n);
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * @brief Wakes the thread waiting on @p id, or lets its next wait return
+ * right away.
+ *
+ * @return 1, or 2 if the woken thread should run before the caller
+ * @return -EINVAL on an invalid id
+ */
+int SM_ENTRY(sancus_sm_timer) spsc_notify(unsigned id);
+
+/**
+ * @brief Scheduler side of spsc_wait()
+ *
+ * Consumes a pending notification, or blocks the caller on @p id.
+ *
+ * @return 1, if a notification was pending
+ * @return SPSC_BLOCKED, if the caller is blocked and has to yield
+ * @return 0, for periodic callers, which never block
+ * @return -EINVAL on an invalid id, -EBUSY if another thread waits on it
+ */
+int SM_ENTRY(sancus_sm_timer) _spsc_wait(unsigned id);
+
+/**
+ * @brief Blocks until the producer of @p c notified, unless it has data
+ *
+ * Unprotected threads only, SMs use ___MACRO_SPSC_WAIT_FROM_SM.
+ *
+ * @return bytes available, 0 if woken without data
+ */
+uint16_t spsc_wait(spsc_t *c);
+
+/**
+ * @brief SM variant of spsc_wait(), yields with an exitless call
+ */
+#define ___MACRO_SPSC_WAIT_FROM_SM(c, sm)                            \
+    if (spsc_avail(c) == 0                                           \
+        && _spsc_wait((c)->notify) == SPSC_BLOCKED) {                \
+        ___MACRO_CALL_THREAD_YIELD_FROM_SM(sm)                       \
+    }
+
+/**
+ * @brief Releases the notification ids of an exiting thread (internal)
+ */
+void SM_FUNC(sancus_sm_timer) spsc_thread_exit(kernel_pid_t pid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPSC_H */
+/** @} */
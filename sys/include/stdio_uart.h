@@ -58,6 +58,13 @@ extern "C" {
 #define STDIO_UART_RX_BUFSIZE   (64)
 #endif
 
+/**
+ * @def STDIO_UART_LINE_MODE
+ * @brief Define to let stdio_read() return whole lines only
+ * The receive ISR then also turns carriage returns into newlines and handles
+ * backspace on the line that is being typed.
+ */
+
 #ifdef __cplusplus
 }
 #endif
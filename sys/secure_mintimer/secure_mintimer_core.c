@@ -23,6 +23,7 @@
 #include "secure_mintimer.h"
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include "board.h"
 #include "periph/timer.h"
 #include "periph_conf.h"
@@ -30,6 +31,8 @@
 #include "secure_mintimer.h"
 // #include "irq.h"
 #include "mutex.h"
+#include "thread.h"
+#include "list.h"
 #include "sancus_modules.h"
 #include "sancus_helpers.h"
 #include "sm_irq.h"
@@ -46,34 +49,121 @@
 
 static volatile SM_DATA(sancus_sm_timer) int _in_handler = 0;
 
+/*
+ * The time the counters start at. Tests set them close to a rollover, e.g.
+ * examples/secure_mintimer. SECURE_MINTIMER_HIGH_CNT_INIT must not have bits
+ * of the low-level timer set.
+ */
+#ifndef SECURE_MINTIMER_LONG_CNT_INIT
+#define SECURE_MINTIMER_LONG_CNT_INIT (0)
+#endif
+#ifndef SECURE_MINTIMER_HIGH_CNT_INIT
+#define SECURE_MINTIMER_HIGH_CNT_INIT (0)
+#endif
+
 // To be able to debug the timer, we have a debug flag on some protections
 #ifndef DEBUG_TIMER
-static SM_DATA(sancus_sm_timer) uint32_t _long_cnt = 0;
+static SM_DATA(sancus_sm_timer) uint32_t _long_cnt = SECURE_MINTIMER_LONG_CNT_INIT;
 #if SECURE_MINTIMER_MASK
-static SM_DATA(sancus_sm_timer) uint32_t _secure_mintimer_high_cnt = 0;
+static SM_DATA(sancus_sm_timer) uint32_t _secure_mintimer_high_cnt = SECURE_MINTIMER_HIGH_CNT_INIT & SECURE_MINTIMER_MASK;
 #endif
 #else
-uint32_t _long_cnt = 0;
-uint32_t _secure_mintimer_high_cnt = 0;
+uint32_t _long_cnt = SECURE_MINTIMER_LONG_CNT_INIT;
+uint32_t _secure_mintimer_high_cnt = SECURE_MINTIMER_HIGH_CNT_INIT & SECURE_MINTIMER_MASK;
 #endif
 
 static inline void SM_FUNC(sancus_sm_timer) secure_mintimer_spin_until(uint32_t value);
 
-#define SECURE_MINTIMER_TIMER_LIST_LENGTH 15
-static SM_DATA(sancus_sm_timer) secure_mintimer_t *overflow_list_head = NULL;
+/*
+ * With SECURE_MINTIMER_CALIBRATE, the backoffs are measured at boot and the
+ * configured values are only the initial guess.
+ */
+#ifdef SECURE_MINTIMER_CALIBRATE
+static SM_DATA(sancus_sm_timer) uint16_t _backoff = SECURE_MINTIMER_BACKOFF;
+static SM_DATA(sancus_sm_timer) uint16_t _isr_backoff = SECURE_MINTIMER_ISR_BACKOFF;
+/* ticks to arm the low-level timer for the next head, measured at boot */
+static SM_DATA(sancus_sm_timer) uint16_t _isr_arm_cost = 0;
+#define BACKOFF                 _backoff
+#define ISR_BACKOFF             _isr_backoff
+#else
+#define BACKOFF                 SECURE_MINTIMER_BACKOFF
+#define ISR_BACKOFF             SECURE_MINTIMER_ISR_BACKOFF
+#endif
+
+/*
+ * Timers are kept in timing wheels instead of one sorted list, so that
+ * removing a timer takes constant time and inserting one only walks the
+ * timers of its slot:
+ *
+ * - two short wheels, one for the current and one for the next (overflow)
+ *   period of the low-level timer. Every slot covers
+ *   2^WHEEL_SLOT_SHIFT ticks and holds a list sorted by fire time.
+ *   On a period change, the wheels swap roles.
+ * - the long wheel, one slot per upcoming period up to WHEEL_SLOTS periods
+ *   ahead. A slot is moved into the current wheel when its period starts.
+ * - the far list for everything beyond that, cascaded into the long wheel
+ *   every WHEEL_SLOTS periods.
+ *
+ * The bitmaps track non-empty slots, timer_list_head caches the first timer
+ * of the current wheel that the low-level timer is armed for.
+ *
+ * With SECURE_MINTIMER_DEFERRED, timers that are too close to arm the
+ * low-level timer for are kept on the near list instead, which is fired by
+ * its own compare channel.
+ */
+#if SECURE_MINTIMER_WHEEL_BITS > 4
+#error "SECURE_MINTIMER_WHEEL_BITS must be at most 4, slot maps are 16 bit wide"
+#endif
+#define WHEEL_SLOTS             (1 << SECURE_MINTIMER_WHEEL_BITS)
+#define WHEEL_SLOT_MASK         (WHEEL_SLOTS - 1)
+#define WHEEL_SLOT_SHIFT        (SECURE_MINTIMER_WIDTH - SECURE_MINTIMER_WHEEL_BITS)
+#define WHEEL_LONG              (2 * WHEEL_SLOTS)
+#define WHEEL_FAR               (3 * WHEEL_SLOTS)
+#ifdef SECURE_MINTIMER_DEFERRED
+#define WHEEL_NEAR              (WHEEL_FAR + 1)
+#define WHEEL_SLOT_COUNT        (WHEEL_NEAR + 1)
+#else
+#define WHEEL_SLOT_COUNT        (WHEEL_FAR + 1)
+#endif
+
+static SM_DATA(sancus_sm_timer) uint16_t _wheel_map[3];
+static SM_DATA(sancus_sm_timer) uint8_t _wheel_cur = 0;
 
 #ifndef DEBUG_TIMER
-static SM_DATA(sancus_sm_timer) secure_mintimer_t secure_mintimer_timer_list [SECURE_MINTIMER_TIMER_LIST_LENGTH];
+static SM_DATA(sancus_sm_timer) secure_mintimer_t secure_mintimer_pool [SECURE_MINTIMER_POOL_SIZE];
 static SM_DATA(sancus_sm_timer) secure_mintimer_t *timer_list_head = NULL;
-static SM_DATA(sancus_sm_timer) secure_mintimer_t *long_list_head = NULL;
+static SM_DATA(sancus_sm_timer) secure_mintimer_t *secure_mintimer_wheel[WHEEL_SLOT_COUNT];
 #else
-secure_mintimer_t secure_mintimer_timer_list [SECURE_MINTIMER_TIMER_LIST_LENGTH];
+secure_mintimer_t secure_mintimer_pool [SECURE_MINTIMER_POOL_SIZE];
 secure_mintimer_t *timer_list_head = NULL;
-secure_mintimer_t *long_list_head = NULL;
+secure_mintimer_t *secure_mintimer_wheel[WHEEL_SLOT_COUNT];
 #endif
 
-static void SM_FUNC(sancus_sm_timer) _add_timer_to_list(secure_mintimer_t **list_head, secure_mintimer_t *timer);
-static void SM_FUNC(sancus_sm_timer)_add_timer_to_long_list(secure_mintimer_t **list_head, secure_mintimer_t *timer);
+/*
+ * Timers of the pool that are not allocated are kept in a free list linked
+ * through timer->next. Every thread may hold up to SECURE_MINTIMER_THREAD_QUOTA
+ * timers, one of which is its wakeup timer for sleeps and periodic releases.
+ */
+static SM_DATA(sancus_sm_timer) secure_mintimer_t *_pool_free = NULL;
+static SM_DATA(sancus_sm_timer) uint8_t _pool_used[KERNEL_PID_LAST + 1];
+static SM_DATA(sancus_sm_timer) secure_mintimer_handle_t _wakeup_handle[KERNEL_PID_LAST + 1];
+
+/*
+ * The budget of the running periodic thread has its own compare channel. It
+ * is armed in the period its target falls into, and from _next_period() for
+ * targets further ahead.
+ */
+static SM_DATA(sancus_sm_timer) uint32_t _budget_target;
+static SM_DATA(sancus_sm_timer) uint32_t _budget_long_target;
+static SM_DATA(sancus_sm_timer) uint8_t _budget_armed = 0;
+
+static void SM_FUNC(sancus_sm_timer) _wheel_insert(secure_mintimer_t *timer);
+static secure_mintimer_t* SM_FUNC(sancus_sm_timer) _wheel_first(void);
+static inline uint32_t SM_FUNC(sancus_sm_timer) _fire_time(secure_mintimer_t *timer);
+static int32_t SM_FUNC(sancus_sm_timer) _period_distance(secure_mintimer_t *timer);
+static inline uint32_t SM_FUNC(sancus_sm_timer) _period_offset(uint32_t target);
+static inline uint32_t SM_FUNC(sancus_sm_timer) _target_offset(secure_mintimer_t *timer);
+static void SM_FUNC(sancus_sm_timer) _wheel_coalesce(uint32_t reference);
 static void SM_FUNC(sancus_sm_timer)_shoot_timer(secure_mintimer_t *timer);
 static void SM_FUNC(sancus_sm_timer)_remove(secure_mintimer_t *timer);
 static inline void SM_FUNC(sancus_sm_timer) _lltimer_set(uint32_t target);
@@ -81,26 +171,100 @@ static uint32_t SM_FUNC(sancus_sm_timer) _time_left(uint32_t target, uint32_t re
 
 static void SM_FUNC(sancus_sm_timer)_timer_callback(void);
 static void SM_FUNC(sancus_sm_timer) _periph_timer_callback(int chan);
-
-static inline int SM_FUNC(sancus_sm_timer)_this_high_period(uint32_t target);
+#ifdef SECURE_MINTIMER_DEFERRED
+static void SM_FUNC(sancus_sm_timer) _near_insert(secure_mintimer_t *timer);
+static void SM_FUNC(sancus_sm_timer) _near_arm(void);
+static void SM_FUNC(sancus_sm_timer) _near_callback(void);
+static uint32_t SM_FUNC(sancus_sm_timer) _near_left(secure_mintimer_t *timer, uint32_t now);
+#endif
+#ifdef SECURE_MINTIMER_CALIBRATE
+static void SM_FUNC(sancus_sm_timer) _calibrate(void);
+static inline void SM_FUNC(sancus_sm_timer) _calibrate_isr(void);
+#endif
+static void SM_FUNC(sancus_sm_timer) _budget_arm(void);
+static void SM_FUNC(sancus_sm_timer) _budget_callback(void);
 
 int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute(secure_mintimer_t *timer, uint32_t target);
 
-secure_mintimer_t* SM_FUNC(sancus_sm_timer) get_available_timer(kernel_pid_t pid){
-    if(pid<=SECURE_MINTIMER_TIMER_LIST_LENGTH){
-        secure_mintimer_t* current_timer = &secure_mintimer_timer_list[pid];
+secure_mintimer_handle_t SM_FUNC(sancus_sm_timer) secure_mintimer_handle(secure_mintimer_t *timer)
+{
+    return (secure_mintimer_handle_t)(timer - secure_mintimer_pool) + 1;
+}
+
+secure_mintimer_t* SM_FUNC(sancus_sm_timer) secure_mintimer_from_handle(secure_mintimer_handle_t handle)
+{
+    if (handle == SECURE_MINTIMER_HANDLE_NONE || handle > SECURE_MINTIMER_POOL_SIZE) {
+        return NULL;
+    }
+    return &secure_mintimer_pool[handle - 1];
+}
+
+secure_mintimer_t* SM_FUNC(sancus_sm_timer) secure_mintimer_alloc(thread_t *owner)
+{
+    secure_mintimer_t *timer = _pool_free;
+
+    if (timer == NULL || _pool_used[owner->pid] >= SECURE_MINTIMER_THREAD_QUOTA) {
+        SECMIN_DEBUG(sancus_debug1("timer_alloc(): no timer left for %" PRIkernel_pid, owner->pid));
+        return NULL;
+    }
+
+    _pool_free = timer->next;
+    _pool_used[owner->pid]++;
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->target = timer->long_target = 0;
+    timer->slack = 0;
+    timer->thread = owner;
+    timer->callback = NULL;
+    timer->arg = NULL;
+    return timer;
+}
+
+void SM_FUNC(sancus_sm_timer) secure_mintimer_free(secure_mintimer_t *timer)
+{
+    kernel_pid_t pid = timer->thread->pid;
+
+    _remove(timer);
+    timer->target = timer->long_target = 0;
+
+    if (_wakeup_handle[pid] == secure_mintimer_handle(timer)) {
+        _wakeup_handle[pid] = SECURE_MINTIMER_HANDLE_NONE;
+    }
+    _pool_used[pid]--;
+
+    timer->thread = NULL;
+    timer->next = _pool_free;
+    _pool_free = timer;
+}
 
-        // if(current_timer->target == 0 && current_timer->long_target == 0){
-        //     return current_timer;
-        // }
+void SM_FUNC(sancus_sm_timer) secure_mintimer_free_all(kernel_pid_t pid)
+{
+    thread_t *owner = &sched_threads[pid];
 
-        // Delete any pending timer and return this timer
-        secure_mintimer_remove(current_timer);
-        return current_timer;
+    for (unsigned i = 0; _pool_used[pid] && i < SECURE_MINTIMER_POOL_SIZE; i++) {
+        if (secure_mintimer_pool[i].thread == owner) {
+            secure_mintimer_free(&secure_mintimer_pool[i]);
+        }
     }
+}
 
+secure_mintimer_t* SM_FUNC(sancus_sm_timer) secure_mintimer_wakeup_timer(kernel_pid_t pid)
+{
+    secure_mintimer_t *timer = secure_mintimer_from_handle(_wakeup_handle[pid]);
 
-    return NULL;
+    if (timer == NULL) {
+        timer = secure_mintimer_alloc(&sched_threads[pid]);
+        if (timer != NULL) {
+            _wakeup_handle[pid] = secure_mintimer_handle(timer);
+        }
+    }
+    else {
+        // Delete any pending wakeup, the caller sets a new one
+        secure_mintimer_remove(timer);
+    }
+
+    return timer;
 }
 
 /**
@@ -137,11 +301,21 @@ static inline void SM_FUNC(sancus_sm_timer) secure_mintimer_spin_until(uint32_t
 
 void SM_FUNC(sancus_sm_timer) secure_mintimer_init(void)
 {
+    /* put all timers of the pool on the free list */
+    for (unsigned i = 0; i < SECURE_MINTIMER_POOL_SIZE; i++) {
+        secure_mintimer_pool[i].next = _pool_free;
+        _pool_free = &secure_mintimer_pool[i];
+    }
+
     /* initialize low-level timer */
     sm_timer_init(SECURE_MINTIMER_DEV, SECURE_MINTIMER_HZ, _periph_timer_callback);
 
     /* register initial overflow tick */
     _lltimer_set(0xFFFFFFFF);
+
+#ifdef SECURE_MINTIMER_CALIBRATE
+    _calibrate();
+#endif
 }
 
 uint32_t SM_ENTRY(sancus_sm_timer) _secure_mintimer_now(void)
@@ -221,32 +395,41 @@ void SM_FUNC(sancus_sm_timer) _secure_mintimer_set(secure_mintimer_t *timer, uin
     // }
 }
 
-// void SM_FUNC(sancus_sm_timer) _secure_mintimer_set64(secure_mintimer_t *timer, uint32_t offset, uint32_t long_offset)
-// {
-//     SECMIN_DEBUG(sancus_debug2(" _secure_mintimer_set64() offset=%" PRIu32 " long_offset=%" PRIu32 " ", offset, long_offset));
-//     if (!long_offset) {
-//         /* timer fits into the short timer */
-//         _secure_mintimer_set(timer, (uint32_t)offset);
-//     }
-//     else {
-//         // int state = sm_irq_disable();
-//         if (_is_set(timer)) {
-//             _remove(timer);
-//         }
-
-//         _secure_mintimer_now_internal(&timer->target, &timer->long_target);
-//         timer->target += offset;
-//         timer->long_target += long_offset;
-//         if (timer->target < offset) {
-//             timer->long_target++;
-//         }
-
-//         _add_timer_to_long_list(&long_list_head, timer);
-//         // sm_irq_restore(state);
-//         SECMIN_DEBUG(sancus_debug2("secure_mintimer_set64(): added longterm timer (long_target=%" PRIu32 " target=%" PRIu32 ")\n",
-//               timer->long_target, timer->target));
-//     }
-// }
+/*
+ * Timers are placed by their period of the low-level timer, and the distance
+ * to a period has to fit an int32_t. This limits the long offset to
+ * 2^(31 + SECURE_MINTIMER_WIDTH) ticks, about 4.4 years at 1 MHz.
+ */
+#define LONG_OFFSET_MAX         ((1ul << (SECURE_MINTIMER_WIDTH - 1)) - 1)
+
+void SM_FUNC(sancus_sm_timer) _secure_mintimer_set64(secure_mintimer_t *timer, uint32_t offset, uint32_t long_offset)
+{
+    SECMIN_DEBUG(sancus_debug2(" _secure_mintimer_set64() offset=%" PRIu32 " long_offset=%" PRIu32 " ", offset, long_offset));
+    if (!long_offset) {
+        /* timer fits into the short timer */
+        _secure_mintimer_set(timer, (uint32_t)offset);
+    }
+    else {
+        if (long_offset > LONG_OFFSET_MAX) {
+            long_offset = LONG_OFFSET_MAX;
+        }
+
+        secure_mintimer_remove(timer);
+
+        _secure_mintimer_now_internal(&timer->target, &timer->long_target);
+        timer->target += offset;
+        timer->long_target += long_offset;
+        if (timer->target < offset) {
+            timer->long_target++;
+        }
+
+        /* at least 2^32 ticks ahead, so this never ends up in the current
+         * wheel and the low-level timer stays as it is */
+        _wheel_insert(timer);
+        SECMIN_DEBUG(sancus_debug2("secure_mintimer_set64(): added longterm timer (long_target=%" PRIu32 " target=%" PRIu32 ")\n",
+              timer->long_target, timer->target));
+    }
+}
 
 int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute_explicit(secure_mintimer_t *timer, uint32_t now){
     int res = 0;
@@ -256,34 +439,48 @@ int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute_explicit(secure_minti
      * Backoff condition above ensures that 'target - SECURE_MINTIMER_OVERHEAD` is later
      * than 'now', also for values when now will overflow and the value of target
      * is smaller then now.
-     * If `target < SECURE_MINTIMER_OVERHEAD` the new target will be at the end of this
-     * 32bit period, as `target - SECURE_MINTIMER_OVERHEAD` is a big number instead of a
-     * small at the beginning of the next period. */
-    target = target - SECURE_MINTIMER_OVERHEAD;
+     * If `target < SECURE_MINTIMER_OVERHEAD` the new target will be at the end of the
+     * previous 32bit period, which _period_distance() accounts for. */
+    target = _fire_time(timer);
 
     /* 32 bit target overflow, target is in next 32bit period */
-    if (target < now) {
+    if (timer->target < now) {
         timer->long_target++;
     }
 
-    if ((timer->long_target > _long_cnt) || !_this_high_period(target)) {
-        SECMIN_DEBUG(sancus_debug3("Timer set is long target %lu long count %lu and this high period %d", timer->long_target , _long_cnt,!_this_high_period(target) ));
-        SECMIN_DEBUG(sancus_debug("secure_mintimer_set_absolute(): the timer doesn't fit into the low-level timer's mask."));
-        _add_timer_to_long_list(&long_list_head, timer);
-    }
-    else {
-        if (_secure_mintimer_lltimer_mask(now) >= target) {
-            SECMIN_DEBUG(sancus_debug("secure_mintimer_set_absolute(): the timer will expire in the next timer period"));
-            _add_timer_to_list(&overflow_list_head, timer);
+    /* the timer may still be armed, e.g. the scheduler timer of a periodic
+     * thread that got interrupted */
+    _remove(timer);
+
+    int32_t distance = _period_distance(timer);
+    if (distance < 0
+        || (distance == 0 && _secure_mintimer_lltimer_mask(target) <= _secure_mintimer_lltimer_now())) {
+        /* the low-level timer can not be armed for a time that already passed,
+         * back off like _secure_mintimer_set_absolute() does */
+        SECMIN_DEBUG(sancus_debug("secure_mintimer_set_absolute(): target already passed."));
+        if (distance == 0 && (int32_t)(timer->target - now) > 0) {
+#ifdef SECURE_MINTIMER_DEFERRED
+            _near_insert(timer);
+            return res;
+#else
+            secure_mintimer_spin_until(timer->target);
+#endif
         }
-        else {
-            SECMIN_DEBUG(sancus_debug("timer_set_absolute(): timer will expire in this timer period."));
-            _add_timer_to_list(&timer_list_head, timer);
+        timer->target = 0;
+        timer->long_target = 0;
+        _shoot_timer(timer);
+        return res;
+    }
 
-            if (timer_list_head == timer) {
-                SECMIN_DEBUG(sancus_debug("timer_set_absolute(): timer is new list head. updating lltimer."));
-                _lltimer_set(target);
-            }
+    _wheel_insert(timer);
+
+    if (timer->slot < WHEEL_LONG && (timer->slot >> SECURE_MINTIMER_WHEEL_BITS) == _wheel_cur) {
+        SECMIN_DEBUG(sancus_debug("timer_set_absolute(): timer will expire in this timer period."));
+        if (!timer_list_head
+            || _secure_mintimer_lltimer_mask(target) < _secure_mintimer_lltimer_mask(_fire_time(timer_list_head))) {
+            SECMIN_DEBUG(sancus_debug("timer_set_absolute(): timer is new list head. updating lltimer."));
+            timer_list_head = timer;
+            _lltimer_set(target);
         }
     }
 
@@ -296,8 +493,6 @@ int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute(secure_mintimer_t *ti
 {
     uint32_t now = _secure_mintimer_now();
 
-    timer->next = NULL;
-
     /* Ensure that offset is bigger than 'SECURE_MINTIMER_BACKOFF',
      * 'target - now' will allways be the offset no matter if target < or > now.
      *
@@ -314,10 +509,17 @@ int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute(secure_mintimer_t *ti
     SECMIN_DEBUG(sancus_debug3("timer_set_absolute(): now=%lu target=%lu offset=%lu ",
           now, target, offset));
 
-    if (offset <= SECURE_MINTIMER_BACKOFF) {
+    if (offset <= BACKOFF) {
         /* backoff */
+#ifdef SECURE_MINTIMER_DEFERRED
+        _remove(timer);
+        timer->target = target;
+        timer->long_target = _long_cnt + (target < now);
+        _near_insert(timer);
+#else
         secure_mintimer_spin_until(target);
         _shoot_timer(timer);
+#endif
         return 0;
     }
 
@@ -335,7 +537,23 @@ int SM_FUNC(sancus_sm_timer) _secure_mintimer_set_absolute(secure_mintimer_t *ti
 
 static void SM_FUNC(sancus_sm_timer)_periph_timer_callback(int chan)
 {
+#ifdef SECURE_MINTIMER_CALIBRATE
+    if (chan == SECURE_MINTIMER_CHAN) {
+        _calibrate_isr();
+    }
+#endif
+    if (chan == SECURE_MINTIMER_BUDGET_CHAN) {
+        _budget_callback();
+        return;
+    }
+#ifdef SECURE_MINTIMER_DEFERRED
+    if (chan == SECURE_MINTIMER_NEAR_CHAN) {
+        _near_callback();
+        return;
+    }
+#else
     (void)chan;
+#endif
     _timer_callback();
 }
 
@@ -344,8 +562,15 @@ static void SM_FUNC(sancus_sm_timer)_periph_timer_callback(int chan)
  * */
 static void SM_FUNC(sancus_sm_timer) _shoot_timer(secure_mintimer_t *timer)
 {
-    // To shoot a timer, we just allow the thread to be scheduled again, aka "wake" it up
-    if(timer->thread != NULL) sched_set_status(timer->thread, STATUS_PENDING);
+#ifdef SCHED_TRACE
+    sched_trace(SCHED_TRACE_TIMER, timer->thread ? timer->thread->pid : KERNEL_PID_UNDEF, 0);
+#endif
+    // To shoot a timer, we either run its callback or just allow the thread
+    // to be scheduled again, aka "wake" it up
+    if (timer->callback != NULL) {
+        timer->callback(timer->arg);
+    }
+    else if(timer->thread != NULL) sched_set_status(timer->thread, STATUS_PENDING);
     
     // Since a timer triggered, we should run the scheduler.
     sched_context_switch_request = 1;
@@ -361,62 +586,302 @@ static inline void SM_FUNC(sancus_sm_timer) _lltimer_set(uint32_t target)
 }
 
 
-static void SM_FUNC(sancus_sm_timer) _add_timer_to_list(secure_mintimer_t **list_head, secure_mintimer_t *timer)
+/**
+ * @brief the time the low-level timer has to fire at for this timer
+ *
+ * This is the latest time the timer may fire, timers are placed and the
+ * low-level timer is armed by it.
+ */
+static inline uint32_t SM_FUNC(sancus_sm_timer) _fire_time(secure_mintimer_t *timer)
+{
+    return timer->target + timer->slack - SECURE_MINTIMER_OVERHEAD;
+}
+
+/**
+ * @brief index of the low-level timer period a timestamp falls into
+ */
+static inline uint32_t SM_FUNC(sancus_sm_timer) _period_of(uint32_t target, uint32_t long_target)
 {
-    while (*list_head && (*list_head)->target <= timer->target) {
-        list_head = &((*list_head)->next);
+#if SECURE_MINTIMER_MASK
+    return (long_target << (32 - SECURE_MINTIMER_WIDTH)) | (target >> SECURE_MINTIMER_WIDTH);
+#else
+    (void)target;
+    return long_target;
+#endif
+}
+
+static inline uint32_t SM_FUNC(sancus_sm_timer) _current_period(void)
+{
+#if SECURE_MINTIMER_MASK
+    return _period_of(_secure_mintimer_high_cnt, _long_cnt);
+#else
+    return _long_cnt;
+#endif
+}
+
+/**
+ * @brief target relative to the start of the current period
+ *
+ * Unlike masking, this keeps targets that lie past the end of the period
+ * (the timer is placed by its target minus SECURE_MINTIMER_OVERHEAD) later
+ * than everything in it.
+ */
+static inline uint32_t SM_FUNC(sancus_sm_timer) _period_offset(uint32_t target)
+{
+#if SECURE_MINTIMER_MASK
+    return target - _secure_mintimer_high_cnt;
+#else
+    return target;
+#endif
+}
+
+/**
+ * @brief target relative to the start of the current period, 0 if it lies
+ *        before it
+ *
+ * With slack, a timer of the current wheel may have its target in the
+ * previous period.
+ */
+static inline uint32_t SM_FUNC(sancus_sm_timer) _target_offset(secure_mintimer_t *timer)
+{
+    uint32_t offset = _period_offset(timer->target);
+#if SECURE_MINTIMER_MASK
+    if ((int32_t)offset < 0) {
+        return 0;
+    }
+#endif
+    return offset;
+}
+
+/**
+ * @brief number of low-level timer periods until the timer has to fire,
+ *        negative if it is already late
+ */
+static int32_t SM_FUNC(sancus_sm_timer) _period_distance(secure_mintimer_t *timer)
+{
+    uint32_t late = timer->target + timer->slack;
+    uint32_t fire = late - SECURE_MINTIMER_OVERHEAD;
+    /* adding the slack may carry into and subtracting the overhead may
+     * borrow from the upper 32 bit */
+    uint32_t fire_long = timer->long_target + (late < timer->target) - (fire > late);
+
+    return (int32_t)(_period_of(fire, fire_long) - _current_period());
+}
+
+/**
+ * @brief index of the lowest non-empty slot in a slot map, map must not be 0
+ */
+static inline unsigned SM_FUNC(sancus_sm_timer) _wheel_lowest_slot(uint16_t map)
+{
+    unsigned idx = 0;
+
+    if (!(map & 0x00FF)) { map >>= 8; idx += 8; }
+    if (!(map & 0x000F)) { map >>= 4; idx += 4; }
+    if (!(map & 0x0003)) { map >>= 2; idx += 2; }
+    if (!(map & 0x0001)) { idx += 1; }
+
+    return idx;
+}
+
+static void SM_FUNC(sancus_sm_timer) _wheel_link(secure_mintimer_t *timer, uint8_t slot)
+{
+    secure_mintimer_t **head = &secure_mintimer_wheel[slot];
+
+    /* short wheel slots are kept sorted, so their first timer is the head */
+    if (slot < WHEEL_LONG) {
+        uint32_t fire = _secure_mintimer_lltimer_mask(_fire_time(timer));
+        while (*head && _secure_mintimer_lltimer_mask(_fire_time(*head)) <= fire) {
+            head = &(*head)->next;
+        }
+    }
+
+    timer->slot = slot;
+    timer->next = *head;
+    timer->pprev = head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+
+    if (slot < WHEEL_FAR) {
+        _wheel_map[slot >> SECURE_MINTIMER_WHEEL_BITS] |= 1 << (slot & WHEEL_SLOT_MASK);
     }
+}
+
+static void SM_FUNC(sancus_sm_timer) _wheel_unlink(secure_mintimer_t *timer)
+{
+    uint8_t slot = timer->slot;
 
-    timer->next = *list_head;
-    *list_head = timer;
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+
+    if (slot < WHEEL_FAR && !secure_mintimer_wheel[slot]) {
+        _wheel_map[slot >> SECURE_MINTIMER_WHEEL_BITS] &= ~(1 << (slot & WHEEL_SLOT_MASK));
+    }
+}
+
+/**
+ * @brief put a timer into the wheel slot matching its target
+ *
+ * Bounded by the number of timers sharing a short wheel slot, O(1) for the
+ * long wheel and the far list.
+ */
+static void SM_FUNC(sancus_sm_timer) _wheel_insert(secure_mintimer_t *timer)
+{
+    int32_t distance = _period_distance(timer);
+    uint32_t fire = _fire_time(timer);
+
+    if (distance <= 1) {
+        /* current or overflow wheel, slot by the low-level timer value */
+        uint8_t wheel = _wheel_cur ^ (distance == 1);
+        _wheel_link(timer, (wheel << SECURE_MINTIMER_WHEEL_BITS)
+                    + (_secure_mintimer_lltimer_mask(fire) >> WHEEL_SLOT_SHIFT));
+    }
+    else if (distance <= WHEEL_SLOTS) {
+        _wheel_link(timer, WHEEL_LONG + ((_current_period() + distance) & WHEEL_SLOT_MASK));
+    }
+    else {
+        _wheel_link(timer, WHEEL_FAR);
+    }
 }
 
-static void SM_FUNC(sancus_sm_timer) _add_timer_to_long_list(secure_mintimer_t **list_head, secure_mintimer_t *timer)
+/**
+ * @brief find the first timer of a short wheel, the head of its lowest
+ *        non-empty slot
+ */
+static secure_mintimer_t* SM_FUNC(sancus_sm_timer) _wheel_first_of(uint8_t wheel)
 {
-    while (*list_head
-           && (((*list_head)->long_target < timer->long_target)
-           || (((*list_head)->long_target == timer->long_target) && ((*list_head)->target <= timer->target)))) {
-        list_head = &((*list_head)->next);
+    uint16_t map = _wheel_map[wheel];
+
+    if (!map) {
+        return NULL;
     }
 
-    timer->next = *list_head;
-    *list_head = timer;
+    return secure_mintimer_wheel[(wheel << SECURE_MINTIMER_WHEEL_BITS) + _wheel_lowest_slot(map)];
 }
 
-static int SM_FUNC(sancus_sm_timer) _remove_timer_from_list(secure_mintimer_t **list_head, secure_mintimer_t *timer)
+/**
+ * @brief find the first timer of the current wheel
+ */
+static secure_mintimer_t* SM_FUNC(sancus_sm_timer) _wheel_first(void)
 {
-    while (*list_head) {
-        if (*list_head == timer) {
-            *list_head = timer->next;
-            return 1;
+    return _wheel_first_of(_wheel_cur);
+}
+
+/**
+ * @brief ticks until the next timer of the wheels has to fire
+ */
+static uint32_t SM_FUNC(sancus_sm_timer) _wheel_next_distance(void)
+{
+    uint32_t now = _secure_mintimer_lltimer_now();
+    secure_mintimer_t *timer;
+    int32_t periods;
+
+    if (timer_list_head) {
+        uint32_t fire = _period_offset(_fire_time(timer_list_head));
+        return (fire > now) ? fire - now : 0;
+    }
+
+    /* ticks until the next period starts */
+    uint32_t left = _secure_mintimer_lltimer_mask(0xFFFFFFFF) - now + 1;
+
+    /* timers of the next period are in the overflow wheel, or still in the
+     * long wheel if they were set further ahead. The long wheel slot of a
+     * period is (period & WHEEL_SLOT_MASK). */
+    uint32_t period = _current_period();
+    secure_mintimer_t *first = _wheel_first_of(_wheel_cur ^ 1);
+    for (timer = secure_mintimer_wheel[WHEEL_LONG + ((period + 1) & WHEEL_SLOT_MASK)]; timer; timer = timer->next) {
+        if (!first || _secure_mintimer_lltimer_mask(_fire_time(timer)) < _secure_mintimer_lltimer_mask(_fire_time(first))) {
+            first = timer;
         }
-        list_head = &((*list_head)->next);
+    }
+    if (first) {
+        return left + _secure_mintimer_lltimer_mask(_fire_time(first));
     }
 
-    return 0;
+    /* further ahead only the period is looked up */
+    periods = INT32_MAX;
+    if (_wheel_map[2]) {
+        for (periods = 2; !(_wheel_map[2] & (1 << ((period + periods) & WHEEL_SLOT_MASK))); periods++) {}
+    }
+    /* far timers are only cascaded once per turn of the long wheel and may
+     * be closer by now */
+    for (timer = secure_mintimer_wheel[WHEEL_FAR]; timer; timer = timer->next) {
+        int32_t distance = _period_distance(timer);
+        if (distance < periods) {
+            periods = distance;
+        }
+    }
+
+    if (periods == INT32_MAX) {
+        /* nothing is armed */
+        return UINT32_MAX;
+    }
+    if (periods <= 1) {
+        return left;
+    }
+#if SECURE_MINTIMER_MASK
+    if ((uint32_t)(periods - 1) <= (UINT32_MAX >> SECURE_MINTIMER_WIDTH)) {
+        uint32_t ahead = (uint32_t)(periods - 1) << SECURE_MINTIMER_WIDTH;
+        if (ahead < UINT32_MAX - left) {
+            return left + ahead;
+        }
+    }
+#endif
+    /* saturate, but stay below the value for no timer at all */
+    return UINT32_MAX - 1;
+}
+
+uint32_t SM_FUNC(sancus_sm_timer) secure_mintimer_next_distance(void)
+{
+    uint32_t distance = _wheel_next_distance();
+
+#ifdef SECURE_MINTIMER_DEFERRED
+    uint32_t now = _secure_mintimer_lltimer_now();
+    for (secure_mintimer_t *timer = secure_mintimer_wheel[WHEEL_NEAR]; timer; timer = timer->next) {
+        uint32_t left = _near_left(timer, now);
+        if (left < distance) {
+            distance = left;
+        }
+    }
+#endif
+
+    return distance;
 }
 
 static void SM_FUNC(sancus_sm_timer) _remove(secure_mintimer_t *timer)
 {
+    if (!timer->pprev) {
+        /* not armed */
+        return;
+    }
+
+#ifdef SECURE_MINTIMER_DEFERRED
+    if (timer->slot == WHEEL_NEAR) {
+        _wheel_unlink(timer);
+        _near_arm();
+        return;
+    }
+#endif
+
+    _wheel_unlink(timer);
+
     if (timer_list_head == timer) {
         uint32_t next;
-        timer_list_head = timer->next;
+        timer_list_head = _wheel_first();
         if (timer_list_head) {
             /* schedule callback on next timer target time */
-            next = timer_list_head->target - SECURE_MINTIMER_OVERHEAD;
+            next = _fire_time(timer_list_head);
         }
         else {
             next = _secure_mintimer_lltimer_mask(0xFFFFFFFF);
         }
         _lltimer_set(next);
     }
-    else {
-        if (!_remove_timer_from_list(&timer_list_head, timer)) {
-            if (!_remove_timer_from_list(&overflow_list_head, timer)) {
-                _remove_timer_from_list(&long_list_head, timer);
-            }
-        }
-    }
 }
 
 void SM_FUNC(sancus_sm_timer) secure_mintimer_remove(secure_mintimer_t *timer)
@@ -448,107 +913,203 @@ static uint32_t SM_FUNC(sancus_sm_timer) _time_left(uint32_t target, uint32_t re
     }
 }
 
-static inline int SM_FUNC(sancus_sm_timer) _this_high_period(uint32_t target)
+#ifdef SECURE_MINTIMER_DEFERRED
+/**
+ * @brief ticks until a near timer expires, 0 if it already did
+ *
+ * Near timers are less than a backoff ahead, so the distance on the
+ * low-level timer is enough to tell.
+ */
+static uint32_t SM_FUNC(sancus_sm_timer) _near_left(secure_mintimer_t *timer, uint32_t now)
 {
-#if SECURE_MINTIMER_MASK
-    // LOG_ERROR("Target is %ul while mask is %ul. The combined is %ul and is compared to %ul\n", target, SECURE_MINTIMER_MASK, target & SECURE_MINTIMER_MASK, _secure_mintimer_high_cnt);
+    uint32_t left = _secure_mintimer_lltimer_mask(timer->target - now);
 
-    return (target & SECURE_MINTIMER_MASK) == _secure_mintimer_high_cnt;
-#else
-    (void)target;
-    return 1;
-#endif
+    if (left > (_secure_mintimer_lltimer_mask(0xFFFFFFFF) >> 1)) {
+        return 0;
+    }
+    return left;
 }
 
 /**
- * @brief compare two timers' target values, return the one with lower value.
- *
- * if either is NULL, return the other.
- * if both are NULL, return NULL.
+ * @brief arm the near-term channel for the first timer of the near list
  */
-static inline secure_mintimer_t* SM_FUNC(sancus_sm_timer) _compare(secure_mintimer_t *a, secure_mintimer_t *b)
+static void SM_FUNC(sancus_sm_timer) _near_arm(void)
 {
-    if (a && b) {
-        return ((a->target <= b->target) ? a : b);
+    uint32_t now = _secure_mintimer_lltimer_now();
+    secure_mintimer_t *first = NULL;
+    uint32_t first_left = 0;
+
+    for (secure_mintimer_t *timer = secure_mintimer_wheel[WHEEL_NEAR]; timer; timer = timer->next) {
+        uint32_t left = _near_left(timer, now);
+        if (!first || left < first_left) {
+            first = timer;
+            first_left = left;
+        }
     }
-    else {
-        return (a ? a : b);
+
+    if (!first) {
+        sm_timer_clear(SECURE_MINTIMER_NEAR_CHAN);
+        return;
+    }
+
+    sm_timer_set_absolute(SECURE_MINTIMER_NEAR_CHAN, _secure_mintimer_lltimer_mask(first->target));
+    /* the channel only matches if the counter has yet to reach the target */
+    if (!_near_left(first, _secure_mintimer_lltimer_now())) {
+        sm_timer_set_pending(SECURE_MINTIMER_NEAR_CHAN);
     }
 }
 
 /**
- * @brief merge two timer lists, return head of new list
+ * @brief fire a timer from the near-term channel instead of spinning for it
  */
-static secure_mintimer_t* SM_FUNC(sancus_sm_timer) _merge_lists(secure_mintimer_t *head_a, secure_mintimer_t *head_b)
+static void SM_FUNC(sancus_sm_timer) _near_insert(secure_mintimer_t *timer)
 {
-    secure_mintimer_t *result_head = _compare(head_a, head_b);
-    secure_mintimer_t *pos = result_head;
+    _wheel_link(timer, WHEEL_NEAR);
+    _near_arm();
+}
 
-    while (1) {
-        head_a = head_a->next;
-        head_b = head_b->next;
-        if (!head_a) {
-            pos->next = head_b;
-            break;
-        }
-        if (!head_b) {
-            pos->next = head_a;
-            break;
+/**
+ * @brief near-term channel callback, fires the near timers that expired
+ */
+static void SM_FUNC(sancus_sm_timer) _near_callback(void)
+{
+    secure_mintimer_t *timer = secure_mintimer_wheel[WHEEL_NEAR];
+
+    while (timer) {
+        if (_near_left(timer, _secure_mintimer_lltimer_now())) {
+            timer = timer->next;
+            continue;
         }
 
-        pos->next = _compare(head_a, head_b);
-        pos = pos->next;
+        _wheel_unlink(timer);
+        timer->target = 0;
+        timer->long_target = 0;
+        _shoot_timer(timer);
+
+        /* the callback may have changed the list, so start over */
+        timer = secure_mintimer_wheel[WHEEL_NEAR];
     }
 
-    return result_head;
+    _near_arm();
 }
+#endif
 
 /**
- * @brief parse long timers list and copy those that will expire in the current
- *        short timer period
- */
-static void SM_FUNC(sancus_sm_timer) _select_long_timers(void)
-{
-    secure_mintimer_t *select_list_start = long_list_head;
-    secure_mintimer_t *select_list_last = NULL;
-
-    /* advance long_list head so it points to the first timer of the next (not
-     * just started) "long timer period" */
-    // SECMIN_DEBUG(sancus_debug1("Current long_cnt: %lu\n", _long_cnt));
-    while (long_list_head) {
-        // SECMIN_DEBUG(sancus_debug2("Stuff in long list: target: %lu ;long target: %lu\n", long_list_head->target, long_list_head->long_target));
-        if ((long_list_head->long_target <= _long_cnt) && _this_high_period(long_list_head->target)) {
-            select_list_last = long_list_head;
-            long_list_head = long_list_head->next;
-        }
-        else {
-            /* remaining long_list timers belong to later long periods */
-            break;
-        }
+ * @brief arm the budget channel if the budget ends in the current period
+ */
+static void SM_FUNC(sancus_sm_timer) _budget_arm(void)
+{
+    int32_t distance = (int32_t)(_period_of(_budget_target, _budget_long_target) - _current_period());
+
+    if (distance > 0) {
+        sm_timer_clear(SECURE_MINTIMER_BUDGET_CHAN);
+        return;
     }
 
-    /* cut the "selected long timer list" at the end */
-    if (select_list_last) {
-        select_list_last->next = NULL;
+    sm_timer_set_absolute(SECURE_MINTIMER_BUDGET_CHAN, _secure_mintimer_lltimer_mask(_budget_target));
+    /* the channel only matches if the counter has yet to reach the target */
+    if (distance < 0
+        || _secure_mintimer_lltimer_mask(_budget_target) <= _secure_mintimer_lltimer_now()) {
+        sm_timer_set_pending(SECURE_MINTIMER_BUDGET_CHAN);
     }
+}
 
-    /* merge "current timer list" and "selected long timer list" */
-    if (timer_list_head) {
-        if (select_list_last) {
-            /* both lists are non-empty. merge. */
-            timer_list_head = _merge_lists(timer_list_head, select_list_start);
-        }
-        else {
-            /* "selected long timer list" is empty, nothing to do */
+void SM_FUNC(sancus_sm_timer) secure_mintimer_budget_set(uint32_t target, uint32_t long_target)
+{
+    _budget_target = target;
+    _budget_long_target = long_target;
+    _budget_armed = 1;
+    _budget_arm();
+}
+
+void SM_FUNC(sancus_sm_timer) secure_mintimer_budget_clear(void)
+{
+    _budget_armed = 0;
+    sm_timer_clear(SECURE_MINTIMER_BUDGET_CHAN);
+}
+
+/**
+ * @brief budget channel callback, lets the scheduler check the budget
+ */
+static void SM_FUNC(sancus_sm_timer) _budget_callback(void)
+{
+    if (!_budget_armed) {
+        return;
+    }
+
+    if ((int32_t)(_period_of(_budget_target, _budget_long_target) - _current_period()) > 0) {
+        /* matched in an earlier period, wait for the right one */
+        _budget_arm();
+        return;
+    }
+
+    secure_mintimer_budget_clear();
+#ifdef SCHED_TRACE
+    sched_trace(SCHED_TRACE_BUDGET, sched_active_pid, 0);
+#endif
+    sched_context_switch_request = 1;
+}
+
+/**
+ * @brief move all timers of a slot back through _wheel_insert()
+ *
+ * With @p period_limit set, only timers at most that many periods ahead are
+ * moved, the others stay where they are.
+ */
+static void SM_FUNC(sancus_sm_timer) _wheel_cascade(uint8_t slot, int32_t period_limit)
+{
+    secure_mintimer_t *timer = secure_mintimer_wheel[slot];
+
+    while (timer) {
+        secure_mintimer_t *next = timer->next;
+        if (!period_limit || _period_distance(timer) <= period_limit) {
+            _wheel_unlink(timer);
+            _wheel_insert(timer);
         }
+        timer = next;
     }
-    else { /* current timer list is empty */
-        if (select_list_last) {
-            /* there's no current timer list, but a non-empty "selected long
-             * timer list".  So just use that list as the new current timer
-             * list.*/
-            timer_list_head = select_list_start;
+}
+
+/**
+ * @brief fire the timers of the current wheel whose target already passed
+ *
+ * Timers are placed by the latest time they may fire, so a timer with slack
+ * can be due while others are still ahead of it. Only the slots up to
+ * SECURE_MINTIMER_MAX_SLACK ahead of now can hold such timers.
+ */
+static void SM_FUNC(sancus_sm_timer) _wheel_coalesce(uint32_t reference)
+{
+    uint32_t now = _secure_mintimer_lltimer_now();
+    uint32_t last = (now + SECURE_MINTIMER_MAX_SLACK) >> WHEEL_SLOT_SHIFT;
+    uint32_t map = _wheel_map[_wheel_cur];
+
+    if (now < reference) {
+        /* overflowed, the caller moves on to the next period */
+        return;
+    }
+    if (last < WHEEL_SLOT_MASK) {
+        map &= (2ul << last) - 1;
+    }
+
+    while (map) {
+        unsigned idx = _wheel_lowest_slot(map);
+        secure_mintimer_t *timer = secure_mintimer_wheel[(_wheel_cur << SECURE_MINTIMER_WHEEL_BITS) + idx];
+
+        while (timer && _target_offset(timer) > now) {
+            timer = timer->next;
         }
+        if (!timer) {
+            map &= ~(1ul << idx);
+            continue;
+        }
+
+        /* firing may change the slot, so search it again afterwards */
+        _wheel_unlink(timer);
+        timer_list_head = _wheel_first();
+        timer->target = 0;
+        timer->long_target = 0;
+        _shoot_timer(timer);
+        map &= _wheel_map[_wheel_cur] | ~(1ul << idx);
     }
 }
 
@@ -573,11 +1134,33 @@ static void SM_FUNC(sancus_sm_timer) _next_period(void)
         _long_cnt++;
     #endif
 
-        /* swap overflow list to current timer list */
-        timer_list_head = overflow_list_head;
-        overflow_list_head = NULL;
+        /* timers left in the current wheel belong to the period that just
+         * ended and are overdue, release them now */
+        while (timer_list_head) {
+            secure_mintimer_t *timer = timer_list_head;
+            _wheel_unlink(timer);
+            timer->target = 0;
+            timer->long_target = 0;
+            _shoot_timer(timer);
+            timer_list_head = _wheel_first();
+        }
+
+        /* swap overflow wheel to current wheel */
+        _wheel_cur ^= 1;
+
+        /* move in the long timers of this period and, once per turn of the
+         * long wheel, the far timers that now fit into it */
+        uint32_t period = _current_period();
+        _wheel_cascade(WHEEL_LONG + (period & WHEEL_SLOT_MASK), 0);
+        if (!(period & WHEEL_SLOT_MASK)) {
+            _wheel_cascade(WHEEL_FAR, WHEEL_SLOTS);
+        }
+
+        timer_list_head = _wheel_first();
 
-        _select_long_timers();
+        if (_budget_armed) {
+            _budget_arm();
+        }
 }
 
 void SM_FUNC(sancus_sm_timer) secure_mintimer_timer_callback(void){
@@ -619,19 +1202,37 @@ static void SM_FUNC(sancus_sm_timer) _timer_callback(void)
          */
         /* set our period reference to the current time. */
         reference = _secure_mintimer_lltimer_now();
+
+        if (TIMER_BASE->CTL & TIMER_CTL_IFG) {
+            /* the low-level timer overflowed before the timers of this
+             * period were handled (e.g. when the head lies right at the end
+             * of the period), so the remaining ones are overdue. */
+            _next_period();
+
+            reference = 0;
+        }
     }
 
 overflow:
     /* check if next timers are close to expiring */
-    while (timer_list_head && (_time_left(_secure_mintimer_lltimer_mask(timer_list_head->target), reference) < SECURE_MINTIMER_ISR_BACKOFF)) {
-        /* make sure we don't fire too early. With Sancus we never fire too early */
-        while (_time_left(_secure_mintimer_lltimer_mask(timer_list_head->target), reference)) {}
-
+    while (timer_list_head && (_time_left(_target_offset(timer_list_head), reference) < ISR_BACKOFF)) {
         /* pick first timer in list */
         secure_mintimer_t *timer = timer_list_head;
 
         /* advance list */
-        timer_list_head = timer->next;
+        _wheel_unlink(timer);
+        timer_list_head = _wheel_first();
+
+        /* make sure we don't fire too early. With Sancus we never fire too early */
+#ifdef SECURE_MINTIMER_DEFERRED
+        if (_time_left(_target_offset(timer), reference)) {
+            /* let the near-term channel fire it instead of spinning */
+            _near_insert(timer);
+            continue;
+        }
+#else
+        while (_time_left(_target_offset(timer), reference)) {}
+#endif
 
         /* make sure timer is recognized as being already fired */
         timer->target = 0;
@@ -640,12 +1241,15 @@ overflow:
         _shoot_timer(timer);
     }
 
+    /* take along the timers with slack that are due already */
+    _wheel_coalesce(reference);
+
     /* possibly executing all callbacks took enough
      * time to overflow.  In that case we advance to
      * next timer period and check again for expired
      * timers.*/
     /* check if the end of this period is very soon */
-    uint32_t now = _secure_mintimer_lltimer_now() + SECURE_MINTIMER_ISR_BACKOFF;
+    uint32_t now = _secure_mintimer_lltimer_now() + ISR_BACKOFF;
     if (now < reference) {
         SECMIN_DEBUG(sancus_debug1("_timer_callback: overflowed while executing callbacks. %i\n",
               timer_list_head != NULL));
@@ -658,10 +1262,19 @@ overflow:
 
     if (timer_list_head) {
         /* schedule callback on next timer target time */
-        next_target = timer_list_head->target - SECURE_MINTIMER_OVERHEAD;
+        next_target = _fire_time(timer_list_head);
+        uint32_t now = _secure_mintimer_lltimer_now();
+
+        /* the list head may lie just past the end of this period, so check
+         * for overflow here as well */
+        if (now < reference) {
+            _next_period();
+            reference = 0;
+            goto overflow;
+        }
     //     /* make sure we're not setting a time in the past */
     //     // LOG_ERROR("Marker 1. Target is %lu and now is %lu. Compared back-off %ul against next_target %u\n", timer_list_head->target, reference, _secure_mintimer_now() + SECURE_MINTIMER_ISR_BACKOFF, next_target);
-        if (next_target < (_secure_mintimer_now() + SECURE_MINTIMER_ISR_BACKOFF)) {
+        if (_period_offset(next_target) < (now + ISR_BACKOFF)) {
             goto overflow;
         }
     }
@@ -679,7 +1292,7 @@ overflow:
         }
         else {
             /* check if the end of this period is very soon */
-            if (_secure_mintimer_lltimer_mask(now + SECURE_MINTIMER_ISR_BACKOFF) < now) {
+            if (_secure_mintimer_lltimer_mask(now + ISR_BACKOFF) < now) {
                 /* spin until next period, then advance */
                 while (_secure_mintimer_lltimer_now() >= now) {}
                 _next_period();
@@ -698,6 +1311,65 @@ overflow:
     TIMER_BASE->CTL &= ~(TIMER_CTL_IFG);
 }
 
+#ifdef SECURE_MINTIMER_CALIBRATE
+/**
+ * @brief measure the backoffs on this device
+ *
+ * ISR_BACKOFF has to cover arming the low-level timer for the next head and
+ * getting from the timer ISR into the callback again. Arming is measured here,
+ * the way into the callback by _calibrate_isr() on every timer interrupt.
+ * BACKOFF has to cover a whole _secure_mintimer_set_absolute() of a timer.
+ * Both are taken as twice the largest cost seen.
+ */
+static void SM_FUNC(sancus_sm_timer) _calibrate(void)
+{
+    secure_mintimer_t probe = { .thread = NULL, .callback = NULL };
+    uint16_t isr_cost = 0;
+    uint16_t cost = 0;
+
+    for (unsigned i = 0; i < SECURE_MINTIMER_CALIBRATE_ROUNDS; i++) {
+        uint16_t start = _secure_mintimer_lltimer_now();
+        timer_list_head = _wheel_first();
+        _lltimer_set(0xFFFFFFFF);
+        uint16_t elapsed = _secure_mintimer_lltimer_mask(_secure_mintimer_lltimer_now() - start);
+        if (elapsed > isr_cost) {
+            isr_cost = elapsed;
+        }
+    }
+
+    for (unsigned i = 0; i < SECURE_MINTIMER_CALIBRATE_ROUNDS; i++) {
+        /* far enough ahead to be armed like any other timer */
+        uint32_t target = _secure_mintimer_now() + (_secure_mintimer_lltimer_mask(0xFFFFFFFF) >> 1);
+        uint16_t start = _secure_mintimer_lltimer_now();
+        _secure_mintimer_set_absolute(&probe, target);
+        uint16_t elapsed = _secure_mintimer_lltimer_mask(_secure_mintimer_lltimer_now() - start);
+        secure_mintimer_remove(&probe);
+        if (elapsed > cost) {
+            cost = elapsed;
+        }
+    }
+
+    _isr_arm_cost = isr_cost;
+    _isr_backoff = 2 * isr_cost + 1;
+    _backoff = 2 * cost + 1;
+}
+
+/**
+ * @brief grow ISR_BACKOFF to the latency of the current timer interrupt
+ *
+ * The ISR stamps the timer at its entry, so everything up to here is measured:
+ * interrupt entry, the violation check, the context save and the dispatch.
+ */
+static inline void SM_FUNC(sancus_sm_timer) _calibrate_isr(void)
+{
+    uint16_t latency = sm_timer_isr_latency;
+
+    if (latency && 2 * (latency + _isr_arm_cost) + 1 > _isr_backoff) {
+        _isr_backoff = 2 * (latency + _isr_arm_cost) + 1;
+    }
+}
+#endif
+
 /**
  * From old secure_mintimer.c
  * */
@@ -708,36 +1380,165 @@ overflow:
 //     mutex_unlock(mutex);
 // }
 
-void SM_FUNC(sancus_sm_timer) _secure_mintimer_tsleep_specific_pid(uint32_t offset, kernel_pid_t pid){
-    SECMIN_DEBUG(sancus_debug1("timer sleep called with %lu offset", offset));
+static void SM_FUNC(sancus_sm_timer) _mutex_timeout(void *arg)
+{
+    thread_t *thread = (thread_t *)arg;
+
+    // Only time out if the thread is still waiting, it may have been woken
+    // up by an unlock already. The owner drops the priority the thread lent.
+    if (thread->mutex_wait == NULL || !mutex_remove_waiter(thread->mutex_wait, thread)) {
+        return;
+    }
+
+    sched_set_status(thread, STATUS_PENDING);
+}
+
+/**
+ * @brief Gives back the timeout timer of @p thread, if it has one
+ */
+static void SM_FUNC(sancus_sm_timer) _mutex_timeout_free(thread_t *thread)
+{
+    for (unsigned i = 0; i < SECURE_MINTIMER_POOL_SIZE; i++) {
+        if (secure_mintimer_pool[i].thread == thread
+            && secure_mintimer_pool[i].callback == _mutex_timeout) {
+            secure_mintimer_free(&secure_mintimer_pool[i]);
+            return;
+        }
+    }
+}
+
+int SM_ENTRY(sancus_sm_timer) _secure_mintimer_mutex_lock_timeout(unsigned id, uint32_t us)
+{
+    thread_t *me = (thread_t *)sched_active_thread;
+    mutex_t *mutex = mutex_get(id);
+
+    if (me == NULL || me->status != STATUS_RUNNING || mutex == NULL
+        || (mutex->queue.next != NULL && mutex->owner == me->pid)) {
+        return -1;
+    }
+    if (_mutex_lock_internal(mutex, me, 0)) {
+        return 0;
+    }
+    // Periodic threads are released by the timer, they can not block
+    if (us == 0 || me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        return -1;
+    }
+
+    secure_mintimer_t *timer = secure_mintimer_alloc(me);
+    if (timer == NULL) {
+        return -1;
+    }
+
+    // Queued first, so a timeout that fires right away still finds the thread
+    _mutex_lock_internal(mutex, me, 1);
+    timer->callback = _mutex_timeout;
+    timer->arg = me;
+    uint64_t ticks = _secure_mintimer_ticks_from_usec64(us);
+    _secure_mintimer_set64(timer, (uint32_t)ticks, (uint32_t)(ticks >> 32));
+    return MUTEX_BLOCKED;
+}
+
+int SM_ENTRY(sancus_sm_timer) _secure_mintimer_mutex_wait(unsigned id)
+{
+    thread_t *me = (thread_t *)sched_active_thread;
+    mutex_t *mutex = mutex_get(id);
 
+    if (me == NULL || mutex == NULL) {
+        return -1;
+    }
+    if (me->status == STATUS_MUTEX_BLOCKED) {
+        return MUTEX_BLOCKED;
+    }
+
+    // Woken by the unlock or the timeout, the timer is not needed anymore
+    _mutex_timeout_free(me);
+    return (mutex->queue.next != NULL && mutex->owner == me->pid) ? 0 : -1;
+}
 
-    // Look for an empty timer to use
-    secure_mintimer_t* timer = get_available_timer(pid);
+int secure_mintimer_mutex_lock_timeout(unsigned id, uint32_t us)
+{
+    int res = _secure_mintimer_mutex_lock_timeout(id, us);
+    while (res == MUTEX_BLOCKED) {
+        thread_yield_higher();
+        res = _secure_mintimer_mutex_wait(id);
+    }
+    return res;
+}
+
+#ifdef MODULE_CORE_THREAD_FLAGS
+static void SM_FUNC(sancus_sm_timer) _set_timeout_flag_callback(void *arg)
+{
+    thread_t *thread = (thread_t *)arg;
+
+    thread_flags_set_internal(thread, THREAD_FLAG_TIMEOUT);
+}
+
+void SM_FUNC(sancus_sm_timer) secure_mintimer_set_timeout_flag(secure_mintimer_t *t, uint32_t timeout)
+{
+    thread_t *me = (thread_t *)sched_active_thread;
+
+    t->callback = _set_timeout_flag_callback;
+    t->arg = me;
+    me->flags &= ~THREAD_FLAG_TIMEOUT;
+    _secure_mintimer_set(t, _secure_mintimer_ticks_from_usec(timeout));
+}
+#endif
+
+int SM_ENTRY(sancus_sm_timer) secure_mintimer_set_sleep_slack(uint16_t slack)
+{
+    /* may be called before the scheduler runs a thread */
+    if (sched_active_thread == NULL) {
+        return -EINVAL;
+    }
+
+    kernel_pid_t pid = sched_active_thread->pid;
+    secure_mintimer_t *timer = secure_mintimer_from_handle(_wakeup_handle[pid]);
+
+    if (timer == NULL) {
+        /* no wakeup timer yet, so there is no pending wakeup to lose */
+        timer = secure_mintimer_wakeup_timer(pid);
+        if (timer == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    secure_mintimer_set_slack(timer, slack);
+    return 0;
+}
+
+static void SM_FUNC(sancus_sm_timer) _tsleep(uint32_t offset, uint32_t long_offset, kernel_pid_t pid){
+    SECMIN_DEBUG(sancus_debug2("timer sleep called with %lu offset, %lu long offset", offset, long_offset));
+
+
+    // Use the wakeup timer of this thread
+    secure_mintimer_t* timer = secure_mintimer_wakeup_timer(pid);
     
     if(timer == NULL){
         SECMIN_DEBUG(sancus_debug("timer sleep: Found no empty timer, not sleeping."));
     } else {
         // Set the active status to sleeping and set the timer 
         timer->target = timer->long_target = 0;
-        timer->thread = &sched_threads[pid];
         sched_set_status(timer->thread, STATUS_SLEEPING);
-        _secure_mintimer_set(timer, offset);
+        _secure_mintimer_set64(timer, offset, long_offset);
     }
 
 }
 
-void SM_FUNC(sancus_sm_timer) _secure_mintimer_tsleep_internal(uint32_t offset){
-    _secure_mintimer_tsleep_specific_pid(offset, sched_active_thread->pid);
+void SM_FUNC(sancus_sm_timer) _secure_mintimer_tsleep_specific_pid(uint32_t offset, kernel_pid_t pid){
+    _tsleep(offset, 0, pid);
+}
+
+void SM_FUNC(sancus_sm_timer) _secure_mintimer_tsleep_internal(uint32_t offset, uint32_t long_offset){
+    _tsleep(offset, long_offset, sched_active_thread->pid);
 }
 
-void _secure_mintimer_tsleep(USED_IN_ASM uint32_t offset, uint32_t long_offset)
+void _secure_mintimer_tsleep(USED_IN_ASM uint32_t offset, USED_IN_ASM uint32_t long_offset)
 {
-    // We ignore long offset for now.
-    // Consider adding a long_offset timer by setting it up in the scheduler first.
-    if(long_offset != 0){
-        LOG_WARNING("Secure Mintimer sleep: Ignoring long offset\n");
-    }
+    // The long offset is passed in r9 and r8, keep the values of the caller
+    __asm__("push r8");
+    __asm__("push r9");
+    __asm__("mov r13, r9");
+    __asm__("mov r12, r8");
 
     // move offset into r13 and r12
     __asm__("mov r15, r13");
@@ -746,5 +1547,8 @@ void _secure_mintimer_tsleep(USED_IN_ASM uint32_t offset, uint32_t long_offset)
     // perform a full save context and exitless call
     ___MACRO_EXITLESS_CALL_WITH_RESUME(EXITLESS_FUNCTION_TYPE_SLEEP)
 
+    __asm__("pop r9");
+    __asm__("pop r8");
+
     return;
 }
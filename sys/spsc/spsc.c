@@ -0,0 +1,97 @@
+/*
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     sys_spsc
+ * @{
+ *
+ * @file
+ * @brief       Wake-on-data notifications for shared memory channels
+ *
+ * @}
+ */
+
+#include <errno.h>
+#include "spsc.h"
+#include "sched.h"
+#include "thread.h"
+
+// Ids of applications and the reserved ones of system drivers
+#define SPSC_NOTIFY_IDS (SPSC_NOTIFY_NUMOF + SPSC_NOTIFY_RESERVED)
+
+typedef struct {
+    kernel_pid_t waiter;    // thread blocked on the id, KERNEL_PID_UNDEF if none
+    uint8_t pending;        // notified while nobody waited
+} spsc_notify_t;
+
+SM_DATA(sancus_sm_timer) static spsc_notify_t spsc_notify_ids[SPSC_NOTIFY_IDS];
+
+int SM_ENTRY(sancus_sm_timer) spsc_notify(unsigned id)
+{
+    if (id >= SPSC_NOTIFY_IDS) {
+        return -EINVAL;
+    }
+
+    spsc_notify_t *n = &spsc_notify_ids[id];
+    if (n->waiter == KERNEL_PID_UNDEF
+        || sched_threads[n->waiter].status != STATUS_CHAN_BLOCKED) {
+        n->pending = 1;
+        return 1;
+    }
+
+    thread_t *waiter = &sched_threads[n->waiter];
+    n->waiter = KERNEL_PID_UNDEF;
+    sched_set_status(waiter, STATUS_PENDING);
+    if (sched_active_thread == NULL) {
+        return 1;
+    }
+    // Only request the switch, the caller yields if we return 2
+    sched_switch_internal_allow_yield(waiter->priority, false);
+    return sched_context_switch_request ? 2 : 1;
+}
+
+int SM_ENTRY(sancus_sm_timer) _spsc_wait(unsigned id)
+{
+    thread_t *me = (thread_t *)sched_active_thread;
+
+    if (id >= SPSC_NOTIFY_IDS || me == NULL || me->status != STATUS_RUNNING) {
+        return -EINVAL;
+    }
+
+    spsc_notify_t *n = &spsc_notify_ids[id];
+    if (n->pending) {
+        n->pending = 0;
+        return 1;
+    }
+    if (n->waiter != KERNEL_PID_UNDEF && n->waiter != me->pid) {
+        return -EBUSY;
+    }
+    // Periodic threads are released by the timer, a yield ends their job
+    if (me->priority == SCHED_PERIODIC_PRIO_LEVEL) {
+        return 0;
+    }
+
+    n->waiter = me->pid;
+    sched_set_status(me, STATUS_CHAN_BLOCKED);
+    return SPSC_BLOCKED;
+}
+
+void SM_FUNC(sancus_sm_timer) spsc_thread_exit(kernel_pid_t pid)
+{
+    for (unsigned id = 0; id < SPSC_NOTIFY_IDS; id++) {
+        if (spsc_notify_ids[id].waiter == pid) {
+            spsc_notify_ids[id].waiter = KERNEL_PID_UNDEF;
+        }
+    }
+}
+
+uint16_t spsc_wait(spsc_t *c)
+{
+    if (spsc_avail(c) == 0 && _spsc_wait(c->notify) == SPSC_BLOCKED) {
+        thread_yield_higher();
+    }
+    return spsc_avail(c);
+}
@@ -27,38 +27,33 @@
  * @}
  */
 
-#include <errno.h>
-
 #include "stdio_uart.h"
 
 #include "board.h"
-#include "periph/uart.h"
+// The board driver of the Sancus support library, not periph/uart.h
+#include "uart.h"
 
 #define ENABLE_DEBUG 0
 #include "debug.h"
 
 void stdio_init(void)
 {
-    uart_rx_cb_t cb;
-    void *arg;
-
-
-    cb = NULL;
-    arg = NULL;
-
-    uart_init(STDIO_UART_DEV, STDIO_UART_BAUDRATE, cb, arg);
-
+    // board_init() already brought up the UART and its rings
+#ifdef STDIO_UART_LINE_MODE
+    uart_set_line_mode(1);
+#endif
 }
 
 ssize_t stdio_read(void* buffer, size_t count)
 {
-    (void)buffer;
-    (void)count;
-    return -ENOTSUP;
+    // Blocks in the scheduler until input is there, then takes all of it
+    // that fits. In line mode only whole lines are returned.
+    return uart_read_some((unsigned char *)buffer, count);
 }
 
 ssize_t stdio_write(const void* buffer, size_t len)
 {
-    uart_write(STDIO_UART_DEV, (const uint8_t *)buffer, len);
+    // Only copies into the transmit ring, waits only while it is full
+    uart_write((const unsigned char *)buffer, len);
     return len;
 }